@@ -0,0 +1,56 @@
+#!/bin/sh
+
+# ============================================================================
+# Input Validation
+
+if [ "$#" -ne 1 ] || { [ "$1" != "Rel" ] && [ "$1" != "Deb" ]; }; then
+	echo "ERROR: Incorrect usage, use as follows:"
+	echo "build_linux_x64.sh (Rel|Deb)"
+	exit 1
+fi
+
+# ============================================================================
+# Build
+
+# Only the headless runner (and the scan line rendering benchmark) is built on
+# Linux. The SDL/ImGui frontend in main.cpp is Windows-only (see
+# build_win_x64.bat).
+ExeName=gb_headless
+BenchExeName=gb_bench_render
+
+# Use whatever C compiler is set in CC, defaults to the system compiler.
+Compiler=${CC:-cc}
+
+CodeFiles="../code/headless.c ../code/gb.c"
+BenchCodeFiles="../code/bench_render.c"  # Includes gb.c
+
+# -Wno-parentheses and -Wno-type-limits: GCC is chattier than Clang about a
+# few spots in gb.c that Clang (which build_win_x64.bat uses) doesn't mind.
+CompilerFlags="-std=c11 -Wall -Wextra -Wno-unused-parameter -Wno-missing-field-initializers -Wno-parentheses -Wno-type-limits"
+LinkerFlags="-lm"
+# -march=native is fine here, the binary is meant to run on the machine that
+# builds it (e.g., a build farm node).
+RelCompilerFlags="-DNDEBUG -O3 -march=native -Wno-unused-function -Wno-unused-but-set-variable"
+DebCompilerFlags="-g -O0"
+
+if [ "$1" = "Rel" ]; then
+	CompilerFlags="$CompilerFlags $RelCompilerFlags"
+else
+	CompilerFlags="$CompilerFlags $DebCompilerFlags"
+fi
+
+cd "$(dirname "$0")" || exit 1
+mkdir -p build
+cd build || exit 1
+
+StartTime=$(date +%T.%N)
+set -x
+$Compiler -o $ExeName $CompilerFlags $CodeFiles $LinkerFlags &&
+	$Compiler -o $BenchExeName $CompilerFlags $BenchCodeFiles $LinkerFlags
+{ Result=$?; set +x; } 2>/dev/null
+EndTime=$(date +%T.%N)
+
+echo "Start time: $StartTime"
+echo "End time:   $EndTime"
+
+exit $Result
@@ -28,6 +28,7 @@ rem ============================================================================
 rem Build
 
 set ExeName=gb.exe
+set HeadlessExeName=gb_headless.exe
 
 set SdlDir=..\external\SDL2-2.0.14
 set SdlLibs=%SdlDir%\lib\x64\SDL2.lib %SdlDir%\lib\x64\SDL2main.lib
@@ -44,6 +45,8 @@ set ImguiDir=..\external\imgui
 
 rem A unity build is faster than listing required ImGui files.
 set CodeFiles=..\code\main.cpp ..\code\gb.c ..\code\imgui_unity_build.cpp
+rem The headless runner only needs the core, no SDL and no ImGui.
+set HeadlessCodeFiles=..\code\headless.c ..\code\gb.c
 
 rem -Wno-language-extension-token is used to prevent clang from complaining about
 rem `typedef unsigned __int64 uint64_t` (and the like) in SDL headers.
@@ -58,6 +61,9 @@ set ClangCompilerFlags=-o %ExeName% -I%SdlDir% -I..\external -I%SdlDir%\SDL2 -I%
 rem -fuse-ld=lld Use clang lld linker instead of msvc link.
 rem /SUBSYSTEM:console warns about both main and wmain being present.
 set ClangLinkerFlags=-fuse-ld=lld -Xlinker /INCREMENTAL:NO -Xlinker /OPT:REF -Xlinker /SUBSYSTEM:windows -lShell32 -lOpenGL32 -lComdlg32 %SdlLibs%
+rem The headless runner is pure C and runs in the terminal.
+set ClangHeadlessCompilerFlags=-o %HeadlessExeName% -std=c11 -Wall -Werror -Wextra -pedantic-errors -Wno-unused-parameter -Wno-unused-but-set-variable -Wno-missing-field-initializers
+set ClangHeadlessLinkerFlags=-fuse-ld=lld -Xlinker /INCREMENTAL:NO -Xlinker /OPT:REF -Xlinker /SUBSYSTEM:console
 set ClangRelCompilerFlags=-DNDEBUG -O3 -Wno-unused-function
 rem See on ASAN below in Msvc build steps (-fsanitize=address)
 set ClangDebCompilerFlags=-g
@@ -72,6 +78,8 @@ rem /wd4201 Disable warning about anonymous structs/unions, it's allowed in C11
 rem See note under 'Clang' about duplicate include dirs.
 set MsvcCompilerFlags=/Zi /FC /Fe%ExeName% /I%SdlDir% /I../external /I%SdlDir%/SDL2 /I../external/imgui /std:c11 /WX /W4 /WL /GR- /EHa- /wd4201
 set MsvcLinkerFlags=/link /INCREMENTAL:NO /SUBSYSTEM:windows /NOLOGO %SdlLibs% Shell32.lib OpenGL32.lib Comdlg32.lib
+set MsvcHeadlessCompilerFlags=/Zi /FC /Fe%HeadlessExeName% /std:c11 /WX /W4 /WL /GR- /EHa- /wd4201
+set MsvcHeadlessLinkerFlags=/link /INCREMENTAL:NO /SUBSYSTEM:console /NOLOGO
 rem /Zo Generates enhanced debugging information for optimized code.
 rem /Oi Generates intrinsic functions.
 rem /GL Whole program optimization
@@ -89,10 +97,13 @@ if "%1" equ "Clang" (
 	set Compiler=clang
 	if "%2" equ "Rel" (
 		set CompilerFlags=%ClangCompilerFlags% %ClangRelCompilerFlags%
+		set HeadlessCompilerFlags=%ClangHeadlessCompilerFlags% %ClangRelCompilerFlags%
 	) else (
 		set CompilerFlags=%ClangCompilerFlags% %ClangDebCompilerFlags%
+		set HeadlessCompilerFlags=%ClangHeadlessCompilerFlags% %ClangDebCompilerFlags%
 	)
 	set LinkerFlags=%ClangLinkerFlags%
+	set HeadlessLinkerFlags=%ClangHeadlessLinkerFlags%
 ) else (
 	rem NOTE: You can actually use clang-cl here if you remove /std:c11 and /WL.
 	rem But then it will use the MS toolchain for linking (I think).
@@ -100,9 +111,13 @@ if "%1" equ "Clang" (
 	if "%2" equ "Rel" (
 		set CompilerFlags=%MsvcCompilerFlags% %MsvcRelCompilerFlags%
 		set LinkerFlags=%MsvcLinkerFlags% %MsvcRelLinkerFlags%
+		set HeadlessCompilerFlags=%MsvcHeadlessCompilerFlags% %MsvcRelCompilerFlags%
+		set HeadlessLinkerFlags=%MsvcHeadlessLinkerFlags% %MsvcRelLinkerFlags%
 	) else (
 		set CompilerFlags=%MsvcCompilerFlags% %MsvcDebCompilerFlags%
 		set LinkerFlags=%MsvcLinkerFlags% %MsvcDebLinkerFlags%
+		set HeadlessCompilerFlags=%MsvcHeadlessCompilerFlags% %MsvcDebCompilerFlags%
+		set HeadlessLinkerFlags=%MsvcHeadlessLinkerFlags% %MsvcDebLinkerFlags%
 	)
 )
 
@@ -113,6 +128,7 @@ copy "%SdlDir%\lib\x64\SDL2.dll" .
 set StartTime=%time%
 echo on
 %Compiler% %CompilerFlags% %CodeFiles% %LinkerFlags%
+%Compiler% %HeadlessCompilerFlags% %HeadlessCodeFiles% %HeadlessLinkerFlags%
 @echo off
 set EndTime=%time%
 popd
@@ -0,0 +1,133 @@
+// Copyright (C) 2022 Stefan Lienhard
+
+// Micro benchmark for the scan line renderer.
+//
+// Renders frames of random tile data, tile maps, and sprites with different
+// LCDC settings and reports the average cost per scan line. Includes 'gb.c'
+// directly to get at the internal gb__RenderScanLine, so the same file can be
+// built against older versions of 'gb.c' to compare before and after.
+// Build with different GB_SIMD values to compare the compositing paths:
+//
+//     ./build_linux_x64.sh Rel && build/gb_bench_render
+//     CC="cc -DGB_SIMD=0" ./build_linux_x64.sh Rel && build/gb_bench_render
+
+#include "gb.c"
+
+#include <time.h>
+
+// xorshift32, deterministic so that the checksums are comparable between builds.
+static uint32_t
+Random(uint32_t *state)
+{
+	uint32_t x = *state;
+	x ^= x << 13u;
+	x ^= x >> 17u;
+	x ^= x << 5u;
+	*state = x;
+	return x;
+}
+
+static double
+WallTimeInS(void)
+{
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+typedef struct Scenario
+{
+	const char *name;
+	uint8_t lcdc;
+	bool layers;  // See gb_SetLayers
+} Scenario;
+
+int
+main(void)
+{
+	gb_GameBoy *gb = (gb_GameBoy *)calloc(1, sizeof(gb_GameBoy));
+	// Like gb_Reset, scan lines only write the colors if their shades change.
+	for (size_t i = 0; i < GB_FRAMEBUFFER_WIDTH * GB_FRAMEBUFFER_HEIGHT; ++i)
+	{
+		gb->display.pixels[i] = gb__DefaultPalette[0];
+	}
+
+	uint32_t rng = 0x12345678u;
+	for (uint16_t i = 0; i < sizeof(gb->memory.vram); ++i)
+	{
+		gb->memory.vram[i] = (uint8_t)Random(&rng);
+		gb__UpdateDecodedTiles(gb, i);
+	}
+	for (size_t i = 0; i < sizeof(gb->memory.oam.bytes); ++i)
+	{
+		gb->memory.oam.bytes[i] = (uint8_t)Random(&rng);
+	}
+
+	gb->ppu.scx = 3;
+	gb->ppu.scy = 100;
+	gb->ppu.wx = 60;
+	gb->ppu.wy = 40;
+	gb->ppu.bgp = 0xE4;
+	gb->ppu.obp0 = 0xD2;
+	gb->ppu.obp1 = 0x1B;
+
+	// LCDC bits: 0x01 BG & window, 0x02 sprites, 0x04 8x16 sprites, 0x20 window
+	const Scenario scenarios[] = {
+		{ "BG", 0x81, false },
+		{ "BG + window", 0xA1, false },
+		{ "BG + window + sprites", 0xA3, false },
+		{ "BG + window + 8x16 sprites", 0xA7, false },
+		{ "Sprites only", 0x82, false },
+		{ "BG, layers", 0x81, true },
+		{ "BG + window, layers", 0xA1, true },
+		{ "BG + window + sprites, layers", 0xA3, true },
+	};
+	static gb_Layers layers;
+	// The fastest of several runs is reported, it's the least disturbed by
+	// whatever else is running on the machine.
+	const int num_runs = 20;
+	const int num_frames_per_run = 100;
+
+	printf("GB_SIMD = %i\n", GB_SIMD);
+	for (size_t s = 0; s < sizeof(scenarios) / sizeof(scenarios[0]); ++s)
+	{
+		gb->ppu.lcdc.reg = scenarios[s].lcdc;
+		gb_SetLayers(gb, scenarios[s].layers ? &layers : NULL);
+
+		double best_s = 1e9;
+		for (int run = 0; run < num_runs; ++run)
+		{
+			const double start_time = WallTimeInS();
+			for (int frame = 0; frame < num_frames_per_run; ++frame)
+			{
+				gb->ppu.ly_win_internal = 0;
+				gb->memory.sprite_buckets.valid = false;  // Games usually DMA new sprites every frame.
+				for (uint8_t ly = 0; ly < GB_FRAMEBUFFER_HEIGHT; ++ly)
+				{
+					gb->ppu.ly = ly;
+					gb__RenderScanLine(gb);
+				}
+			}
+			const double elapsed_s = WallTimeInS() - start_time;
+			if (elapsed_s < best_s)
+			{
+				best_s = elapsed_s;
+			}
+		}
+
+		// 64-bit FNV-1a of the last frame.
+		uint64_t hash = 0xCBF29CE484222325ull;
+		const uint8_t *bytes = (const uint8_t *)gb->display.pixels;
+		for (size_t i = 0; i < sizeof(gb->display.pixels); ++i)
+		{
+			hash ^= bytes[i];
+			hash *= 0x100000001B3ull;
+		}
+
+		printf("%-30s %8.1f ns/line  (hash %016llX)\n", scenarios[s].name,
+				best_s * 1e9 / ((double)num_frames_per_run * GB_FRAMEBUFFER_HEIGHT), (unsigned long long)hash);
+	}
+
+	free(gb);
+	return 0;
+}
@@ -1,11 +1,24 @@
 // Copyright (C) 2022 Stefan Lienhard
 
+#if defined(GB_JIT) && GB_JIT
+#define _DEFAULT_SOURCE  // For MAP_ANONYMOUS in C11 mode.
+#endif
+
 #include "gb.h"
 #include <assert.h>
 #include <math.h>  // TODO(stefalie): Only used for fabs, consider removing.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>  // MSVC's C11 atomics are still experimental.
+#else
+#include <stdatomic.h>
+#endif
+#if GB_JIT
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
@@ -13,6 +26,68 @@
 
 #define BLARGG_TEST_ENABLE 0
 
+// Enables the JIT (see gb_CreateJit), x86-64 Linux only.
+#ifndef GB_JIT
+#define GB_JIT 0
+#endif
+
+// Selects how the CPU dispatches opcodes:
+// 0: gb_FetchInstruction decodes the instruction which is then executed by
+//    one big switch statement.
+// 1: A table of 256 + 256 handler functions indexed by the opcode. Each
+//    handler fetches its own operands. The handlers are generated from the
+//    switch statements (by inlining them with a constant opcode), so both
+//    variants share the same instruction implementations.
+// Can be set from the command line (e.g., -DGB_DISPATCH_TABLE=1) for
+// benchmarking. The JIT calls the handlers and therefore requires the table.
+#ifndef GB_DISPATCH_TABLE
+#define GB_DISPATCH_TABLE GB_JIT
+#endif
+
+// Computes the CPU flags only when they are read instead of after every
+// arithmetic instruction (see 'struct gb_LazyFlags').
+#ifndef GB_LAZY_FLAGS
+#define GB_LAZY_FLAGS 1
+#endif
+
+// Selects the instruction set used to composite scan lines (see
+// gb__CompositeScanLine):
+// 0: Plain C.
+// 1: SSE2 (uses SSSE3 byte shuffles if the compiler targets SSSE3).
+// 2: AVX2.
+// Defaults to the widest one the compiler targets.
+#ifndef GB_SIMD
+#if defined(__AVX2__)
+#define GB_SIMD 2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define GB_SIMD 1
+#else
+#define GB_SIMD 0
+#endif
+#endif
+
+#if GB_SIMD >= 2
+#include <immintrin.h>
+#elif GB_SIMD >= 1
+#include <emmintrin.h>
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+#endif
+
+#if GB_JIT && !GB_DISPATCH_TABLE
+#error "GB_JIT requires GB_DISPATCH_TABLE"
+#endif
+#if GB_JIT && !(defined(__linux__) && defined(__x86_64__))
+#error "GB_JIT is only supported on x86-64 Linux"
+#endif
+
+#if defined(_MSC_VER)
+#define GB__FORCE_INLINE __forceinline
+#else
+#define GB__FORCE_INLINE inline __attribute__((always_inline))
+#endif
+
 // Palette from bgb
 static const gb_Color gb__DefaultPalette[4] = {
 	{ .r = 0xE8, .g = 0xFC, .b = 0xCC },
@@ -83,6 +158,126 @@ gb__GetHeader(const gb_GameBoy *gb)
 	return (gb__RomHeader *)&(gb->rom.data[ROM_HEADER_START_ADDRESS]);
 }
 
+// Resolves the ROM banks mapped to [0x0000, 0x4000) and [0x4000, 0x8000) and
+// rebuilds the page tables (see 'struct gb_Memory').
+// Needs to be called whenever the MBC registers, the BIOS mapping, or the ROM
+// pointer change.
+static void
+gb__UpdateMemoryMap(gb_GameBoy *gb)
+{
+	struct gb_Memory *mem = &gb->memory;
+
+	const uint8_t rom_size = MIN(gb__GetHeader(gb)->rom_size, 6);
+	const uint8_t num_rom_banks = 2u << rom_size;
+	assert(num_rom_banks < 128);
+	// Mask away unused bits.
+	const uint8_t mask = num_rom_banks - 1;
+
+	uint8_t bank0 = 0;
+	if (mem->mbc_type == GB_MBC_TYPE_1 && mem->mbc1.bank_mode == 1)
+	{
+		bank0 = (mem->mbc1.ram_bank << 5u) & mask;
+	}
+
+	uint8_t bank = 0;
+	if (mem->mbc_type == GB_MBC_TYPE_ROM_ONLY)
+	{
+		bank = 1;
+	}
+	else if (mem->mbc_type == GB_MBC_TYPE_1)
+	{
+		// 0 -> 1 transition
+		uint8_t lower_bits = mem->mbc1.rom_bank;
+		if (lower_bits == 0)
+		{
+			lower_bits = 1;
+		}
+		bank = lower_bits + (mem->mbc1.ram_bank << 5u);
+		bank &= mask;
+	}
+	else if (mem->mbc_type == GB_MBC_TYPE_2)
+	{
+		bank = MAX(mem->mbc2.rom_bank, 1);
+		assert(bank < 16);
+		assert(rom_size <= 3);
+	}
+	else if (mem->mbc_type == GB_MBC_TYPE_3)
+	{
+		bank = MAX(mem->mbc3.rom_bank, 1);
+	}
+	assert(bank < num_rom_banks);
+
+	const size_t bank_size = 0x4000;
+	mem->rom_bank0 = gb->rom.data + bank0 * bank_size;
+	mem->rom_bankx = gb->rom.data + bank * bank_size;
+
+	// External RAM, NULL if the accesses need special handling.
+	uint8_t *external_ram = NULL;
+	if (mem->mbc_type == GB_MBC_TYPE_ROM_ONLY)
+	{
+		external_ram = mem->external_ram;
+	}
+	else if (mem->mbc_type == GB_MBC_TYPE_1 && mem->mbc_external_ram_enable)
+	{
+		external_ram = mem->external_ram + (mem->mbc1.ram_bank << 13u);
+	}
+	else if (mem->mbc_type == GB_MBC_TYPE_3 && mem->mbc_external_ram_enable && mem->mbc3.rtc_mode_or_idx == 0)
+	{
+		external_ram = mem->external_ram + (mem->mbc3.ram_bank << 13u);
+	}
+
+	const size_t page_size = 0x1000;
+	for (size_t page = 0; page < 16; ++page)
+	{
+		const uint8_t *read = NULL;
+		uint8_t *write = NULL;
+
+		switch (page)
+		{
+		case 0x0:
+			// The BIOS only covers the first 256 bytes of the page.
+			read = mem->bios_mapped ? NULL : mem->rom_bank0;
+			break;
+		case 0x1:
+		case 0x2:
+		case 0x3:
+			read = mem->rom_bank0 + page * page_size;
+			break;
+		case 0x4:
+		case 0x5:
+		case 0x6:
+		case 0x7:
+			read = mem->rom_bankx + (page - 4) * page_size;
+			break;
+		case 0x8:
+		case 0x9:
+			// Writes need to update the decoded tiles.
+			read = mem->vram + (page - 8) * page_size;
+			break;
+		case 0xA:
+		case 0xB:
+			if (external_ram)
+			{
+				write = external_ram + (page - 0xA) * page_size;
+				read = write;
+			}
+			break;
+		case 0xC:
+		case 0xD:
+		case 0xE:  // Echo of (Internal) working RAM
+			write = mem->wram + ((page - 0xC) & 1) * page_size;
+			read = write;
+			break;
+		default:
+			// Echo of (Internal) working RAM, OAM, I/O, zero page
+			break;
+		}
+
+		mem->read_pages[page] = read;
+		mem->write_pages[page] = write;
+	}
+}
+
 // TODO(stefalie): Does stat blocking happen even if the LCD was previously disabled?
 static inline bool
 gb__LcdStatInt48Line(gb_GameBoy *gb)
@@ -116,6 +311,10 @@ gb__CompareLyToLyc(gb_GameBoy *gb, bool prev_int48_signal)
 	}
 }
 
+// Implemented next to the APU.
+static void
+gb__InitTables(void);
+
 bool
 gb_LoadRom(gb_GameBoy *gb, const uint8_t *rom, uint32_t num_bytes, bool skip_bios)
 {
@@ -206,10 +405,85 @@ gb_LoadRom(gb_GameBoy *gb, const uint8_t *rom, uint32_t num_bytes, bool skip_bio
 	}
 #endif
 
+	gb__InitTables();
 	gb_Reset(gb, skip_bios);
 	return false;
 }
 
+// Scheduler (see 'struct gb_Scheduler')
+//
+// The sync and schedule functions are implemented further below, next to the
+// functions that advance the PPU, the timer, and the APU.
+static void
+gb__SyncPpu(gb_GameBoy *gb);
+static void
+gb__SchedulePpu(gb_GameBoy *gb);
+static void
+gb__SyncTimer(gb_GameBoy *gb);
+static void
+gb__ScheduleTimer(gb_GameBoy *gb);
+static void
+gb__SyncApu(gb_GameBoy *gb);
+
+// Implemented next to the scan line renderer, see gb_SetDeferredRendering.
+static void
+gb__ComposeLoggedLines(gb_GameBoy *gb);
+// Implemented next to the APU.
+static void
+gb__EndAudioFrame(gb_GameBoy *gb);
+
+#define SCHEDULER_NEVER UINT64_MAX
+
+static inline void
+gb__SetDeadline(gb_GameBoy *gb, uint64_t *deadline, uint64_t value)
+{
+	*deadline = value;
+	gb->scheduler.next_event = MIN(gb->scheduler.next_event, value);
+}
+
+// Returns the period of TIMA increments in m-cycles.
+static inline uint16_t
+gb__TimerPeriod(const gb_GameBoy *gb)
+{
+	// The clock of the timer runs at a quarter of the m-clock.
+	static const uint16_t periods_in_m_cycles[4] = {
+		64 * 4,  // 4 kHz
+		1 * 4,  // 256 kHz
+		4 * 4,  // 64 kHz
+		16 * 4,  // 16 kHz
+	};
+	return periods_in_m_cycles[gb->timer.tac.clock_select];
+}
+
+// The timer lags behind the CPU. These return the values of DIV and TIMA as if
+// the timer had been advanced until now.
+static inline uint8_t
+gb__CurrentDiv(const gb_GameBoy *gb)
+{
+	const uint64_t lag = gb->scheduler.now - gb->scheduler.timer_last_sync;
+	if (gb->cpu.stop || lag == 0)
+	{
+		return gb->timer.div;
+	}
+	return gb__Hi((uint16_t)(gb->timer.t_clock + 4 * lag));
+}
+
+static inline uint8_t
+gb__CurrentTima(const gb_GameBoy *gb)
+{
+	const struct gb_Timer *timer = &gb->timer;
+	const uint64_t lag = gb->scheduler.now - gb->scheduler.timer_last_sync;
+	if (gb->cpu.stop || lag == 0 || !timer->tac.enable || timer->reset)
+	{
+		return timer->tima;
+	}
+
+	// The timer's deadline is the next overflow of TIMA, so there can't be one in between.
+	const uint64_t num_increments = (timer->remaining_m_cycles + lag) / gb__TimerPeriod(gb);
+	assert(timer->tima + num_increments <= 255);
+	return (uint8_t)(timer->tima + num_increments);
+}
+
 uint8_t
 gb_MemoryReadByte(const gb_GameBoy *gb, uint16_t addr)
 {
@@ -222,6 +496,13 @@ gb_MemoryReadByte(const gb_GameBoy *gb, uint16_t addr)
 	//   https://www.reddit.com/r/EmuDev/comments/5nixai/gb_tetris_writing_to_unused_memory/
 	const uint8_t undefined_value = 0xFF;
 
+	// Plain ROM/RAM accesses
+	const uint8_t *page = mem->read_pages[addr >> 12u];
+	if (page)
+	{
+		return page[addr & 0x0FFF];
+	}
+
 	switch (addr & 0xF000)
 	{
 	// ROM bank 0 or BIOS
@@ -235,56 +516,14 @@ gb_MemoryReadByte(const gb_GameBoy *gb, uint16_t addr)
 		}
 		else
 		{
-			size_t offset = 0;
-			if (mem->mbc_type == GB_MBC_TYPE_1 && mem->mbc1.bank_mode == 1)
-			{
-				offset = mem->mbc1.ram_bank << 19u;
-			}
-			return gb->rom.data[addr + offset];
+			return mem->rom_bank0[addr & 0x3FFF];
 		}
 	// Switchable ROM bank
 	case 0x4000:
 	case 0x5000:
 	case 0x6000:
-	case 0x7000: {
-		const uint8_t rom_size = MIN(gb__GetHeader(gb)->rom_size, 6);
-		const uint8_t num_rom_banks = 2u << rom_size;
-		assert(num_rom_banks < 128);
-
-		uint8_t bank = 0;
-		if (mem->mbc_type == GB_MBC_TYPE_ROM_ONLY)
-		{
-			bank = 1;
-		}
-		else if (mem->mbc_type == GB_MBC_TYPE_1)
-		{
-			// 0 -> 1 transition
-			uint8_t lower_bits = mem->mbc1.rom_bank;
-			if (lower_bits == 0)
-			{
-				lower_bits = 1;
-			}
-			bank = lower_bits + (mem->mbc1.ram_bank << 5u);
-
-			// Mask away unused bits.
-			const uint8_t mask = num_rom_banks - 1;
-			bank &= mask;
-		}
-		else if (mem->mbc_type == GB_MBC_TYPE_2)
-		{
-			bank = MAX(mem->mbc2.rom_bank, 1);
-			assert(bank < 16);
-			assert(rom_size <= 3);
-		}
-		else if (mem->mbc_type == GB_MBC_TYPE_3)
-		{
-			bank = MAX(mem->mbc3.rom_bank, 1);
-		}
-		assert(bank < num_rom_banks);
-
-		const uint16_t bank_size = 0x4000;
-		return gb->rom.data[bank * bank_size + (addr - bank_size)];
-	}
+	case 0x7000:
+		return mem->rom_bankx[addr & 0x3FFF];
 	// VRAM
 	// TODO(stefalie): VRAM/OAM is inaccessible during certain PPU modes.
 	// See: https://gbdev.io/pandocs/Rendering.html
@@ -311,7 +550,7 @@ gb_MemoryReadByte(const gb_GameBoy *gb, uint16_t addr)
 				const uint8_t ram_size = gb__GetHeader(gb)->ram_size;
 				(void)ram_size;
 				assert(mem->mbc1.ram_bank == 0 && ram_size == 2 || ram_size == 3);
-				return mem->external_ram[addr & 0x1FFF + (mem->mbc1.ram_bank << 13u)];
+				return mem->external_ram[(addr & 0x1FFF) + (mem->mbc1.ram_bank << 13u)];
 			}
 		}
 		else if (mem->mbc_type == GB_MBC_TYPE_2)
@@ -336,7 +575,7 @@ gb_MemoryReadByte(const gb_GameBoy *gb, uint16_t addr)
 					const uint8_t ram_size = gb__GetHeader(gb)->ram_size;
 					(void)ram_size;
 					assert(mem->mbc1.ram_bank == 0 && ram_size == 2 || ram_size == 3);
-					return mem->external_ram[addr & 0x1FFF + (mem->mbc3.ram_bank << 13u)];
+					return mem->external_ram[(addr & 0x1FFF) + (mem->mbc3.ram_bank << 13u)];
 				}
 				else
 				{
@@ -395,11 +634,11 @@ gb_MemoryReadByte(const gb_GameBoy *gb, uint16_t addr)
 			// Timer
 			else if (addr == 0xFF04)
 			{
-				return gb->timer.div;
+				return gb__CurrentDiv(gb);
 			}
 			else if (addr == 0xFF05)
 			{
-				return gb->timer.tima;
+				return gb__CurrentTima(gb);
 			}
 			else if (addr == 0xFF06)
 			{
@@ -650,6 +889,108 @@ gb__ClearApu(gb_GameBoy *gb)
 	gb->apu.ch4.volume_sweep.volume_timer = 2048;
 }
 
+typedef union gb__TileLine
+{
+	uint64_t line;
+	uint8_t pixels[8];
+} gb__TileLine;
+
+static gb__TileLine
+gb__Interleave(uint64_t mem_line1, uint64_t mem_line2)
+{
+	// mem_line1 = -------- -------- -------- -------- -------- -------- -------- 76543210
+	// mem_line2 = -------- -------- -------- -------- -------- -------- -------- FEDCBA98
+	//
+	// n         = 76543210 FEDCBA98 -------- -------- -------- -------- -------- -------- : After (1)
+	// n         = ----3210 ----BA98 -------- -------- ----7654 ----FEDC -------- -------- : After (2)
+	// n         = ------10 ------98 ------32 ------BA ------54 ------DC ------76 ------FE : After (3)
+	// n         = ------80 ------91 ------A2 ------B3 ------C4 ------D5 ------E6 ------F7 : After (3)
+
+	uint64_t n = (mem_line2 << 48) + (mem_line1 << 56);  // (1)
+	n = (n ^ (n >> 36)) & 0x0F0F00000F0F0000;  // (2)
+	n = (n ^ (n >> 18)) & 0x0303030303030303;  // (3)
+	n = (n & 0x0100010001000100) + ((n & 0x0200020002000200) >> 9) +  // (4)
+			(n & 0x0002000200020002) + ((n & 0x0001000100010001) << 9);
+
+	return (gb__TileLine){ .line = n };
+}
+
+// Decodes the tile line that contains the VRAM byte at 'vram_offset'.
+static inline void
+gb__UpdateDecodedTiles(gb_GameBoy *gb, uint16_t vram_offset)
+{
+	if (vram_offset < 0x1800)
+	{
+		struct gb_Memory *mem = &gb->memory;
+		const uint16_t line_offset = vram_offset & ~1u;
+		mem->decoded_tiles[vram_offset >> 4u][(vram_offset >> 1u) & 7u] =
+				gb__Interleave(mem->vram[line_offset], mem->vram[line_offset + 1]).line;
+	}
+}
+
+static void
+gb__MarkLayersDirty(gb_GameBoy *gb, uint16_t vram_offset)
+{
+	struct gb_LayerCache *cache = &gb->memory.layer_cache;
+	if (!cache->layers)
+	{
+		return;
+	}
+
+	if (vram_offset < 0x1800)
+	{
+		const uint16_t tile = vram_offset >> 4u;
+		cache->dirty_tiles[tile >> 3u] |= (uint8_t)(1u << (tile & 7u));
+	}
+	else
+	{
+		const uint16_t entry = vram_offset - 0x1800;  // Both maps
+		cache->dirty_map_entries[entry >> 3u] |= (uint8_t)(1u << (entry & 7u));
+	}
+	cache->dirty = true;
+}
+
+// Re-decodes all tile map entries of the layers that changed or point to a
+// tile that changed.
+static void
+gb__UpdateLayers(gb_GameBoy *gb)
+{
+	struct gb_LayerCache *cache = &gb->memory.layer_cache;
+	if (!cache->dirty)
+	{
+		return;
+	}
+	assert(cache->layers);
+
+	for (uint16_t entry = 0; entry < 2 * 1024; ++entry)
+	{
+		const uint8_t map_index = (uint8_t)(entry >> 10u);
+		const uint8_t tile_x = entry & 31u;
+		const uint8_t tile_y = (entry >> 5u) & 31u;
+		const uint8_t tile_idx = gb->memory.vram[0x1800 + entry];
+		const bool entry_dirty = cache->all_dirty || (cache->dirty_map_entries[entry >> 3u] >> (entry & 7u)) & 1u;
+
+		for (uint8_t address_mode = 0; address_mode < 2; ++address_mode)
+		{
+			// See gb__GetTileLine.
+			const int tile = address_mode == 0 ? 256 + (int8_t)tile_idx : tile_idx;
+			if (entry_dirty || (cache->dirty_tiles[tile >> 3u] >> (tile & 7u)) & 1u)
+			{
+				for (int y = 0; y < 8; ++y)
+				{
+					uint8_t *dst = &cache->layers->pixels[map_index][address_mode][tile_y * 8 + y][tile_x * 8];
+					memcpy(dst, &gb->memory.decoded_tiles[tile][y], 8);
+				}
+			}
+		}
+	}
+
+	cache->dirty = false;
+	cache->all_dirty = false;
+	memset(cache->dirty_tiles, 0, sizeof(cache->dirty_tiles));
+	memset(cache->dirty_map_entries, 0, sizeof(cache->dirty_map_entries));
+}
+
 static void
 gb__MemoryWriteByte(gb_GameBoy *gb, uint16_t addr, uint8_t value)
 {
@@ -657,6 +998,14 @@ gb__MemoryWriteByte(gb_GameBoy *gb, uint16_t addr, uint8_t value)
 
 	const uint8_t undefined_value = 0xFF;
 
+	// Plain RAM accesses
+	uint8_t *page = mem->write_pages[addr >> 12u];
+	if (page)
+	{
+		page[addr & 0x0FFF] = value;
+		return;
+	}
+
 	switch (addr & 0xF000)
 	{
 	// ROM bank selection
@@ -700,6 +1049,7 @@ gb__MemoryWriteByte(gb_GameBoy *gb, uint16_t addr, uint8_t value)
 				mem->mbc3.rom_bank = value;
 			}
 		}
+		gb__UpdateMemoryMap(gb);
 		break;
 	// RAM bank selection
 	case 0x4000:
@@ -724,6 +1074,7 @@ gb__MemoryWriteByte(gb_GameBoy *gb, uint16_t addr, uint8_t value)
 				assert(false);
 			}
 		}
+		gb__UpdateMemoryMap(gb);
 		break;
 	// ROM banking mode selection
 	case 0x6000:
@@ -738,6 +1089,7 @@ gb__MemoryWriteByte(gb_GameBoy *gb, uint16_t addr, uint8_t value)
 			// TODO(stefalie): RTC not suppored,
 			assert(false);
 		}
+		gb__UpdateMemoryMap(gb);
 		break;
 	// VRAM
 	// TODO(stefalie): VRAM/OAM is inaccessible during certain PPU modes.
@@ -750,7 +1102,10 @@ gb__MemoryWriteByte(gb_GameBoy *gb, uint16_t addr, uint8_t value)
 		// anyway (current status).
 		//
 		// assert(gb->ppu.stat.mode != GB_PPU_MODE_VRAM_SCAN || gb->ppu.lcdc.lcd_enable == 0);
+		gb__ComposeLoggedLines(gb);
 		mem->vram[addr & 0x1FFF] = value;
+		gb__UpdateDecodedTiles(gb, addr & 0x1FFF);
+		gb__MarkLayersDirty(gb, addr & 0x1FFF);
 		break;
 	// Switchable RAM bank
 	case 0xA000:
@@ -769,7 +1124,7 @@ gb__MemoryWriteByte(gb_GameBoy *gb, uint16_t addr, uint8_t value)
 				(void)ram_size;
 				assert(mem->mbc1.ram_bank == 0 && ram_size == 2 || ram_size == 3);
 #endif
-				mem->external_ram[addr & 0x1FFF + (mem->mbc1.ram_bank << 13u)] = value;
+				mem->external_ram[(addr & 0x1FFF) + (mem->mbc1.ram_bank << 13u)] = value;
 			}
 		}
 		else if (mem->mbc_type == GB_MBC_TYPE_2)
@@ -791,7 +1146,7 @@ gb__MemoryWriteByte(gb_GameBoy *gb, uint16_t addr, uint8_t value)
 					const uint8_t ram_size = gb__GetHeader(gb)->ram_size;
 					(void)ram_size;
 					assert(mem->mbc1.ram_bank == 0 && ram_size == 2 || ram_size == 3);
-					mem->external_ram[addr & 0x1FFF + (mem->mbc3.ram_bank << 13u)] = value;
+					mem->external_ram[(addr & 0x1FFF) + (mem->mbc3.ram_bank << 13u)] = value;
 				}
 				else
 				{
@@ -821,7 +1176,9 @@ gb__MemoryWriteByte(gb_GameBoy *gb, uint16_t addr, uint8_t value)
 			{
 				assert(gb->ppu.stat.mode == GB_PPU_MODE_HBLANK || gb->ppu.stat.mode == GB_PPU_MODE_VBLANK ||
 						gb->ppu.lcdc.lcd_enable == 0);
+				gb__ComposeLoggedLines(gb);
 				gb->memory.oam.bytes[addr & 0xFF] = value;
+				gb->memory.sprite_buckets.valid = false;
 			}
 			else
 			{
@@ -856,28 +1213,35 @@ gb__MemoryWriteByte(gb_GameBoy *gb, uint16_t addr, uint8_t value)
 				}
 			}
 			// Timer
-			else if (addr == 0xFF04)
-			{
-				// Writing any value resets this.
-				gb->timer.div = 0x00;
-			}
-			else if (addr == 0xFF05)
-			{
-				gb->timer.tima = value;
-			}
-			else if (addr == 0xFF06)
-			{
-				gb->timer.tma = value;
-			}
-			else if (addr == 0xFF07)
+			else if (addr >= 0xFF04 && addr <= 0xFF07)
 			{
-				const bool timer_prev_active = gb->timer.tac.enable == 1;
-				// Masking is probably not needed.
-				gb->timer.tac.reg = value & 0x07;
-				if (!timer_prev_active && (gb->timer.tac.enable == 1))
+				gb__SyncTimer(gb);
+
+				if (addr == 0xFF04)
+				{
+					// Writing any value resets this.
+					gb->timer.div = 0x00;
+				}
+				else if (addr == 0xFF05)
+				{
+					gb->timer.tima = value;
+				}
+				else if (addr == 0xFF06)
+				{
+					gb->timer.tma = value;
+				}
+				else if (addr == 0xFF07)
 				{
-					gb->timer.reset = true;
+					const bool timer_prev_active = gb->timer.tac.enable == 1;
+					// Masking is probably not needed.
+					gb->timer.tac.reg = value & 0x07;
+					if (!timer_prev_active && (gb->timer.tac.enable == 1))
+					{
+						gb->timer.reset = true;
+					}
 				}
+
+				gb__ScheduleTimer(gb);
 			}
 			// Interrupt request flags
 			else if (addr == 0xFF0F)
@@ -887,6 +1251,11 @@ gb__MemoryWriteByte(gb_GameBoy *gb, uint16_t addr, uint8_t value)
 			// Sound channels
 			else if (addr >= 0xFF10 && addr <= 0xFF3F)
 			{
+				// Catch up before anything changes. Triggers only take effect when the
+				// APU advances, make sure that happens at the end of this instruction.
+				gb__SyncApu(gb);
+				gb__SetDeadline(gb, &gb->scheduler.apu_deadline, gb->scheduler.now);
+
 				// Master control
 				if (addr == 0xFF26)
 				{
@@ -1019,9 +1388,15 @@ gb__MemoryWriteByte(gb_GameBoy *gb, uint16_t addr, uint8_t value)
 			else if (addr == 0xFF40)
 			{
 				struct gb_Ppu *ppu = &gb->ppu;
+				gb__SyncPpu(gb);
 
 				const uint8_t prev_lcd_enable = ppu->lcdc.lcd_enable;
+				const uint8_t prev_sprite_size = ppu->lcdc.sprite_size;
 				ppu->lcdc.reg = value;
+				if (ppu->lcdc.sprite_size != prev_sprite_size)
+				{
+					gb->memory.sprite_buckets.valid = false;
+				}
 				if (prev_lcd_enable == 1 && ppu->lcdc.lcd_enable == 0)
 				{
 					// Disable LCD
@@ -1042,6 +1417,12 @@ gb__MemoryWriteByte(gb_GameBoy *gb, uint16_t addr, uint8_t value)
 							gb->display.pixels[GB_FRAMEBUFFER_WIDTH * y + x] = gb__DefaultPalette[0];
 						}
 					}
+					memset(gb->display.shades, 0, sizeof(gb->display.shades));
+					gb->display.dirty_rows = (gb_RowRange){ .begin = 0, .end = GB_FRAMEBUFFER_HEIGHT };
+
+					// The logged lines would be cleared anyway.
+					gb->display.log_begin = 0;
+					gb->display.log_end = 0;
 				}
 				else if (prev_lcd_enable == 0 && ppu->lcdc.lcd_enable == 1)
 				{
@@ -1054,6 +1435,8 @@ gb__MemoryWriteByte(gb_GameBoy *gb, uint16_t addr, uint8_t value)
 						gb->cpu.interrupt.if_flags.lcd_stat = 1;
 					}
 				}
+
+				gb__SchedulePpu(gb);
 			}
 			else if (addr == 0xFF41)
 			{
@@ -1145,10 +1528,12 @@ gb__MemoryWriteByte(gb_GameBoy *gb, uint16_t addr, uint8_t value)
 				// See: https://gbdev.io/pandocs/OAM_DMA_Transfer.html#oam-dma-transfer
 				// We simply ignore that and don't verify that.
 				// We also ignore that DMA is not instantaneous.
+				gb__ComposeLoggedLines(gb);
 				for (uint16_t i = 0; i < 0xA0; ++i)
 				{
 					gb->memory.oam.bytes[i] = gb_MemoryReadByte(gb, (value << 8u) + i);
 				}
+				gb->memory.sprite_buckets.valid = false;
 				break;
 			}
 			else if (addr == 0xFF47)
@@ -1174,6 +1559,7 @@ gb__MemoryWriteByte(gb_GameBoy *gb, uint16_t addr, uint8_t value)
 			else if (addr == 0xFF50)
 			{
 				gb->memory.bios_mapped = false;
+				gb__UpdateMemoryMap(gb);
 			}
 			// Zero page RAM
 			else if (addr >= 0xFF80 && addr < 0xFFFF)
@@ -1229,6 +1615,13 @@ gb__PopWordToStack(gb_GameBoy *gb)
 	return result;
 }
 
+void
+gb_RelocateRom(gb_GameBoy *gb, const uint8_t *rom)
+{
+	gb->rom.data = rom;
+	gb__UpdateMemoryMap(gb);
+}
+
 void
 gb_Reset(gb_GameBoy *gb, bool skip_bios)
 {
@@ -1239,13 +1632,38 @@ gb_Reset(gb_GameBoy *gb, bool skip_bios)
 	gb_MbcType prev_mbc_type = mem->mbc_type;
 	gb_AudioCallback *prev_callback = gb->apu.callback;
 	void *prev_callback_user_data = gb->apu.callback_user_data;
+	uint16_t prev_audio_chunk_size = gb->apu.chunk_size;
+	gb_AudioFormat prev_audio_format = gb->apu.format;
+	gb_AudioSynthesis prev_audio_synthesis = gb->apu.synthesis;
+	gb_Layers *prev_layers = gb->memory.layer_cache.layers;
+	gb_DecodeCache *prev_decode_cache = gb->decode_cache;
+	gb_FramebufferFormat prev_framebuffer_format = gb->display.format;
+	uint8_t prev_frame_skip = gb->display.frame_skip;
+	bool prev_deferred = gb->display.deferred;
 	*gb = (gb_GameBoy){ 0 };
 	gb->rom = prev_rom;
 	mem->mbc_type = prev_mbc_type;
 	gb->apu.callback = prev_callback;
 	gb->apu.callback_user_data = prev_callback_user_data;
-
+	gb->apu.chunk_size = prev_audio_chunk_size;
+	gb->apu.format = prev_audio_format;
+	gb->apu.synthesis = prev_audio_synthesis;
+	gb_SetLayers(gb, prev_layers);
+	gb_SetDecodeCache(gb, prev_decode_cache);
+
+	gb->display.format = prev_framebuffer_format;
+	gb->display.frame_skip = prev_frame_skip;
+	gb->display.deferred = prev_deferred;
 	gb->display.updated = true;
+	gb->display.dirty_rows = (gb_RowRange){ .begin = 0, .end = GB_FRAMEBUFFER_HEIGHT };
+	if (gb->display.format == GB_FRAMEBUFFER_FORMAT_RGB)
+	{
+		// Scan lines only write the colors if their shades change.
+		gb_ExpandIndexedFramebuffer(gb_GetIndexedFramebuffer(gb), gb->display.pixels);
+	}
+
+	// NOTE: All deadlines of the scheduler are 0 now, i.e., the subsystems get
+	// scheduled at the end of the first instruction.
 
 	if (skip_bios)
 	{
@@ -1260,6 +1678,7 @@ gb_Reset(gb_GameBoy *gb, bool skip_bios)
 	{
 		mem->mbc2.rom_bank = 1;
 	}
+	gb__UpdateMemoryMap(gb);
 	// TODO(stefalie): Are MBC3 values correct if initialized to 0?
 	// gbdev.io doesn't give default values.
 	// TODO(stefalie): How to init RTC in MBC3?
@@ -1944,6 +2363,42 @@ gb_InstructionSize(gb_Instruction inst)
 	return inst.is_extended ? 2 : 1 + inst.num_operand_bytes;
 }
 
+// Same as gb_FetchInstruction but goes through the decode cache (if set, see
+// gb_SetDecodeCache) for code in ROM.
+static inline gb_Instruction
+gb__FetchInstructionCached(gb_GameBoy *gb, uint16_t addr)
+{
+	// Instructions that straddle two banks (i.e., that start in the last 2 bytes
+	// of a bank) are not cached, their operands depend on the other bank.
+	// Page 0 is NULL while the BIOS is mapped.
+	const uint8_t *page = gb->memory.read_pages[addr >> 12u];
+	if (gb->decode_cache && addr < 0x8000 && page && (addr & 0x3FFF) < 0x3FFE)
+	{
+		const uint32_t rom_offset = (uint32_t)(page - gb->rom.data) + (addr & 0x0FFF);
+		const uint32_t index = (rom_offset ^ (rom_offset >> 14u)) & (GB_DECODE_CACHE_SIZE - 1);
+
+		gb_DecodeCache *cache = gb->decode_cache;
+		if (cache->entries[index].tag != rom_offset + 1)
+		{
+			cache->entries[index].tag = rom_offset + 1;
+			cache->entries[index].inst = gb_FetchInstruction(gb, addr);
+		}
+		return cache->entries[index].inst;
+	}
+
+	return gb_FetchInstruction(gb, addr);
+}
+
+void
+gb_SetDecodeCache(gb_GameBoy *gb, gb_DecodeCache *cache)
+{
+	gb->decode_cache = cache;
+	if (cache)
+	{
+		memset(cache, 0, sizeof(gb_DecodeCache));
+	}
+}
+
 // TODO(stefalie): get rid of snprintf, strlen, memcpy to avoid std includes.
 // should all be easy, and from snprintf you only need to know how to convert 1 byte numbers to 2-char strings.
 size_t
@@ -1971,27 +2426,134 @@ gb_DisassembleInstruction(gb_Instruction inst, char str_buf[], size_t str_buf_le
 	return strlen(str_buf);
 }
 
-static inline void
-gb__SetFlags(gb_GameBoy *gb, bool zero, bool subtract, bool half_carry, bool carry)
+// Flags (see 'struct gb_LazyFlags')
+
+enum
+{
+	GB__LAZY_FLAGS_OP_NONE = 0,
+	GB__LAZY_FLAGS_OP_ADD,
+	GB__LAZY_FLAGS_OP_SUB,
+	GB__LAZY_FLAGS_OP_AND,
+	GB__LAZY_FLAGS_OP_OR_XOR,
+	GB__LAZY_FLAGS_OP_INC,
+	GB__LAZY_FLAGS_OP_DEC,
+};
+
+static inline uint8_t
+gb__FlagsByte(bool zero, bool subtract, bool half_carry, bool carry)
 {
-	gb->cpu.flags.zero = zero ? 1 : 0;
-	gb->cpu.flags.subtract = subtract ? 1 : 0;
-	gb->cpu.flags.half_carry = half_carry ? 1 : 0;
-	gb->cpu.flags.carry = carry ? 1 : 0;
+	return (uint8_t)((zero ? 0x80 : 0) | (subtract ? 0x40 : 0) | (half_carry ? 0x20 : 0) | (carry ? 0x10 : 0));
 }
 
-static uint8_t *
-gb__MapIndexToReg(gb_GameBoy *gb, uint8_t index)
+static void
+gb__MaterializeFlags(gb_GameBoy *gb)
 {
-	index &= 0x07;
+	struct gb_LazyFlags *lazy = &gb->cpu.lazy_flags;
 
-	switch (index)
+	const uint8_t lhs = lazy->lhs;
+	const uint8_t rhs = lazy->rhs;
+	const uint8_t ci = lazy->carry_in;
+	switch (lazy->op)
 	{
-	case 0:
-		return &gb->cpu.b;
-	case 1:
-		return &gb->cpu.c;
-	case 2:
+	case GB__LAZY_FLAGS_OP_NONE:
+		break;
+	case GB__LAZY_FLAGS_OP_ADD:
+		gb->cpu.f = gb__FlagsByte((uint8_t)(lhs + rhs + ci) == 0, false, (lhs & 0x0F) + (rhs & 0x0F) + ci > 0x0F,
+				lhs + rhs + ci > 0xFF);
+		break;
+	case GB__LAZY_FLAGS_OP_SUB:
+		gb->cpu.f = gb__FlagsByte(
+				(uint8_t)(lhs - rhs - ci) == 0, true, (lhs & 0x0F) < (rhs & 0x0F) + ci, lhs < rhs + ci);
+		break;
+	case GB__LAZY_FLAGS_OP_AND:
+		gb->cpu.f = gb__FlagsByte(lhs == 0, false, true, false);
+		break;
+	case GB__LAZY_FLAGS_OP_OR_XOR:
+		gb->cpu.f = gb__FlagsByte(lhs == 0, false, false, false);
+		break;
+	default:
+		assert(false);
+		break;
+	}
+	lazy->op = GB__LAZY_FLAGS_OP_NONE;
+
+	// INC and DEC don't touch the carry.
+	const uint8_t result = lazy->inc_dec_result;
+	switch (lazy->inc_dec_op)
+	{
+	case GB__LAZY_FLAGS_OP_NONE:
+		break;
+	case GB__LAZY_FLAGS_OP_INC:
+		gb->cpu.f = gb__FlagsByte(result == 0, false, (result & 0x0F) == 0, gb->cpu.flags.carry);
+		break;
+	case GB__LAZY_FLAGS_OP_DEC:
+		gb->cpu.f = gb__FlagsByte(result == 0, true, (result & 0x0F) == 0x0F, gb->cpu.flags.carry);
+		break;
+	default:
+		assert(false);
+		break;
+	}
+	lazy->inc_dec_op = GB__LAZY_FLAGS_OP_NONE;
+}
+
+// Use this to read the flags from within the CPU core.
+static inline struct gb_Flags *
+gb__Flags(gb_GameBoy *gb)
+{
+	if (gb->cpu.lazy_flags.op != GB__LAZY_FLAGS_OP_NONE || gb->cpu.lazy_flags.inc_dec_op != GB__LAZY_FLAGS_OP_NONE)
+	{
+		gb__MaterializeFlags(gb);
+	}
+	return &gb->cpu.flags;
+}
+
+static inline void
+gb__SetFlags(gb_GameBoy *gb, bool zero, bool subtract, bool half_carry, bool carry)
+{
+	gb->cpu.lazy_flags.op = GB__LAZY_FLAGS_OP_NONE;
+	gb->cpu.lazy_flags.inc_dec_op = GB__LAZY_FLAGS_OP_NONE;
+	gb->cpu.f = gb__FlagsByte(zero, subtract, half_carry, carry);
+}
+
+// Records an operation that sets all flags. 'lhs' is the result for AND, OR,
+// and XOR.
+static inline void
+gb__SetFlagsLazy(gb_GameBoy *gb, uint8_t op, uint8_t lhs, uint8_t rhs, uint8_t carry_in)
+{
+	struct gb_LazyFlags *lazy = &gb->cpu.lazy_flags;
+	lazy->op = op;
+	lazy->lhs = lhs;
+	lazy->rhs = rhs;
+	lazy->carry_in = carry_in;
+	lazy->inc_dec_op = GB__LAZY_FLAGS_OP_NONE;
+#if !GB_LAZY_FLAGS
+	gb__MaterializeFlags(gb);
+#endif
+}
+
+// Records an INC or DEC.
+static inline void
+gb__SetFlagsLazyIncDec(gb_GameBoy *gb, uint8_t op, uint8_t result)
+{
+	gb->cpu.lazy_flags.inc_dec_op = op;
+	gb->cpu.lazy_flags.inc_dec_result = result;
+#if !GB_LAZY_FLAGS
+	gb__MaterializeFlags(gb);
+#endif
+}
+
+static uint8_t *
+gb__MapIndexToReg(gb_GameBoy *gb, uint8_t index)
+{
+	index &= 0x07;
+
+	switch (index)
+	{
+	case 0:
+		return &gb->cpu.b;
+	case 1:
+		return &gb->cpu.c;
+	case 2:
 		return &gb->cpu.d;
 	case 3:
 		return &gb->cpu.e;
@@ -2025,7 +2587,7 @@ gb__RotateLeft(gb_GameBoy *gb, uint8_t val, bool clear_zero)
 {
 	const bool co = val & 0x80;
 	val <<= 1u;
-	val |= gb->cpu.flags.carry;
+	val |= gb__Flags(gb)->carry;
 	gb__SetFlags(gb, clear_zero ? false : val == 0, false, false, co);
 	return val;
 }
@@ -2048,7 +2610,7 @@ gb__RotateRight(gb_GameBoy *gb, uint8_t val, bool clear_zero)
 {
 	const bool co = val & 0x01;
 	val >>= 1u;
-	val |= gb->cpu.flags.carry << 7u;
+	val |= gb__Flags(gb)->carry << 7u;
 	gb__SetFlags(gb, clear_zero ? false : val == 0, false, false, co);
 	return val;
 }
@@ -2056,12 +2618,9 @@ gb__RotateRight(gb_GameBoy *gb, uint8_t val, bool clear_zero)
 static void
 gb__Add(gb_GameBoy *gb, uint8_t rhs, bool carry_in)
 {
-	uint8_t ci = (carry_in ? gb->cpu.flags.carry : 0);
-	uint16_t sum = gb->cpu.a + rhs + ci;
-	bool half_carry = (gb->cpu.a & 0x0F) + (rhs & 0x0F) + ci > 0x0F;
-	bool co = sum > 0xFF;
-	gb->cpu.a = (uint8_t)sum;
-	gb__SetFlags(gb, gb->cpu.a == 0, false, half_carry, co);
+	uint8_t ci = (carry_in ? gb__Flags(gb)->carry : 0);
+	gb__SetFlagsLazy(gb, GB__LAZY_FLAGS_OP_ADD, gb->cpu.a, rhs, ci);
+	gb->cpu.a += rhs + ci;
 }
 
 // Could this be implemented by doing gb__Add(lhs, 2's complement of (rhs + carry_if_enable)),
@@ -2071,12 +2630,9 @@ gb__Add(gb_GameBoy *gb, uint8_t rhs, bool carry_in)
 static void
 gb__Sub(gb_GameBoy *gb, uint8_t rhs, bool carry_in)
 {
-	uint8_t ci = (carry_in ? gb->cpu.flags.carry : 0);
-	uint16_t diff = gb->cpu.a - rhs - ci;
-	bool half_carry = (gb->cpu.a & 0x0F) < (rhs & 0x0F) + ci;
-	bool co = diff > 0xFF;
-	gb->cpu.a = (uint8_t)diff;
-	gb__SetFlags(gb, gb->cpu.a == 0, true, half_carry, co);
+	uint8_t ci = (carry_in ? gb__Flags(gb)->carry : 0);
+	gb__SetFlagsLazy(gb, GB__LAZY_FLAGS_OP_SUB, gb->cpu.a, rhs, ci);
+	gb->cpu.a -= rhs + ci;
 }
 
 static uint16_t
@@ -2085,7 +2641,7 @@ gb__Add16(gb_GameBoy *gb, uint16_t lhs, uint16_t rhs)
 	uint32_t sum = lhs + rhs;
 	bool half_carry = (lhs & 0x0FFF) + (rhs & 0x0FFF) > 0x0FFF;
 	bool co = sum > 0xFFFF;
-	gb__SetFlags(gb, gb->cpu.flags.zero == 1, false, half_carry, co);
+	gb__SetFlags(gb, gb__Flags(gb)->zero == 1, false, half_carry, co);
 	return (uint16_t)sum;
 }
 
@@ -2093,44 +2649,50 @@ static void
 gb__And(gb_GameBoy *gb, uint8_t rhs)
 {
 	gb->cpu.a &= rhs;
-	gb__SetFlags(gb, gb->cpu.a == 0, false, true, false);
+	gb__SetFlagsLazy(gb, GB__LAZY_FLAGS_OP_AND, gb->cpu.a, 0, 0);
 }
 
 static void
 gb__Xor(gb_GameBoy *gb, uint8_t rhs)
 {
 	gb->cpu.a ^= rhs;
-	gb__SetFlags(gb, gb->cpu.a == 0, false, false, false);
+	gb__SetFlagsLazy(gb, GB__LAZY_FLAGS_OP_OR_XOR, gb->cpu.a, 0, 0);
 }
 
 static void
 gb__Or(gb_GameBoy *gb, uint8_t rhs)
 {
 	gb->cpu.a |= rhs;
-	gb__SetFlags(gb, gb->cpu.a == 0, false, false, false);
+	gb__SetFlagsLazy(gb, GB__LAZY_FLAGS_OP_OR_XOR, gb->cpu.a, 0, 0);
 }
 
 static void
 gb__Cp(gb_GameBoy *gb, uint8_t rhs)
 {
-	gb__SetFlags(gb, gb->cpu.a == rhs, true, (gb->cpu.a & 0x0F) < (rhs & 0x0F), gb->cpu.a < rhs);
+	gb__SetFlagsLazy(gb, GB__LAZY_FLAGS_OP_SUB, gb->cpu.a, rhs, 0);
 }
 
 static void
 gb__Inc(gb_GameBoy *gb, uint8_t *val)
 {
 	++(*val);
-	gb__SetFlags(gb, (*val) == 0, false, ((*val) & 0x0F) == 0, gb->cpu.flags.carry == 1);
+	gb__SetFlagsLazyIncDec(gb, GB__LAZY_FLAGS_OP_INC, *val);
 }
 
 static void
 gb__Dec(gb_GameBoy *gb, uint8_t *val)
 {
 	--(*val);
-	gb__SetFlags(gb, (*val) == 0, true, ((*val) & 0x0F) == 0x0F, gb->cpu.flags.carry == 1);
+	gb__SetFlagsLazyIncDec(gb, GB__LAZY_FLAGS_OP_DEC, *val);
 }
 
-static uint16_t
+#if GB_DISPATCH_TABLE
+#define GB__EXECUTE_INLINE GB__FORCE_INLINE
+#else
+#define GB__EXECUTE_INLINE
+#endif
+
+static GB__EXECUTE_INLINE uint16_t
 gb__ExecuteBasicInstruction(gb_GameBoy *gb, gb_Instruction inst)
 {
 	assert(gb_MemoryReadByte(gb, gb->cpu.pc - gb_InstructionSize(inst)) != extended_inst_prefix ||
@@ -2190,8 +2752,10 @@ gb__ExecuteBasicInstruction(gb_GameBoy *gb, gb_Instruction inst)
 		break;
 
 	case 0x10:  // STOP
+		gb__SyncTimer(gb);
 		gb->timer.div = 0;
 		gb->cpu.stop = true;
+		gb__ScheduleTimer(gb);
 		// TODO(stefalie): not implemented. Supposedly no licensed DMG game ever used it.
 		break;
 	case 0x11:  // LD DE, u16
@@ -2242,7 +2806,7 @@ gb__ExecuteBasicInstruction(gb_GameBoy *gb, gb_Instruction inst)
 		break;
 
 	case 0x20:  // JR NZ, i8
-		if (gb->cpu.flags.zero == 0)
+		if (gb__Flags(gb)->zero == 0)
 		{
 			gb->cpu.pc += (int8_t)inst.operand_byte;
 			branch = true;
@@ -2272,36 +2836,36 @@ gb__ExecuteBasicInstruction(gb_GameBoy *gb, gb_Instruction inst)
 		// See:
 		// - https://forums.nesdev.org/viewtopic.php?t=15944
 		// - https://ehaskins.com/2018-01-30%20Z80%20DAA
-		bool co = gb->cpu.flags.carry == 1;
-		if (gb->cpu.flags.subtract == 0)
+		bool co = gb__Flags(gb)->carry == 1;
+		if (gb__Flags(gb)->subtract == 0)
 		{  // After an addition, adjust if (half-)carry occurred or if result is out of bounds.
-			if (gb->cpu.flags.carry == 1 || gb->cpu.a > 0x99)
+			if (gb__Flags(gb)->carry == 1 || gb->cpu.a > 0x99)
 			{
 				gb->cpu.a += 0x60;
 				co = true;
 			}
-			if (gb->cpu.flags.half_carry == 1 || (gb->cpu.a & 0x0F) > 0x09)
+			if (gb__Flags(gb)->half_carry == 1 || (gb->cpu.a & 0x0F) > 0x09)
 			{
 				gb->cpu.a += 0x6;
 			}
 		}
 		else
 		{  // After a subtraction, only adjust if (half-)carry occurred.
-			if (gb->cpu.flags.carry == 1)
+			if (gb__Flags(gb)->carry == 1)
 			{
 				gb->cpu.a -= 0x60;
 			}
-			if (gb->cpu.flags.half_carry == 1)
+			if (gb__Flags(gb)->half_carry == 1)
 			{
 				gb->cpu.a -= 0x6;
 			}
 		}
-		gb__SetFlags(gb, gb->cpu.a == 0, gb->cpu.flags.subtract == 1, false, co);
+		gb__SetFlags(gb, gb->cpu.a == 0, gb__Flags(gb)->subtract == 1, false, co);
 		break;
 	}
 
 	case 0x28:  // JR Z, i8
-		if (gb->cpu.flags.zero == 1)
+		if (gb__Flags(gb)->zero == 1)
 		{
 			gb->cpu.pc += (int8_t)inst.operand_byte;
 			branch = true;
@@ -2328,11 +2892,11 @@ gb__ExecuteBasicInstruction(gb_GameBoy *gb, gb_Instruction inst)
 		break;
 	case 0x2F:  // CPL
 		gb->cpu.a = ~gb->cpu.a;
-		gb__SetFlags(gb, gb->cpu.flags.zero == 1, true, true, gb->cpu.flags.carry == 1);
+		gb__SetFlags(gb, gb__Flags(gb)->zero == 1, true, true, gb__Flags(gb)->carry == 1);
 		break;
 
 	case 0x30:  // JR NC, i8
-		if (gb->cpu.flags.carry == 0)
+		if (gb__Flags(gb)->carry == 0)
 		{
 			gb->cpu.pc += (int8_t)inst.operand_byte;
 			branch = true;
@@ -2366,11 +2930,11 @@ gb__ExecuteBasicInstruction(gb_GameBoy *gb, gb_Instruction inst)
 		gb__MemoryWriteByte(gb, gb->cpu.hl, inst.operand_byte);
 		break;
 	case 0x37:  // SCF
-		gb__SetFlags(gb, gb->cpu.flags.zero == 1, false, false, true);
+		gb__SetFlags(gb, gb__Flags(gb)->zero == 1, false, false, true);
 		break;
 
 	case 0x38:  // JR C, i8
-		if (gb->cpu.flags.carry == 1)
+		if (gb__Flags(gb)->carry == 1)
 		{
 			gb->cpu.pc += (int8_t)inst.operand_byte;
 			branch = true;
@@ -2396,7 +2960,7 @@ gb__ExecuteBasicInstruction(gb_GameBoy *gb, gb_Instruction inst)
 		gb->cpu.a = inst.operand_byte;
 		break;
 	case 0x3F:  // CCF
-		gb__SetFlags(gb, gb->cpu.flags.zero == 1, false, false, gb->cpu.flags.carry == 0);
+		gb__SetFlags(gb, gb__Flags(gb)->zero == 1, false, false, gb__Flags(gb)->carry == 0);
 		break;
 
 	case 0x40:  // LD B, B
@@ -2602,7 +3166,7 @@ gb__ExecuteBasicInstruction(gb_GameBoy *gb, gb_Instruction inst)
 		break;
 
 	case 0xC0:  // RET NZ
-		if (gb->cpu.flags.zero == 0)
+		if (gb__Flags(gb)->zero == 0)
 		{
 			gb->cpu.pc = gb__PopWordToStack(gb);
 			branch = true;
@@ -2612,7 +3176,7 @@ gb__ExecuteBasicInstruction(gb_GameBoy *gb, gb_Instruction inst)
 		gb->cpu.bc = gb__PopWordToStack(gb);
 		break;
 	case 0xC2:  // JP NZ, u16
-		if (gb->cpu.flags.zero == 0)
+		if (gb__Flags(gb)->zero == 0)
 		{
 			gb->cpu.pc = inst.operand_word;
 			branch = true;
@@ -2622,7 +3186,7 @@ gb__ExecuteBasicInstruction(gb_GameBoy *gb, gb_Instruction inst)
 		gb->cpu.pc = inst.operand_word;
 		break;
 	case 0xC4:  // CALL NZ, u16
-		if (gb->cpu.flags.zero == 0)
+		if (gb__Flags(gb)->zero == 0)
 		{
 			gb__PushWordToStack(gb, gb->cpu.pc);
 			gb->cpu.pc = inst.operand_word;
@@ -2641,7 +3205,7 @@ gb__ExecuteBasicInstruction(gb_GameBoy *gb, gb_Instruction inst)
 		break;
 
 	case 0xC8:  // RET Z
-		if (gb->cpu.flags.zero == 1)
+		if (gb__Flags(gb)->zero == 1)
 		{
 			gb->cpu.pc = gb__PopWordToStack(gb);
 			branch = true;
@@ -2651,7 +3215,7 @@ gb__ExecuteBasicInstruction(gb_GameBoy *gb, gb_Instruction inst)
 		gb->cpu.pc = gb__PopWordToStack(gb);
 		break;
 	case 0xCA:  // JP Z, u16
-		if (gb->cpu.flags.zero == 1)
+		if (gb__Flags(gb)->zero == 1)
 		{
 			gb->cpu.pc = inst.operand_word;
 			branch = true;
@@ -2662,7 +3226,7 @@ gb__ExecuteBasicInstruction(gb_GameBoy *gb, gb_Instruction inst)
 		assert(false);
 		break;
 	case 0xCC:  // CALL Z, u16
-		if (gb->cpu.flags.zero == 1)
+		if (gb__Flags(gb)->zero == 1)
 		{
 			gb__PushWordToStack(gb, gb->cpu.pc);
 			gb->cpu.pc = inst.operand_word;
@@ -2684,7 +3248,7 @@ gb__ExecuteBasicInstruction(gb_GameBoy *gb, gb_Instruction inst)
 		break;
 
 	case 0xD0:  // RET NC
-		if (gb->cpu.flags.carry == 0)
+		if (gb__Flags(gb)->carry == 0)
 		{
 			gb->cpu.pc = gb__PopWordToStack(gb);
 			branch = true;
@@ -2694,14 +3258,14 @@ gb__ExecuteBasicInstruction(gb_GameBoy *gb, gb_Instruction inst)
 		gb->cpu.de = gb__PopWordToStack(gb);
 		break;
 	case 0xD2:  // JP NC, u16
-		if (gb->cpu.flags.carry == 0)
+		if (gb__Flags(gb)->carry == 0)
 		{
 			gb->cpu.pc = inst.operand_word;
 			branch = true;
 		}
 		break;
 	case 0xD4:  // CALL NC, u16
-		if (gb->cpu.flags.carry == 0)
+		if (gb__Flags(gb)->carry == 0)
 		{
 			gb__PushWordToStack(gb, gb->cpu.pc);
 			gb->cpu.pc = inst.operand_word;
@@ -2720,7 +3284,7 @@ gb__ExecuteBasicInstruction(gb_GameBoy *gb, gb_Instruction inst)
 		break;
 
 	case 0xD8:  // RET C
-		if (gb->cpu.flags.carry == 1)
+		if (gb__Flags(gb)->carry == 1)
 		{
 			gb->cpu.pc = gb__PopWordToStack(gb);
 			branch = true;
@@ -2731,14 +3295,14 @@ gb__ExecuteBasicInstruction(gb_GameBoy *gb, gb_Instruction inst)
 		gb->cpu.interrupt.ime = true;
 		break;
 	case 0xDA:  // JP C, u16
-		if (gb->cpu.flags.carry == 1)
+		if (gb__Flags(gb)->carry == 1)
 		{
 			gb->cpu.pc = inst.operand_word;
 			branch = true;
 		}
 		break;
 	case 0xDC:  // CALL C, u16
-		if (gb->cpu.flags.carry == 1)
+		if (gb__Flags(gb)->carry == 1)
 		{
 			gb__PushWordToStack(gb, gb->cpu.pc);
 			gb->cpu.pc = inst.operand_word;
@@ -2803,8 +3367,9 @@ gb__ExecuteBasicInstruction(gb_GameBoy *gb, gb_Instruction inst)
 		break;
 	case 0xF1:  // POP AF
 		gb->cpu.af = gb__PopWordToStack(gb);
-		// Unclear if necessary. Those bits are initialized to 0 and should never be written anyway.
-		gb->cpu.flags._ = 0;
+		// Drops pending lazy flags. Also clears the lower 4 bits (unclear if necessary,
+		// they are initialized to 0 and should never be written anyway).
+		gb__SetFlags(gb, gb->cpu.flags.zero, gb->cpu.flags.subtract, gb->cpu.flags.half_carry, gb->cpu.flags.carry);
 		break;
 	case 0xF2:  // LD A, (FF00+C)
 		gb->cpu.a = gb_MemoryReadByte(gb, 0xFF00 + gb->cpu.c);
@@ -2814,6 +3379,7 @@ gb__ExecuteBasicInstruction(gb_GameBoy *gb, gb_Instruction inst)
 		gb->cpu.interrupt.ime_after_next_inst = false;
 		break;
 	case 0xF5:  // PUSH AF
+		gb__Flags(gb);
 		gb__PushWordToStack(gb, gb->cpu.af);
 		break;
 	case 0xF6:  // OR A, u8
@@ -2877,7 +3443,7 @@ gb__ExecuteBasicInstruction(gb_GameBoy *gb, gb_Instruction inst)
 	return result;
 }
 
-static uint16_t
+static GB__EXECUTE_INLINE uint16_t
 gb__ExecuteExtendedInstruction(gb_GameBoy *gb, gb_Instruction inst)
 {
 	assert(gb_MemoryReadByte(gb, gb->cpu.pc - gb_InstructionSize(inst)) == extended_inst_prefix);
@@ -3124,7 +3690,7 @@ gb__ExecuteExtendedInstruction(gb_GameBoy *gb, gb_Instruction inst)
 	{
 		size_t bit_index = (inst.opcode - 0x40) >> 3u;
 		size_t bit = (*gb__MapIndexToReg(gb, inst.opcode) >> bit_index) & 0x01;
-		gb__SetFlags(gb, bit == 0, false, true, gb->cpu.flags.carry == 1);
+		gb__SetFlags(gb, bit == 0, false, true, gb__Flags(gb)->carry == 1);
 		break;
 	}
 
@@ -3139,7 +3705,7 @@ gb__ExecuteExtendedInstruction(gb_GameBoy *gb, gb_Instruction inst)
 	{
 		size_t bit_index = (inst.opcode - 0x40) >> 3u;
 		size_t bit = (gb_MemoryReadByte(gb, gb->cpu.hl) >> bit_index) & 0x01;
-		gb__SetFlags(gb, bit == 0, false, true, gb->cpu.flags.carry == 1);
+		gb__SetFlags(gb, bit == 0, false, true, gb__Flags(gb)->carry == 1);
 		break;
 	}
 
@@ -3325,6 +3891,111 @@ gb__ExecuteExtendedInstruction(gb_GameBoy *gb, gb_Instruction inst)
 	return info.num_machine_cycles_wo_branch;
 }
 
+#if GB_DISPATCH_TABLE
+#define GB__FOR_EACH_OPCODE(X) \
+	X(0x00) X(0x01) X(0x02) X(0x03) X(0x04) X(0x05) X(0x06) X(0x07) \
+	X(0x08) X(0x09) X(0x0A) X(0x0B) X(0x0C) X(0x0D) X(0x0E) X(0x0F) \
+	X(0x10) X(0x11) X(0x12) X(0x13) X(0x14) X(0x15) X(0x16) X(0x17) \
+	X(0x18) X(0x19) X(0x1A) X(0x1B) X(0x1C) X(0x1D) X(0x1E) X(0x1F) \
+	X(0x20) X(0x21) X(0x22) X(0x23) X(0x24) X(0x25) X(0x26) X(0x27) \
+	X(0x28) X(0x29) X(0x2A) X(0x2B) X(0x2C) X(0x2D) X(0x2E) X(0x2F) \
+	X(0x30) X(0x31) X(0x32) X(0x33) X(0x34) X(0x35) X(0x36) X(0x37) \
+	X(0x38) X(0x39) X(0x3A) X(0x3B) X(0x3C) X(0x3D) X(0x3E) X(0x3F) \
+	X(0x40) X(0x41) X(0x42) X(0x43) X(0x44) X(0x45) X(0x46) X(0x47) \
+	X(0x48) X(0x49) X(0x4A) X(0x4B) X(0x4C) X(0x4D) X(0x4E) X(0x4F) \
+	X(0x50) X(0x51) X(0x52) X(0x53) X(0x54) X(0x55) X(0x56) X(0x57) \
+	X(0x58) X(0x59) X(0x5A) X(0x5B) X(0x5C) X(0x5D) X(0x5E) X(0x5F) \
+	X(0x60) X(0x61) X(0x62) X(0x63) X(0x64) X(0x65) X(0x66) X(0x67) \
+	X(0x68) X(0x69) X(0x6A) X(0x6B) X(0x6C) X(0x6D) X(0x6E) X(0x6F) \
+	X(0x70) X(0x71) X(0x72) X(0x73) X(0x74) X(0x75) X(0x76) X(0x77) \
+	X(0x78) X(0x79) X(0x7A) X(0x7B) X(0x7C) X(0x7D) X(0x7E) X(0x7F) \
+	X(0x80) X(0x81) X(0x82) X(0x83) X(0x84) X(0x85) X(0x86) X(0x87) \
+	X(0x88) X(0x89) X(0x8A) X(0x8B) X(0x8C) X(0x8D) X(0x8E) X(0x8F) \
+	X(0x90) X(0x91) X(0x92) X(0x93) X(0x94) X(0x95) X(0x96) X(0x97) \
+	X(0x98) X(0x99) X(0x9A) X(0x9B) X(0x9C) X(0x9D) X(0x9E) X(0x9F) \
+	X(0xA0) X(0xA1) X(0xA2) X(0xA3) X(0xA4) X(0xA5) X(0xA6) X(0xA7) \
+	X(0xA8) X(0xA9) X(0xAA) X(0xAB) X(0xAC) X(0xAD) X(0xAE) X(0xAF) \
+	X(0xB0) X(0xB1) X(0xB2) X(0xB3) X(0xB4) X(0xB5) X(0xB6) X(0xB7) \
+	X(0xB8) X(0xB9) X(0xBA) X(0xBB) X(0xBC) X(0xBD) X(0xBE) X(0xBF) \
+	X(0xC0) X(0xC1) X(0xC2) X(0xC3) X(0xC4) X(0xC5) X(0xC6) X(0xC7) \
+	X(0xC8) X(0xC9) X(0xCA) X(0xCB) X(0xCC) X(0xCD) X(0xCE) X(0xCF) \
+	X(0xD0) X(0xD1) X(0xD2) X(0xD3) X(0xD4) X(0xD5) X(0xD6) X(0xD7) \
+	X(0xD8) X(0xD9) X(0xDA) X(0xDB) X(0xDC) X(0xDD) X(0xDE) X(0xDF) \
+	X(0xE0) X(0xE1) X(0xE2) X(0xE3) X(0xE4) X(0xE5) X(0xE6) X(0xE7) \
+	X(0xE8) X(0xE9) X(0xEA) X(0xEB) X(0xEC) X(0xED) X(0xEE) X(0xEF) \
+	X(0xF0) X(0xF1) X(0xF2) X(0xF3) X(0xF4) X(0xF5) X(0xF6) X(0xF7) \
+	X(0xF8) X(0xF9) X(0xFA) X(0xFB) X(0xFC) X(0xFD) X(0xFE) X(0xFF)
+
+typedef uint16_t gb__OpcodeHandler(gb_GameBoy *gb);
+
+static GB__FORCE_INLINE uint16_t
+gb__ExecuteExtendedOpcode(gb_GameBoy *gb, uint8_t opcode)
+{
+	const gb_Instruction inst = {
+		.opcode = opcode,
+		.is_extended = true,
+	};
+	gb->cpu.pc += 2;
+
+	return gb__ExecuteExtendedInstruction(gb, inst);
+}
+
+#define GB__DEFINE_EXTENDED_HANDLER(opcode) \
+	static uint16_t gb__ExtendedHandler_##opcode(gb_GameBoy *gb) \
+	{ \
+		return gb__ExecuteExtendedOpcode(gb, opcode); \
+	}
+GB__FOR_EACH_OPCODE(GB__DEFINE_EXTENDED_HANDLER)
+#undef GB__DEFINE_EXTENDED_HANDLER
+
+#define GB__EXTENDED_HANDLER_ENTRY(opcode) [opcode] = &gb__ExtendedHandler_##opcode,
+static gb__OpcodeHandler *const gb__extended_handlers[256] = { GB__FOR_EACH_OPCODE(GB__EXTENDED_HANDLER_ENTRY) };
+#undef GB__EXTENDED_HANDLER_ENTRY
+
+// Fetches the operands and advances PC, then executes the instruction.
+// 'opcode' is always a constant, this makes the compiler strip the switch in
+// gb__ExecuteBasicInstruction down to the single case that matters.
+static GB__FORCE_INLINE uint16_t
+gb__ExecuteBasicOpcode(gb_GameBoy *gb, uint8_t opcode)
+{
+	if (opcode == extended_inst_prefix)
+	{
+		return gb__extended_handlers[gb_MemoryReadByte(gb, gb->cpu.pc + 1)](gb);
+	}
+
+	gb_Instruction inst = {
+		.opcode = opcode,
+		.num_operand_bytes = gb__basic_instruction_infos[opcode].num_operand_bytes,
+	};
+
+	if (inst.num_operand_bytes == 1)
+	{
+		inst.operand_byte = gb_MemoryReadByte(gb, gb->cpu.pc + 1);
+	}
+	else if (inst.num_operand_bytes == 2)
+	{
+		inst.operand_word = gb__MemoryReadWord(gb, gb->cpu.pc + 1);
+	}
+	gb->cpu.pc += 1 + inst.num_operand_bytes;
+
+	return gb__ExecuteBasicInstruction(gb, inst);
+}
+
+#define GB__DEFINE_BASIC_HANDLER(opcode) \
+	static uint16_t gb__BasicHandler_##opcode(gb_GameBoy *gb) \
+	{ \
+		return gb__ExecuteBasicOpcode(gb, opcode); \
+	}
+GB__FOR_EACH_OPCODE(GB__DEFINE_BASIC_HANDLER)
+#undef GB__DEFINE_BASIC_HANDLER
+
+#define GB__BASIC_HANDLER_ENTRY(opcode) [opcode] = &gb__BasicHandler_##opcode,
+static gb__OpcodeHandler *const gb__basic_handlers[256] = { GB__FOR_EACH_OPCODE(GB__BASIC_HANDLER_ENTRY) };
+#undef GB__BASIC_HANDLER_ENTRY
+
+#undef GB__FOR_EACH_OPCODE
+#endif
+
 static uint16_t
 gb__HandleInterrupts(gb_GameBoy *gb)
 {
@@ -3421,30 +4092,13 @@ gb__UpdateClockAndTimer(gb_GameBoy *gb, size_t elapsed_m_cycles)
 				gb->timer.remaining_m_cycles += (uint16_t)elapsed_m_cycles;
 			}
 
-			// The clock of the timer runs at a quarter of the m-clock.
-			uint64_t period_in_m_cyles = 0;
-			switch (gb->timer.tac.clock_select)
-			{
-			case 0:
-				period_in_m_cyles = 64 * 4;  // 4 kHz
-				break;
-			case 1:
-				period_in_m_cyles = 1 * 4;  // 256 kHz
-				break;
-			case 2:
-				period_in_m_cyles = 4 * 4;  // 64 kHz
-				break;
-			case 3:
-				period_in_m_cyles = 16 * 4;  // 16 kHz
-				break;
-			}
-			assert(period_in_m_cyles >= 0);
+			const uint16_t period_in_m_cyles = gb__TimerPeriod(gb);
 
 			// While instead of if because it could happen several times just after
 			// the clock_select was changed.
 			while (gb->timer.remaining_m_cycles >= period_in_m_cyles)
 			{
-				gb->timer.remaining_m_cycles -= (uint16_t)period_in_m_cyles;
+				gb->timer.remaining_m_cycles -= period_in_m_cyles;
 
 				if (gb->timer.tima == 255u)
 				{
@@ -3474,32 +4128,6 @@ gb__UpdateClockAndTimer(gb_GameBoy *gb, size_t elapsed_m_cycles)
 	}
 }
 
-typedef union gb__TileLine
-{
-	uint64_t line;
-	uint8_t pixels[8];
-} gb__TileLine;
-
-static gb__TileLine
-gb__Interleave(uint64_t mem_line1, uint64_t mem_line2)
-{
-	// mem_line1 = -------- -------- -------- -------- -------- -------- -------- 76543210
-	// mem_line2 = -------- -------- -------- -------- -------- -------- -------- FEDCBA98
-	//
-	// n         = 76543210 FEDCBA98 -------- -------- -------- -------- -------- -------- : After (1)
-	// n         = ----3210 ----BA98 -------- -------- ----7654 ----FEDC -------- -------- : After (2)
-	// n         = ------10 ------98 ------32 ------BA ------54 ------DC ------76 ------FE : After (3)
-	// n         = ------80 ------91 ------A2 ------B3 ------C4 ------D5 ------E6 ------F7 : After (3)
-
-	uint64_t n = (mem_line2 << 48) + (mem_line1 << 56);  // (1)
-	n = (n ^ (n >> 36)) & 0x0F0F00000F0F0000;  // (2)
-	n = (n ^ (n >> 18)) & 0x0303030303030303;  // (3)
-	n = (n & 0x0100010001000100) + ((n & 0x0200020002000200) >> 9) +  // (4)
-			(n & 0x0002000200020002) + ((n & 0x0001000100010001) << 9);
-
-	return (gb__TileLine){ .line = n };
-}
-
 static gb__TileLine
 gb__GetTileLine(gb_GameBoy *gb, uint8_t address_mode, uint8_t tile_index, uint8_t line_index)
 {
@@ -3508,16 +4136,12 @@ gb__GetTileLine(gb_GameBoy *gb, uint8_t address_mode, uint8_t tile_index, uint8_
 
 	const int signed_tile_idx = address_mode == 0 ? (int8_t)tile_index : tile_index;
 
-	const size_t set_offset = address_mode == 0 ? 0x1000 : 0x0;
-	size_t vram_offset = set_offset;
-
-	// A tile uses 16 bytes (2 bytes per line for 8x8 pixels).
-	vram_offset += signed_tile_idx << 4;
-	vram_offset += line_index << 1;
-	assert(vram_offset < 0x17FF);
-	assert((vram_offset & 1u) == 0);
+	// Tiles 0-127 are in [0x8000, 0x8800), 128-255 in [0x8800, 0x9000), and
+	// 256-383 in [0x9000, 0x9800).
+	const int tile = (address_mode == 0 ? 256 : 0) + signed_tile_idx;
+	assert(tile >= 0 && tile < 384);
 
-	const gb__TileLine tile_line = gb__Interleave(gb->memory.vram[vram_offset], gb->memory.vram[vram_offset + 1]);
+	const gb__TileLine tile_line = { .line = gb->memory.decoded_tiles[tile][line_index] };
 	return tile_line;
 }
 
@@ -3533,214 +4157,579 @@ gb__GetMapTileLine(
 	return line;
 }
 
-// TODO(stefalie): This is simplified.
-// Rendering background, window, and sprites is interleaved using
-// a 2-byte shift register. For details, see:
-// https://www.youtube.com/watch?v=HyzD8pNlpwI
+// Converts a BGP/OBP register into a map from color indices to shades.
+static inline void
+gb__PaletteMap(uint8_t palette, uint8_t map[4])
+{
+	map[0] = (palette >> 0u) & 0x03;
+	map[1] = (palette >> 2u) & 0x03;
+	map[2] = (palette >> 4u) & 0x03;
+	map[3] = (palette >> 6u) & 0x03;
+}
+
+// Bits of the per pixel sprite values passed to gb__CompositeScanLine.
+// The lowest 2 bits are the sprite's color index (0 means no sprite).
+#define GB__OBJ_PALETTE_BIT 0x04u  // OBP1 instead of OBP0
+#define GB__OBJ_BEHIND_BG_BIT 0x08u  // Only visible where the background is 0
+
+#if GB_SIMD == 1
+// Looks up the bytes of 'idx' (all in [0, 7]) in the first 8 bytes of 'table'.
+static inline __m128i
+gb__Lookup8(__m128i table, const uint8_t table_bytes[16], __m128i idx)
+{
+#if defined(__SSSE3__)
+	(void)table_bytes;
+	return _mm_shuffle_epi8(table, idx);
+#else
+	(void)table;
+	__m128i result = _mm_setzero_si128();
+	for (int i = 0; i < 8; ++i)
+	{
+		const __m128i match = _mm_cmpeq_epi8(idx, _mm_set1_epi8((char)i));
+		result = _mm_or_si128(result, _mm_and_si128(match, _mm_set1_epi8((char)table_bytes[i])));
+	}
+	return result;
+#endif
+}
+
+// Converts 4 shades (one per dword, in [0, 3]) to colors.
+static inline __m128i
+gb__ShadesToColors(__m128i shades, const __m128i colors[4])
+{
+	__m128i result = _mm_and_si128(_mm_cmpeq_epi32(shades, _mm_setzero_si128()), colors[0]);
+	for (int i = 1; i < 4; ++i)
+	{
+		const __m128i match = _mm_cmpeq_epi32(shades, _mm_set1_epi32(i));
+		result = _mm_or_si128(result, _mm_and_si128(match, colors[i]));
+	}
+	return result;
+}
+#endif
+
+// Applies the palettes to a scan line worth of background/window color
+// indices (in [0, 3]) and sprite values (see GB__OBJ_PALETTE_BIT), resolves
+// which of the two is visible, and writes the final shades.
+// 'bgp_map' maps background color indices to shades, 'obp_map' maps
+// (sprite value & 7) to shades, i.e., OBP0 in [0, 4) and OBP1 in [4, 8).
 static void
-gb__RenderScanLine(gb_GameBoy *gb)
+gb__CompositeScanLine(const uint8_t bg[GB_FRAMEBUFFER_WIDTH], const uint8_t obj[GB_FRAMEBUFFER_WIDTH],
+		const uint8_t bgp_map[16], const uint8_t obp_map[16], uint8_t *line_shades)
 {
-	assert(gb->ppu.ly < 144);
+#if GB_SIMD >= 2
+	const __m256i bgp_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)bgp_map));
+	const __m256i obp_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)obp_map));
+	const __m256i zero = _mm256_setzero_si256();
 
-	const union gb_PpuLcdc *lcdc = &gb->ppu.lcdc;
+	// 160 = 5 * 32
+	for (size_t x = 0; x < GB_FRAMEBUFFER_WIDTH; x += 32)
+	{
+		const __m256i bg_idx = _mm256_loadu_si256((const __m256i *)&bg[x]);
+		const __m256i obj_val = _mm256_loadu_si256((const __m256i *)&obj[x]);
+
+		const __m256i bg_shade = _mm256_shuffle_epi8(bgp_table, bg_idx);
+		const __m256i obj_shade = _mm256_shuffle_epi8(obp_table, _mm256_and_si256(obj_val, _mm256_set1_epi8(7)));
+
+		// A sprite pixel is visible if it's not transparent and either in front
+		// of the background or the background is 0.
+		const __m256i obj_transparent = _mm256_cmpeq_epi8(_mm256_and_si256(obj_val, _mm256_set1_epi8(3)), zero);
+		const __m256i obj_in_front = _mm256_or_si256(
+				_mm256_cmpeq_epi8(_mm256_and_si256(obj_val, _mm256_set1_epi8(GB__OBJ_BEHIND_BG_BIT)), zero),
+				_mm256_cmpeq_epi8(bg_idx, zero));
+		const __m256i obj_visible = _mm256_andnot_si256(obj_transparent, obj_in_front);
+		const __m256i shades = _mm256_blendv_epi8(bg_shade, obj_shade, obj_visible);
+		_mm256_storeu_si256((__m256i *)&line_shades[x], shades);
+	}
+#elif GB_SIMD == 1
+	const __m128i bgp_table = _mm_loadu_si128((const __m128i *)bgp_map);
+	const __m128i obp_table = _mm_loadu_si128((const __m128i *)obp_map);
+	const __m128i zero = _mm_setzero_si128();
 
-	const uint8_t bgp_map[4] = {
-		(gb->ppu.bgp >> 0u) & 0x03,
-		(gb->ppu.bgp >> 2u) & 0x03,
-		(gb->ppu.bgp >> 4u) & 0x03,
-		(gb->ppu.bgp >> 6u) & 0x03,
+	// 160 = 10 * 16
+	for (size_t x = 0; x < GB_FRAMEBUFFER_WIDTH; x += 16)
+	{
+		const __m128i bg_idx = _mm_loadu_si128((const __m128i *)&bg[x]);
+		const __m128i obj_val = _mm_loadu_si128((const __m128i *)&obj[x]);
+
+		const __m128i bg_shade = gb__Lookup8(bgp_table, bgp_map, bg_idx);
+		const __m128i obj_shade = gb__Lookup8(obp_table, obp_map, _mm_and_si128(obj_val, _mm_set1_epi8(7)));
+
+		// See AVX2 version above.
+		const __m128i obj_transparent = _mm_cmpeq_epi8(_mm_and_si128(obj_val, _mm_set1_epi8(3)), zero);
+		const __m128i obj_in_front =
+				_mm_or_si128(_mm_cmpeq_epi8(_mm_and_si128(obj_val, _mm_set1_epi8(GB__OBJ_BEHIND_BG_BIT)), zero),
+						_mm_cmpeq_epi8(bg_idx, zero));
+		const __m128i obj_visible = _mm_andnot_si128(obj_transparent, obj_in_front);
+		const __m128i shades =
+				_mm_or_si128(_mm_and_si128(obj_visible, obj_shade), _mm_andnot_si128(obj_visible, bg_shade));
+		_mm_storeu_si128((__m128i *)&line_shades[x], shades);
+	}
+#else
+	for (size_t x = 0; x < GB_FRAMEBUFFER_WIDTH; ++x)
+	{
+		const uint8_t obj_val = obj[x];
+		const bool obj_visible = (obj_val & 3u) != 0 && ((obj_val & GB__OBJ_BEHIND_BG_BIT) == 0 || bg[x] == 0);
+		line_shades[x] = obj_visible ? obp_map[obj_val & 7u] : bgp_map[bg[x]];
+	}
+#endif
+}
+
+// Converts shades (in [0, 3]) to colors.
+static void
+gb__ExpandShades(const uint8_t *shades, gb_Color *pixels, size_t num_pixels)
+{
+	size_t i = 0;
+#if GB_SIMD >= 2
+	const __m256i colors = _mm256_setr_epi32(gb__DefaultPalette[0].as_u32, gb__DefaultPalette[1].as_u32,
+			gb__DefaultPalette[2].as_u32, gb__DefaultPalette[3].as_u32, 0, 0, 0, 0);
+	for (; i < (num_pixels & ~(size_t)7); i += 8)
+	{
+		const __m256i color_idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)&shades[i]));
+		_mm256_storeu_si256((__m256i *)&pixels[i], _mm256_permutevar8x32_epi32(colors, color_idx));
+	}
+#elif GB_SIMD == 1
+	const __m128i colors[4] = {
+		_mm_set1_epi32(gb__DefaultPalette[0].as_u32),
+		_mm_set1_epi32(gb__DefaultPalette[1].as_u32),
+		_mm_set1_epi32(gb__DefaultPalette[2].as_u32),
+		_mm_set1_epi32(gb__DefaultPalette[3].as_u32),
 	};
+	const __m128i zero = _mm_setzero_si128();
+	for (; i < (num_pixels & ~(size_t)3); i += 4)
+	{
+		uint32_t shades_4;
+		memcpy(&shades_4, &shades[i], sizeof(shades_4));
+		const __m128i color_idx =
+				_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int)shades_4), zero), zero);
+		_mm_storeu_si128((__m128i *)&pixels[i], gb__ShadesToColors(color_idx, colors));
+	}
+#endif
+	for (; i < num_pixels; ++i)
+	{
+		assert(shades[i] < 4);
+		pixels[i] = gb__DefaultPalette[shades[i]];
+	}
+}
 
-	const uint8_t address_mode = lcdc->bg_and_win_addr_mode;
+// Enough tiles to cover a scan line that doesn't start at a tile boundary.
+#define GB__TILES_PER_SCAN_LINE (GB_FRAMEBUFFER_WIDTH / 8 + 1)
 
-	// Values in [0, 3] per pixel.
-	uint8_t scan_line[GB_FRAMEBUFFER_WIDTH] = { 0 };
+// Decodes 'num_tiles' consecutive tiles of a line of a tile map into
+// 'pixels' (color indices, 8 per tile), wrapping around at the right border
+// of the map.
+static inline void
+gb__FetchMapLine(gb_GameBoy *gb, uint8_t map_index, uint8_t address_mode, uint8_t tile_x, uint8_t y,
+		size_t num_tiles, uint8_t *pixels)
+{
+	const uint8_t tile_y = y >> 3u;
+	const uint8_t in_tile_y = y & 7u;
 
-	// Apply palette and remember that "transparent", i.e., 0-valued, pixels.
-	bool transparent[GB_FRAMEBUFFER_WIDTH];
+	for (size_t i = 0; i < num_tiles; ++i)
+	{
+		const gb__TileLine line =
+				gb__GetMapTileLine(gb, map_index, address_mode, (uint8_t)((tile_x + i) & 31u), tile_y, in_tile_y);
+		memcpy(&pixels[8 * i], &line.line, 8);
+	}
+}
 
-	// Background
-	if (lcdc->bg_and_win_enable)
+// Sorts the sprites into the per line buckets (see 'struct gb_SpriteBuckets').
+static void
+gb__UpdateSpriteBuckets(gb_GameBoy *gb)
+{
+	struct gb_SpriteBuckets *buckets = &gb->memory.sprite_buckets;
+	if (buckets->valid)
 	{
-		uint8_t y = gb->ppu.scy + gb->ppu.ly;
-		uint8_t tile_y = y >> 3u;
-		uint8_t in_tile_y = y & 7u;
+		return;
+	}
 
-		uint8_t fb_x = 0;
-		while (fb_x < GB_FRAMEBUFFER_WIDTH)
+	memset(buckets->num_sprites, 0, sizeof(buckets->num_sprites));
+
+	const gb_Sprite *sprites = gb->memory.oam.sprites;
+	const int sprite_height = gb->ppu.lcdc.sprite_size == 1 ? 16 : 8;
+
+	// Each line takes the first 10 sprites (in OAM order) that overlap with it.
+	// Within a line, sprites are sorted by x position. A sprite goes after all
+	// the ones with the same x since those come first in OAM.
+	for (uint8_t i = 0; i < 40; ++i)
+	{
+		const int top = sprites[i].y_pos - 16;
+		const int begin = MAX(top, 0);
+		const int end = MIN(top + sprite_height, GB_FRAMEBUFFER_HEIGHT);
+		for (int line = begin; line < end; ++line)
 		{
-			uint8_t x = gb->ppu.scx + fb_x;
-			uint8_t tile_x = x >> 3u;
-			gb__TileLine line =
-					gb__GetMapTileLine(gb, lcdc->bg_tilemap_select, address_mode, tile_x, tile_y, in_tile_y);
+			const uint8_t num_sprites = buckets->num_sprites[line];
+			if (num_sprites == 10)
+			{
+				continue;
+			}
 
-			for (size_t in_tile_x = x & 7u; in_tile_x < 8 && fb_x < GB_FRAMEBUFFER_WIDTH; ++fb_x, ++in_tile_x)
+			uint8_t *line_sprites = buckets->sprites[line];
+			int j = num_sprites;
+			while (j > 0 && sprites[line_sprites[j - 1]].x_pos > sprites[i].x_pos)
 			{
-				const uint8_t pixel = line.pixels[in_tile_x];
-				transparent[fb_x] = pixel == 0;
-				scan_line[fb_x] = bgp_map[pixel];
+				line_sprites[j] = line_sprites[j - 1];
+				--j;
 			}
+			line_sprites[j] = i;
+			buckets->num_sprites[line] = num_sprites + 1;
 		}
 	}
 
-	// Window
-	if (lcdc->win_enable && lcdc->bg_and_win_enable)
-	{
-		// NOTE: This uses a separate, window internal "LY". See:
-		// - https://www.reddit.com/r/EmuDev/comments/zzltyt/what_is_the_window_internal_line_counter
-		// - https://gbdev.io/pandocs/Tile_Maps.html
+	buckets->valid = true;
+}
 
-		const bool win_visible = gb->ppu.ly >= gb->ppu.wy && gb->ppu.wy <= 143 && gb->ppu.wx >= 0 && gb->ppu.wx <= 166;
-		if (win_visible)
-		{
-			// TODO(stefalie): Window bugs not implemented.
-			// See: https://gbdev.io/pandocs/Scrolling.html#ff4aff4b--wy-wx-window-y-position-x-position-plus-7
-			// Can't assert, Donkey Kong sets WX = 166. Sigh.
-			// assert(gb->ppu.wx != 0 && gb->ppu.wx != 166);
+// Whether the window's position covers the current line (ignoring LCDC).
+static inline bool
+gb__WindowOnLine(const gb_GameBoy *gb)
+{
+	return gb->ppu.ly >= gb->ppu.wy && gb->ppu.wy <= 143 && gb->ppu.wx >= 0 && gb->ppu.wx <= 166;
+}
 
-			uint8_t y = gb->ppu.ly_win_internal;
-			uint8_t tile_y = y >> 3u;
-			uint8_t in_tile_y = y & 7u;
+static inline bool
+gb__WindowVisible(const gb_GameBoy *gb)
+{
+	const union gb_PpuLcdc *lcdc = &gb->ppu.lcdc;
+	return lcdc->win_enable && lcdc->bg_and_win_enable && gb__WindowOnLine(gb);
+}
 
-			size_t fb_x = MAX(0, (int)gb->ppu.wx - 7);
-			while (fb_x < GB_FRAMEBUFFER_WIDTH)
-			{
-				uint8_t x = (uint8_t)(7 - gb->ppu.wx + fb_x);  // fb_x = x + wx - 7
-				assert(x < GB_FRAMEBUFFER_WIDTH + 7);
-				uint8_t tile_x = x >> 3u;
-				gb__TileLine line =
-						gb__GetMapTileLine(gb, lcdc->win_tilemap_select, address_mode, tile_x, tile_y, in_tile_y);
+// Mirrors the 8 pixels of a tile line.
+static inline uint64_t
+gb__ReverseBytes(uint64_t x)
+{
+	x = (x >> 32u) | (x << 32u);
+	x = ((x & 0xFFFF0000FFFF0000ull) >> 16u) | ((x & 0x0000FFFF0000FFFFull) << 16u);
+	x = ((x & 0xFF00FF00FF00FF00ull) >> 8u) | ((x & 0x00FF00FF00FF00FFull) << 8u);
+	return x;
+}
 
-				for (size_t in_tile_x = x & 7u; in_tile_x < 8 && fb_x < GB_FRAMEBUFFER_WIDTH; ++fb_x, ++in_tile_x)
-				{
-					const uint8_t pixel = line.pixels[in_tile_x];
-					transparent[fb_x] = pixel == 0;
-					scan_line[fb_x] = bgp_map[pixel];
-				}
-			}
+// Writes the shades of line 'ly' to the framebuffer and tracks which lines
+// differ from the previous frame.
+// NOTE: In RGB mode the colors are only written if the shades changed, they
+// always match the shades (see gb_SetFramebufferFormat).
+static void
+gb__StoreScanLineShades(gb_GameBoy *gb, uint8_t ly, const uint8_t *line_shades)
+{
+	const size_t fb_offset = GB_FRAMEBUFFER_WIDTH * ly;
+	uint8_t *shades = &gb->display.shades[fb_offset];
+	if (memcmp(shades, line_shades, GB_FRAMEBUFFER_WIDTH) != 0)
+	{
+		memcpy(shades, line_shades, GB_FRAMEBUFFER_WIDTH);
+		if (gb->display.format == GB_FRAMEBUFFER_FORMAT_RGB)
+		{
+			gb__ExpandShades(line_shades, &gb->display.pixels[fb_offset], GB_FRAMEBUFFER_WIDTH);
+		}
 
-			++gb->ppu.ly_win_internal;
+		gb_RowRange *dirty = &gb->display.dirty_rows;
+		if (dirty->begin == dirty->end)
+		{
+			dirty->begin = ly;
+			dirty->end = ly + 1;
+		}
+		else
+		{
+			dirty->begin = MIN(dirty->begin, ly);
+			dirty->end = MAX(dirty->end, ly + 1);
 		}
 	}
+}
 
-	// Sprites
-	if (lcdc->sprite_enable)
-	{
-		const uint8_t obp0_map[4] = {
-			(gb->ppu.obp0 >> 0u) & 0x03,
-			(gb->ppu.obp0 >> 2u) & 0x03,
-			(gb->ppu.obp0 >> 4u) & 0x03,
-			(gb->ppu.obp0 >> 6u) & 0x03,
-		};
-		const uint8_t obp1_map[4] = {
-			(gb->ppu.obp1 >> 0u) & 0x03,
-			(gb->ppu.obp1 >> 2u) & 0x03,
-			(gb->ppu.obp1 >> 4u) & 0x03,
-			(gb->ppu.obp1 >> 6u) & 0x03,
-		};
+// The features a scan line renderer variant supports, taken from LCDC (see
+// gb__RenderScanLine).
+#define GB__RENDER_BG 0x01u  // LCDC bit 0, background and window
+#define GB__RENDER_SPRITES 0x02u  // LCDC bit 1
+#define GB__RENDER_TALL_SPRITES 0x04u  // LCDC bit 2, 8x16 sprites
+#define GB__RENDER_WINDOW 0x08u  // LCDC bit 5
 
-		const gb_Sprite *sprites = gb->memory.oam.sprites;
-		const int sprite_height = gb->ppu.lcdc.sprite_size == 1 ? 16 : 8;
+// TODO(stefalie): This is simplified.
+// Rendering background, window, and sprites is interleaved using
+// a 2-byte shift register. For details, see:
+// https://www.youtube.com/watch?v=HyzD8pNlpwI
+//
+// The scan line is produced in 3 passes: First the background and window
+// color indices, then the sprite values, and finally both are combined and
+// converted to colors in gb__CompositeScanLine.
+//
+// 'variant' is a combination of GB__RENDER_* and always a constant, the
+// compiler generates a separate renderer without the branches for the
+// disabled features for each.
+static GB__FORCE_INLINE void
+gb__RenderScanLineVariant(gb_GameBoy *gb, uint8_t variant)
+{
+	assert(gb->ppu.ly < 144);
+
+	const union gb_PpuLcdc *lcdc = &gb->ppu.lcdc;
+	assert(lcdc->bg_and_win_enable == ((variant & GB__RENDER_BG) != 0));
+	assert(lcdc->sprite_enable == ((variant & GB__RENDER_SPRITES) != 0));
+	assert(lcdc->sprite_size == ((variant & GB__RENDER_TALL_SPRITES) != 0));
+	assert(lcdc->win_enable == ((variant & GB__RENDER_WINDOW) != 0));
+
+	// Background and window color indices in [0, 3] per pixel.
+	uint8_t bg[GB_FRAMEBUFFER_WIDTH] = { 0 };
 
-		// Gather the first 10 sprites that overlap with scanline.
-		int num_scanned_sprites = 0;
-		gb_Sprite scanned_sprites[10];
+	// The palette maps are 16 bytes wide so that they can be used as shuffle
+	// tables. With disabled background and window, the background is always
+	// white (and never covers sprites).
+	uint8_t bgp_map[16] = { 0 };
+	uint8_t obp_map[16] = { 0 };
+
+	const uint8_t address_mode = lcdc->bg_and_win_addr_mode;
+
+	const gb_Layers *layers = gb->memory.layer_cache.layers;
+	if ((variant & GB__RENDER_BG) && layers)
+	{
+		gb__UpdateLayers(gb);
+	}
+
+	// Background
+	if (variant & GB__RENDER_BG)
+	{
+		gb__PaletteMap(gb->ppu.bgp, bgp_map);
 
-		for (int i = 0; i < 40 && num_scanned_sprites < 10; ++i)
+		const uint8_t y = gb->ppu.scy + gb->ppu.ly;
+		if (layers)
 		{
-			int in_tile_y = gb->ppu.ly - (sprites[i].y_pos - 16);
-			if (in_tile_y >= 0 && in_tile_y < sprite_height)
-			{
-				scanned_sprites[num_scanned_sprites] = sprites[i];
-				++num_scanned_sprites;
-			}
+			// Wraps around at the right border.
+			const uint8_t *layer_line = layers->pixels[lcdc->bg_tilemap_select][address_mode][y];
+			const size_t num_pixels_to_border = MIN(256u - gb->ppu.scx, GB_FRAMEBUFFER_WIDTH);
+			memcpy(bg, &layer_line[gb->ppu.scx], num_pixels_to_border);
+			memcpy(&bg[num_pixels_to_border], layer_line, GB_FRAMEBUFFER_WIDTH - num_pixels_to_border);
+		}
+		else
+		{
+			uint8_t line_pixels[GB__TILES_PER_SCAN_LINE * 8];
+			gb__FetchMapLine(gb, lcdc->bg_tilemap_select, address_mode, gb->ppu.scx >> 3u, y,
+					GB__TILES_PER_SCAN_LINE, line_pixels);
+			memcpy(bg, &line_pixels[gb->ppu.scx & 7u], GB_FRAMEBUFFER_WIDTH);
 		}
+	}
+
+	// Window
+	// NOTE: This uses a separate, window internal "LY". See:
+	// - https://www.reddit.com/r/EmuDev/comments/zzltyt/what_is_the_window_internal_line_counter
+	// - https://gbdev.io/pandocs/Tile_Maps.html
+	if ((variant & GB__RENDER_BG) && (variant & GB__RENDER_WINDOW) && gb__WindowOnLine(gb))
+	{
+		// TODO(stefalie): Window bugs not implemented.
+		// See: https://gbdev.io/pandocs/Scrolling.html#ff4aff4b--wy-wx-window-y-position-x-position-plus-7
+		// Can't assert, Donkey Kong sets WX = 166. Sigh.
+		// assert(gb->ppu.wx != 0 && gb->ppu.wx != 166);
+
+		const size_t fb_x = MAX(0, (int)gb->ppu.wx - 7);
+		const size_t x = 7 - gb->ppu.wx + fb_x;  // fb_x = x + wx - 7
+		assert(x <= 7);
+		const size_t num_pixels = GB_FRAMEBUFFER_WIDTH - fb_x;
 
-		// Insertion sort the scanned tiles by x position
-		// (For <= 10 elements this is likely faster than anything else.)
-		for (int i = 1; i < num_scanned_sprites; ++i)
+		if (layers)
 		{
-			gb_Sprite x = scanned_sprites[i];
-			int j = i;
-			while (j > 0 && scanned_sprites[j - 1].x_pos > x.x_pos)
-			{
-				scanned_sprites[j] = scanned_sprites[j - 1];
-				--j;
-			}
-			scanned_sprites[j] = x;
+			const uint8_t win_y = gb->ppu.ly_win_internal;
+			const uint8_t *layer_line = layers->pixels[lcdc->win_tilemap_select][address_mode][win_y];
+			memcpy(&bg[fb_x], &layer_line[x], num_pixels);
+		}
+		else
+		{
+			uint8_t line_pixels[GB__TILES_PER_SCAN_LINE * 8];
+			gb__FetchMapLine(gb, lcdc->win_tilemap_select, address_mode, 0, gb->ppu.ly_win_internal,
+					(x + num_pixels + 7) / 8, line_pixels);
+			memcpy(&bg[fb_x], &line_pixels[x], num_pixels);
 		}
 
+		++gb->ppu.ly_win_internal;
+	}
+
+	// Sprite values (see GB__OBJ_PALETTE_BIT), 0 where there is no sprite.
+	uint8_t obj[GB_FRAMEBUFFER_WIDTH] = { 0 };
+
+	// Sprites
+	if (variant & GB__RENDER_SPRITES)
+	{
+		gb__PaletteMap(gb->ppu.obp0, &obp_map[0]);
+		gb__PaletteMap(gb->ppu.obp1, &obp_map[4]);
+
+		const gb_Sprite *sprites = gb->memory.oam.sprites;
+		const int sprite_height = (variant & GB__RENDER_TALL_SPRITES) ? 16 : 8;
+
+		gb__UpdateSpriteBuckets(gb);
+		const int num_scanned_sprites = gb->memory.sprite_buckets.num_sprites[gb->ppu.ly];
+		const uint8_t *scanned_sprites = gb->memory.sprite_buckets.sprites[gb->ppu.ly];
+
 		// Render sprites in order
 		//
 		// Whenever a sprite affects a pixel (even if it is behind the
 		// background), no other sprites will affect the same pixel.
-		// We use mask to track this.
+		// The first sprite to write a non-zero value into 'obj' wins.
 		//
 		// See: https://gbdev.io/pandocs/OAM.html
-		bool masked[GB_FRAMEBUFFER_WIDTH] = { 0 };
-
 		for (int i = 0; i < num_scanned_sprites; ++i)
 		{
-			const gb_Sprite sprite = scanned_sprites[i];
+			const gb_Sprite sprite = sprites[scanned_sprites[i]];
 
 			int in_tile_y = gb->ppu.ly - (sprite.y_pos - 16);
-			if (in_tile_y >= 0 && in_tile_y < sprite_height)
+			assert(in_tile_y >= 0 && in_tile_y < sprite_height);
+
+			const int fb_start_x = sprite.x_pos - 8;
+			if (fb_start_x > -8 && fb_start_x < GB_FRAMEBUFFER_WIDTH)
 			{
-				const int fb_start_x = sprite.x_pos - 8;
-				if (fb_start_x > -8 && fb_start_x < GB_FRAMEBUFFER_WIDTH)
+				// Flip vertically.
+				if (sprite.y_flip == 1)
+				{
+					in_tile_y = (sprite_height - 1) - in_tile_y;
+				}
+				assert(in_tile_y < sprite_height);
+
+				// Second half of 8x16 sprite is in the next tile
+				uint8_t tile_idx = sprite.tile_index;
+				if (sprite_height == 16)
 				{
-					// Flip vertically.
-					if (sprite.y_flip == 1)
+					// Double tile sprites always start on an even tile index.
+					tile_idx &= 0xFE;
+
+					if (in_tile_y >= 8)
 					{
-						in_tile_y = (sprite_height - 1) - in_tile_y;
+						in_tile_y -= 8;
+						tile_idx |= 0x01;
 					}
-					assert(in_tile_y < sprite_height);
+				}
 
-					// Second half of 8x16 sprite is in the next tile
-					uint8_t tile_idx = sprite.tile_index;
-					if (sprite_height == 16)
-					{
-						// Double tile sprites always start on an even tile index.
-						tile_idx &= 0xFE;
-
-						if (in_tile_y >= 8)
-						{
-							in_tile_y -= 8;
-							tile_idx |= 0x01;
-						}
-					}
+				gb__TileLine line = gb__GetTileLine(gb, 1, tile_idx, (uint8_t)in_tile_y);
+				if (sprite.x_flip == 1)
+				{
+					line.line = gb__ReverseBytes(line.line);
+				}
+				const uint8_t attributes = (sprite.dmg_palette ? GB__OBJ_PALETTE_BIT : 0) |
+						(sprite.priority ? GB__OBJ_BEHIND_BG_BIT : 0);
 
-					const gb__TileLine line = gb__GetTileLine(gb, 1, tile_idx, (uint8_t)in_tile_y);
-					const uint8_t *pal_map = sprite.dmg_palette == 0 ? obp0_map : obp1_map;
+				// Clip against the left and right border.
+				const int in_tile_x_begin = MAX(0, -fb_start_x);
+				const int in_tile_x_end = MIN(8, GB_FRAMEBUFFER_WIDTH - fb_start_x);
 
-					for (int in_tile_x = 0; in_tile_x < 8; ++in_tile_x)
+				for (int in_tile_x = in_tile_x_begin; in_tile_x < in_tile_x_end; ++in_tile_x)
+				{
+					const uint8_t sprite_pixel = line.pixels[in_tile_x];
+					uint8_t *obj_pixel = &obj[fb_start_x + in_tile_x];
+					if (sprite_pixel != 0 && *obj_pixel == 0)  // Not transparent and not masked
 					{
-						const int fb_x = fb_start_x + (sprite.x_flip == 0 ? in_tile_x : 7 - in_tile_x);
-
-						if (fb_x >= 0 && fb_x < GB_FRAMEBUFFER_WIDTH)
-						{
-							const uint8_t sprite_pixel = line.pixels[in_tile_x];
-
-							if (sprite_pixel != 0)  // Not transparent
-							{
-								if (!masked[fb_x] && (transparent[fb_x] || sprite.priority == 0))
-								{
-									scan_line[fb_x] = pal_map[sprite_pixel];
-								}
-								masked[fb_x] = true;
-							}
-						}
+						*obj_pixel = sprite_pixel | attributes;
 					}
 				}
 			}
 		}
 	}
 
-	// Convert values [0, 3] to colors
-	for (size_t fb_x = 0; fb_x < GB_FRAMEBUFFER_WIDTH; ++fb_x)
+	uint8_t line_shades[GB_FRAMEBUFFER_WIDTH];
+	gb__CompositeScanLine(bg, obj, bgp_map, obp_map, line_shades);
+	gb__StoreScanLineShades(gb, gb->ppu.ly, line_shades);
+}
+
+#define GB__FOR_EACH_RENDER_VARIANT(X) \
+	X(0x0) X(0x1) X(0x2) X(0x3) X(0x4) X(0x5) X(0x6) X(0x7) \
+	X(0x8) X(0x9) X(0xA) X(0xB) X(0xC) X(0xD) X(0xE) X(0xF)
+
+typedef void gb__ScanLineRenderer(gb_GameBoy *gb);
+
+#define GB__DEFINE_RENDERER(variant) \
+	static void gb__RenderScanLine_##variant(gb_GameBoy *gb) \
+	{ \
+		gb__RenderScanLineVariant(gb, variant); \
+	}
+GB__FOR_EACH_RENDER_VARIANT(GB__DEFINE_RENDERER)
+#undef GB__DEFINE_RENDERER
+
+#define GB__RENDERER_ENTRY(variant) [variant] = &gb__RenderScanLine_##variant,
+static gb__ScanLineRenderer *const gb__scan_line_renderers[16] = { GB__FOR_EACH_RENDER_VARIANT(GB__RENDERER_ENTRY) };
+#undef GB__RENDERER_ENTRY
+
+#undef GB__FOR_EACH_RENDER_VARIANT
+
+// Picks the renderer variant for the current LCDC value.
+// NOTE: Address modes and tile map selection are cheap to handle at runtime
+// and are not part of the variants.
+static void
+gb__RenderScanLine(gb_GameBoy *gb)
+{
+	const uint8_t lcdc = gb->ppu.lcdc.reg;
+	const uint8_t variant = (lcdc & 0x07u) | ((lcdc >> 2u) & GB__RENDER_WINDOW);
+	gb__scan_line_renderers[variant](gb);
+}
+
+// Returns if the frame currently being drawn is rendered (see gb_SetFrameSkip).
+static inline bool
+gb__RenderFrame(const gb_GameBoy *gb)
+{
+	const uint8_t skip = gb->display.frame_skip;
+	return skip == 0 || (skip != GB_FRAME_SKIP_ALL && gb->display.frame_count % (skip + 1u) == 0);
+}
+
+// Records the registers of the current line instead of rendering it (see
+// gb_SetDeferredRendering).
+static void
+gb__LogScanLine(gb_GameBoy *gb)
+{
+	struct gb_Display *display = &gb->display;
+	const struct gb_Ppu *ppu = &gb->ppu;
+	if (display->log_end != ppu->ly)
+	{
+		// Deferred rendering was enabled in the middle of the frame, the
+		// previous lines have been rendered immediately.
+		gb__ComposeLoggedLines(gb);
+		display->log_begin = ppu->ly;
+	}
+
+	display->line_log[ppu->ly] = (gb_LineRegisters){
+		.lcdc = ppu->lcdc.reg,
+		.scx = ppu->scx,
+		.scy = ppu->scy,
+		.wx = ppu->wx,
+		.wy = ppu->wy,
+		.bgp = ppu->bgp,
+		.obp0 = ppu->obp0,
+		.obp1 = ppu->obp1,
+		.ly_win_internal = ppu->ly_win_internal,
+	};
+	display->log_end = ppu->ly + 1;
+
+	if (gb__WindowVisible(gb))
+	{
+		++gb->ppu.ly_win_internal;
+	}
+}
+
+// Renders all logged lines with their registers and the current VRAM/OAM.
+static void
+gb__ComposeLoggedLines(gb_GameBoy *gb)
+{
+	struct gb_Display *display = &gb->display;
+	if (display->log_begin == display->log_end)
+	{
+		return;
+	}
+
+	const struct gb_Ppu prev_ppu = gb->ppu;
+	for (uint8_t ly = display->log_begin; ly < display->log_end; ++ly)
+	{
+		const gb_LineRegisters *regs = &display->line_log[ly];
+		struct gb_Ppu *ppu = &gb->ppu;
+		if ((regs->lcdc ^ ppu->lcdc.reg) & 0x04u)  // Sprite size, see the write to LCDC
+		{
+			gb->memory.sprite_buckets.valid = false;
+		}
+		ppu->lcdc.reg = regs->lcdc;
+		ppu->scx = regs->scx;
+		ppu->scy = regs->scy;
+		ppu->wx = regs->wx;
+		ppu->wy = regs->wy;
+		ppu->bgp = regs->bgp;
+		ppu->obp0 = regs->obp0;
+		ppu->obp1 = regs->obp1;
+		ppu->ly_win_internal = regs->ly_win_internal;
+		ppu->ly = ly;
+		gb__RenderScanLine(gb);
+	}
+	if ((prev_ppu.lcdc.reg ^ gb->ppu.lcdc.reg) & 0x04u)
 	{
-		gb->display.pixels[GB_FRAMEBUFFER_WIDTH * gb->ppu.ly + fb_x] = gb__DefaultPalette[scan_line[fb_x]];
+		gb->memory.sprite_buckets.valid = false;
 	}
+	gb->ppu = prev_ppu;
+
+	display->log_begin = display->log_end;
 }
 
 #define MODE_HBLANK_LENGTH 204
@@ -3789,7 +4778,9 @@ gb__AdvancePpu(gb_GameBoy *gb, uint16_t elapsed_m_cycles)
 			{
 				stat->mode = GB_PPU_MODE_VBLANK;
 				gb->cpu.interrupt.if_flags.vblank = 1;
-				gb->display.updated = true;
+				gb->display.updated = gb->display.updated || gb__RenderFrame(gb);
+				gb__EndAudioFrame(gb);
+				++gb->display.frame_count;
 
 				if (!prev_int48_signal && stat->interrupt_mode_vblank)
 				{
@@ -3820,6 +4811,11 @@ gb__AdvancePpu(gb_GameBoy *gb, uint16_t elapsed_m_cycles)
 			ppu->ly = 0;
 			gb->ppu.ly_win_internal = 0;
 			gb__CompareLyToLyc(gb, prev_int48_signal);
+
+			// The previous frame hasn't been taken (see gb_TakeDeferredFrame).
+			gb__ComposeLoggedLines(gb);
+			gb->display.log_begin = 0;
+			gb->display.log_end = 0;
 		}
 		if (ppu->mode_clock >= MODE_VBLANK_LINE_LENGTH)
 		{
@@ -3853,7 +4849,22 @@ gb__AdvancePpu(gb_GameBoy *gb, uint16_t elapsed_m_cycles)
 
 			// This is vastly simplified. Ideally the LCD should get updated after
 			// every T cycle. See: https://gbdev.io/pandocs/Rendering.html
-			gb__RenderScanLine(gb);
+			if (gb__RenderFrame(gb))
+			{
+				if (gb->display.deferred)
+				{
+					gb__LogScanLine(gb);
+				}
+				else
+				{
+					gb__RenderScanLine(gb);
+				}
+			}
+			else if (gb__WindowVisible(gb))
+			{
+				// The window line counter has to keep going for the next rendered frame.
+				++gb->ppu.ly_win_internal;
+			}
 		}
 		break;
 	case GB_PPU_MODE_VRAM_SCAN:
@@ -3889,6 +4900,11 @@ gb__AdvancePpu(gb_GameBoy *gb, uint16_t elapsed_m_cycles)
 	assert(stat->mode != GB_PPU_MODE_VRAM_SCAN || ppu->mode_clock < MODE_VRAM_SCAN_LENGTH);
 }
 
+// Periods of the frame sequencer steps in m-cycles
+#define SOUND_LENGTH_PERIOD 4096  // 256 Hz
+#define SOUND_VOLUME_SWEEP_PERIOD 16384  // 64 Hz
+#define SOUND_FREQ_SWEEP_PERIOD 8192  // 128 Hz
+
 static const uint8_t gb__PwmWaveForms[4][8] = {
 	{ 0, 0, 0, 0, 0, 0, 0, 1 },
 	{ 1, 0, 0, 0, 0, 0, 0, 1 },
@@ -3896,6 +4912,14 @@ static const uint8_t gb__PwmWaveForms[4][8] = {
 	{ 0, 1, 1, 1, 1, 1, 1, 0 },
 };
 
+// The DACs map the digital channel outputs in [0, 15] linearly to analog
+// values in [1, -1]. These are the analog values times 15, which lets the mixer
+// work with integers only.
+static const int8_t gb__DacOutput[16] = { 15, 13, 11, 9, 7, 5, 3, 1, -1, -3, -5, -7, -9, -11, -13, -15 };
+
+// Channel 3 output levels (NR32): mute, 100%, 50%, 25%
+static const uint8_t gb__WaveVolumeShifts[4] = { 4, 0, 1, 2 };
+
 static uint16_t
 gb__CalculateSweepFrequency(struct gb_PulseA *ch1)
 {
@@ -3918,13 +4942,130 @@ gb__SoundSampleAdvance(gb_SoundSampleTimer *sample, uint16_t elapsed_m_cycles, u
 {
 	// NOTE: Channel 3 is ticked at 2 MHz, not 1 MHz, and it has 32 samples instead of 8.
 	sample->wave_pos_timer += elapsed_m_cycles * (is_channel_3 ? 2 : 1);
-	uint16_t period = 2048 - freq;
-	while (sample->wave_pos_timer >= period)
+	const uint16_t period = 2048 - freq;
+	if (sample->wave_pos_timer >= period)
+	{
+		const uint16_t num_steps = sample->wave_pos_timer / period;
+		sample->wave_pos_timer -= num_steps * period;
+		sample->wave_pos = (sample->wave_pos + num_steps) % (is_channel_3 ? 32 : 8);
+	}
+}
+
+// NOTE: The following two sources implement the LFSR differently (but the
+// effect should be the same). I follow gbdev.io.
+// - https://gbdev.io/pandocs/Audio_details.html#noise-channel-ch4
+// - https://gbdev.gg8.se/wiki/articles/Gameboy_sound_hardware#Noise_Channel
+static uint16_t
+gb__LfsrStep(uint16_t lfsr, bool is_7_bit)
+{
+	assert((lfsr & 0x8000) == 0);
+	uint16_t xor_bit = ((lfsr >> 1u) & 0x0001) ^ (lfsr & 0x0001);
+	uint16_t eq_bit = (~xor_bit) & 0x0001;
+
+	lfsr |= eq_bit << 15u;
+
+	// For 7-bit mode, copy bit :
+	if (is_7_bit)
+	{
+		lfsr = (lfsr & 0xFF7F) | (eq_bit << 7u);
+	}
+
+	return lfsr >> 1u;
+}
+
+// Apart from the lock-up state (all ones), the LFSR always runs through the
+// same sequence of 2^15 - 1 states (in 7-bit mode, the lower 7 bits run
+// through 2^7 - 1 states). Advancing it by any number of steps is a lookup
+// of the position of the current state in the sequence.
+#define GB__LFSR_15_PERIOD 32767
+#define GB__LFSR_7_PERIOD 127
+#define GB__LFSR_LOCKED 0xFFFF  // Position of the lock-up state
+
+// Filled in by gb__InitTables.
+static struct
+{
+	uint16_t sequence_15[GB__LFSR_15_PERIOD];
+	uint16_t positions_15[1u << 15u];  // Inverse of 'sequence_15'
+	uint8_t sequence_7[GB__LFSR_7_PERIOD];
+	uint16_t positions_7[1u << 7u];
+} gb__lfsr_tables;
+
+static void
+gb__InitLfsrTables(void)
+{
+	memset(gb__lfsr_tables.positions_15, 0xFF, sizeof(gb__lfsr_tables.positions_15));
+	uint16_t lfsr = 0;
+	for (uint16_t pos = 0; pos < GB__LFSR_15_PERIOD; ++pos)
+	{
+		gb__lfsr_tables.sequence_15[pos] = lfsr;
+		gb__lfsr_tables.positions_15[lfsr] = pos;
+		lfsr = gb__LfsrStep(lfsr, false);
+	}
+	assert(lfsr == 0);
+
+	// The lower 7 bits in 7-bit mode don't depend on the upper ones.
+	memset(gb__lfsr_tables.positions_7, 0xFF, sizeof(gb__lfsr_tables.positions_7));
+	lfsr = 0;
+	for (uint16_t pos = 0; pos < GB__LFSR_7_PERIOD; ++pos)
+	{
+		gb__lfsr_tables.sequence_7[pos] = (uint8_t)lfsr;
+		gb__lfsr_tables.positions_7[lfsr] = pos;
+		lfsr = gb__LfsrStep(lfsr, true) & 0x7F;
+	}
+	assert(lfsr == 0);
+}
+
+static uint16_t
+gb__LfsrAdvance(uint16_t lfsr, bool is_7_bit, uint32_t num_steps)
+{
+	if (!is_7_bit)
+	{
+		const uint16_t pos = gb__lfsr_tables.positions_15[lfsr];
+		return pos == GB__LFSR_LOCKED ? lfsr : gb__lfsr_tables.sequence_15[(pos + num_steps) % GB__LFSR_15_PERIOD];
+	}
+
+	// In 7-bit mode, the upper 8 bits only hold the feedback bits of the last
+	// 8 steps. Jump with the lower 7 bits and compute the upper ones with the
+	// final 8 steps.
+	if (num_steps > 8)
+	{
+		const uint16_t pos = gb__lfsr_tables.positions_7[lfsr & 0x7F];
+		if (pos != GB__LFSR_LOCKED)
+		{
+			lfsr = (lfsr & 0x7F80) | gb__lfsr_tables.sequence_7[(pos + num_steps - 8) % GB__LFSR_7_PERIOD];
+		}
+		num_steps = 8;
+	}
+	for (; num_steps > 0; --num_steps)
+	{
+		lfsr = gb__LfsrStep(lfsr, true);
+	}
+	return lfsr;
+}
+
+// Returns the number of m-cycles between two LFSR steps, 0 if the LFSR is not
+// clocked at all.
+static uint32_t
+gb__NoisePeriod(const struct gb_Noise *ch4)
+{
+	// With clock shifts 14 and 15 the LFSR doesn't get clocked at all.
+	// See: https://gbdev.io/pandocs/Audio_Registers.html#ff22--nr43-channel-4-frequency--randomness
+	if (ch4->nr43.clock_shift >= 14)
+	{
+		return 0;
+	}
+
+	uint32_t period = 1u << ch4->nr43.clock_shift;
+	period *= 4;  // Because LFSR is ticket at 256 MHz, not 1 GHz.
+	if (ch4->nr43.clock_div == 0)
+	{
+		period >>= 1;
+	}
+	else
 	{
-		sample->wave_pos_timer -= period;
-		++sample->wave_pos;
-		sample->wave_pos %= (is_channel_3 ? 32 : 8);
+		period *= ch4->nr43.clock_div;
 	}
+	return period;
 }
 
 // Returns true if the channel needs to be disabled.
@@ -3934,9 +5075,9 @@ gb__SoundTimeoutAdvance(gb_SoundTimeout *timeout, uint16_t elapsed_m_cycles, uin
 	bool disable = false;
 
 	timeout->length_timer += elapsed_m_cycles;
-	if (timeout->length_timer >= 4096)  // 256 Hz
+	if (timeout->length_timer >= SOUND_LENGTH_PERIOD)
 	{
-		timeout->length_timer -= 4096;
+		timeout->length_timer -= SOUND_LENGTH_PERIOD;
 
 		// Timeout
 		if (timeout_enabled && timeout->length_counter > 0)
@@ -3959,9 +5100,9 @@ static void
 gb__VolumeSweepAdvance(gb_SoundVolumeSweep *vol_sweep, uint16_t elapsed_m_cycles)
 {
 	vol_sweep->volume_timer += elapsed_m_cycles;
-	if (vol_sweep->volume_timer >= 16384)  // 64 Hz
+	if (vol_sweep->volume_timer >= SOUND_VOLUME_SWEEP_PERIOD)
 	{
-		vol_sweep->volume_timer -= 16384;
+		vol_sweep->volume_timer -= SOUND_VOLUME_SWEEP_PERIOD;
 
 		if (vol_sweep->current_sweep_pace > 0)
 		{
@@ -3989,117 +5130,467 @@ gb__VolumeSweepAdvance(gb_SoundVolumeSweep *vol_sweep, uint16_t elapsed_m_cycles
 	}
 }
 
+// We should pump out a new sample every 1024 * 1024 / 48 kHz.
+// This is not an integral number, therefore let's go via the LCM.
+//
+// LCM of 48k and 1 MHz is 375 * 1024 * 1024 == 8192 * 48000
+//
+// Returns the sampling period in units of 'clock_acc' which is advanced by 375
+// per m-cycle.
+static inline uint64_t
+gb__SamplingPeriod(const gb_GameBoy *gb)
+{
+	uint64_t sampling_period = 8192;
+	if (gb->apu.speed_multiplier_shift > 0)
+	{
+		sampling_period <<= gb->apu.speed_multiplier_shift;
+	}
+	else if (gb->apu.speed_multiplier_shift < 0)
+	{
+		sampling_period >>= -gb->apu.speed_multiplier_shift;
+	}
+	assert((sampling_period & (sampling_period - 1)) == 0);  // POT
+	return sampling_period;
+}
+
 static void
-gb__AdvanceApu(gb_GameBoy *gb, uint16_t elapsed_m_cycles)
+gb__DeliverAudio(gb_GameBoy *gb)
 {
-	// Advance timers, triggering, and sweeps.
-	//
-	// NOTE: Everything is advanced as long as audio is not off. Even if the
-	// channels or their DACs are off, the timers still advance.
-	if (gb->apu.audio_enable)
+	struct gb_Apu *apu = &gb->apu;
+	if (apu->num_buffered_samples > 0 && apu->callback)
 	{
-		{  // Channel 1
-			struct gb_PulseA *ch1 = &gb->apu.ch1;
+		const size_t sample_size = apu->format == GB_AUDIO_FORMAT_S16 ? sizeof(int16_t) : sizeof(int8_t);
+		apu->callback(apu->callback_user_data, apu->buffer, apu->num_buffered_samples * 2u * sample_size,
+				apu->buffer_m_cycle);
+	}
+	apu->num_buffered_samples = 0;
+}
 
-			// TODO(steaflie): Trigger could also directly go into memory write
-			// procedure. Consider it.
-			if (ch1->trigger == 1 && ch1->dac_enable)
-			{
-				ch1->trigger = 0;
-				ch1->channel_enable = true;
+// Scales the mixer output in [-480, 480] (see gb__AdvanceApu) to the int16_t range.
+#define GB__AUDIO_S16_SCALE 68
 
-				// Length counter only resets to max if it was on 0.
-				// See: https://gbdev.gg8.se/wiki/articles/Gameboy_sound_hardware#Length_Counter
-				if (ch1->timeout.length_counter == 0)
-				{
-					ch1->timeout.length_counter = 64;
-				}
+// Appends a stereo sample to the chunk and delivers it if it's complete.
+// 'mix' is the output of the mixer, 'age' is how long ago the sample was due
+// in units of 'clock_acc'.
+static void
+gb__BufferAudioSample(gb_GameBoy *gb, const int mix[2], uint64_t age)
+{
+	struct gb_Apu *apu = &gb->apu;
 
-				ch1->volume_sweep.current_volume = ch1->nr12.volume;
-				ch1->volume_sweep.current_sweep_pace = ch1->nr12.volume_sweep_pace;
-				ch1->volume_sweep.current_envelope_dir = ch1->nr12.envelope_dir;
-				ch1->volume_sweep.sweep_pace_counter = ch1->volume_sweep.current_sweep_pace;
+	uint16_t chunk_size = apu->chunk_size;
+	if (chunk_size == GB_AUDIO_CHUNK_PER_FRAME)
+	{
+		// The first sample after V-Blank starts a new chunk.
+		if (apu->chunk_frame_count != gb->display.frame_count)
+		{
+			apu->chunk_frame_count = gb->display.frame_count;
+			gb__DeliverAudio(gb);
+		}
+		chunk_size = GB_AUDIO_MAX_CHUNK_SIZE;
+	}
 
-				ch1->freq_sweep_enable = ch1->nr10.freq_sweep_pace != 0 || ch1->nr10.freq_sweep_step != 0;
-				ch1->freq_sweep_pace_counter = ch1->nr10.freq_sweep_pace;
-				if (ch1->freq_sweep_pace_counter == 0)
-				{
-					ch1->freq_sweep_pace_counter = 8;
-				}
-				ch1->freq_shadow_period = ch1->period;
-			}
+	if (apu->num_buffered_samples == 0)
+	{
+		apu->buffer_m_cycle = gb->scheduler.apu_last_sync - age / 375;
+	}
+	if (apu->format == GB_AUDIO_FORMAT_S16)
+	{
+		int16_t *samples = &apu->buffer[2 * apu->num_buffered_samples];
+		samples[0] = (int16_t)(mix[0] * GB__AUDIO_S16_SCALE);
+		samples[1] = (int16_t)(mix[1] * GB__AUDIO_S16_SCALE);
+	}
+	else
+	{
+		// NOTE: Truncated (not rounded) for compatibility with older versions.
+		int8_t *samples = &((int8_t *)apu->buffer)[2 * apu->num_buffered_samples];
+		samples[0] = (int8_t)(mix[0] / 15);
+		samples[1] = (int8_t)(mix[1] / 15);
+	}
+	++apu->num_buffered_samples;
 
-			gb__SoundSampleAdvance(&ch1->wave_timer, elapsed_m_cycles, ch1->period, false);
+	if (apu->num_buffered_samples >= chunk_size)
+	{
+		gb__DeliverAudio(gb);
+	}
+}
 
-			if (gb__SoundTimeoutAdvance(&ch1->timeout, elapsed_m_cycles, ch1->length_enable))
-			{
-				ch1->channel_enable = false;
-			}
+// Sums up the DAC outputs (see gb__DacOutput) of the channels on each side and
+// applies the master volume. The result is in [-480, 480].
+static void
+gb__MixChannels(const gb_GameBoy *gb, int mix[2])
+{
+	mix[0] = 0;
+	mix[1] = 0;
+	if (!gb->apu.audio_enable)
+	{
+		return;
+	}
 
-			gb__VolumeSweepAdvance(&ch1->volume_sweep, elapsed_m_cycles);
+	const struct gb_PulseA *ch1 = &gb->apu.ch1;
+	const struct gb_PulseB *ch2 = &gb->apu.ch2;
+	const struct gb_Wave *ch3 = &gb->apu.ch3;
+	const struct gb_Noise *ch4 = &gb->apu.ch4;
 
-			// Frequency sweep
-			ch1->freq_timer += elapsed_m_cycles;
-			if (ch1->freq_timer >= 8192)  // 128 Hz
-			{
-				ch1->freq_timer -= 8192;
+	// TODO(stefalie): Add a GUI/debugger option to selectively disable channels.
 
-				if (ch1->freq_sweep_pace_counter > 0)
-				{
-					--ch1->freq_sweep_pace_counter;
-				}
-				if (ch1->freq_sweep_pace_counter == 0)
-				{
-					ch1->freq_sweep_pace_counter = ch1->nr10.freq_sweep_pace;
-					if (ch1->freq_sweep_pace_counter == 0)
-					{
-						ch1->freq_sweep_pace_counter = 8;
-					}
+	if (ch1->channel_enable)
+	{
+		assert(ch1->dac_enable);
 
-					if (ch1->freq_sweep_enable && ch1->nr10.freq_sweep_pace > 0)
-					{
-						// NOTE: This is so weird, but see:
-						// - https://nightshade256.github.io/2021/03/27/gb-sound-emulation.html
-						// - https://gbdev.gg8.se/wiki/articles/Gameboy_sound_hardware#Frequency_Sweep
-						uint16_t new_period = gb__CalculateSweepFrequency(ch1);
+		const int8_t output = gb__DacOutput[ch1->volume_sweep.current_volume *
+				gb__PwmWaveForms[ch1->nr11.duty_cycle][ch1->wave_timer.wave_pos]];
+		if (gb->apu.nr51.ch1_left == 1)
+		{
+			mix[0] += output;
+		}
+		if (gb->apu.nr51.ch1_right == 1)
+		{
+			mix[1] += output;
+		}
+	}
 
-						if (new_period < 2048 && ch1->nr10.freq_sweep_step > 0)
-						{
-							ch1->freq_shadow_period = new_period;
-							// Write period back to registers.
-							ch1->period = new_period;
+	if (ch2->channel_enable)
+	{
+		assert(ch2->dac_enable);
 
-							// Run overflow check again.
-							gb__CalculateSweepFrequency(ch1);
-						}
-					}
-				}
-			}
+		const int8_t output = gb__DacOutput[ch2->volume_sweep.current_volume *
+				gb__PwmWaveForms[ch2->nr21.duty_cycle][ch2->wave_timer.wave_pos]];
+		if (gb->apu.nr51.ch2_left == 1)
+		{
+			mix[0] += output;
+		}
+		if (gb->apu.nr51.ch2_right == 1)
+		{
+			mix[1] += output;
 		}
+	}
 
-		{  // Channel 2
-			struct gb_PulseB *ch2 = &gb->apu.ch2;
+	if (ch3->channel_enable)
+	{
+		assert(ch3->nr30.dac_enable);
+		uint8_t pos = ch3->wave_timer.wave_pos;
+		// NOTE: I think Argentum does the wrong thing here. Upper nibble comes first.
+		uint8_t sample = (gb->apu.wave_pattern[pos / 2] >> ((pos & 0x01) == 0 ? 4u : 0u)) & 0x0F;
 
-			if (ch2->trigger == 1 && ch2->dac_enable)
-			{
-				ch2->trigger = 0;
-				ch2->channel_enable = true;
+		const int8_t output = gb__DacOutput[sample >> gb__WaveVolumeShifts[ch3->nr32.output_level]];
+		if (gb->apu.nr51.ch3_left == 1)
+		{
+			mix[0] += output;
+		}
+		if (gb->apu.nr51.ch3_right == 1)
+		{
+			mix[1] += output;
+		}
+	}
 
-				if (ch2->timeout.length_counter == 0)
-				{
-					ch2->timeout.length_counter = 64;
-				}
+	if (ch4->channel_enable)
+	{
+		assert(ch4->dac_enable);
 
-				ch2->volume_sweep.current_volume = ch2->nr22.volume;
-				ch2->volume_sweep.current_sweep_pace = ch2->nr22.volume_sweep_pace;
-				ch2->volume_sweep.current_envelope_dir = ch2->nr22.envelope_dir;
-				ch2->volume_sweep.sweep_pace_counter = ch2->volume_sweep.current_sweep_pace;
-			}
+		const int8_t output = gb__DacOutput[ch4->volume_sweep.current_volume * (ch4->lfsr_state & 0x0001)];
+		if (gb->apu.nr51.ch4_left == 1)
+		{
+			mix[0] += output;
+		}
+		if (gb->apu.nr51.ch4_right == 1)
+		{
+			mix[1] += output;
+		}
+	}
 
-			gb__SoundSampleAdvance(&ch2->wave_timer, elapsed_m_cycles, ch2->period, false);
+	// Master volume in [1, 8]
+	mix[0] *= gb->apu.nr50.left_volume + 1;
+	mix[1] *= gb->apu.nr50.right_volume + 1;
+}
 
-			if (gb__SoundTimeoutAdvance(&ch2->timeout, elapsed_m_cycles, ch2->length_enable))
-			{
+// Band-limited synthesis (see gb_SetAudioSynthesis)
+//
+// A step of the mixer output is added to 'blip_deltas' as a band-limited
+// impulse (windowed sinc) at the exact position of the step. Reading out the
+// samples integrates the impulses back into steps. The impulses are
+// precomputed for GB__BLIP_PHASES positions in between two samples.
+// See also: http://www.slack.net/~ant/bl-synth/
+#define GB__BLIP_PHASES 32
+#define GB__BLIP_TAPS 16  // The output is delayed by half of that
+#define GB__BLIP_FRAC_BITS 15
+
+// Filled in by gb__InitTables.
+static struct
+{
+	int32_t kernels[GB__BLIP_PHASES][GB__BLIP_TAPS];
+} gb__blip_tables;
+
+static void
+gb__InitBlipKernels(void)
+{
+	const double pi = 3.14159265358979323846;
+	const double cutoff = 0.85;  // Relative to the Nyquist frequency
+	for (int phase = 0; phase < GB__BLIP_PHASES; ++phase)
+	{
+		double impulse[GB__BLIP_TAPS];
+		double sum = 0.0;
+		for (int i = 0; i < GB__BLIP_TAPS; ++i)
+		{
+			// Distance to the center of the impulse in samples.
+			const double x = i - (double)phase / GB__BLIP_PHASES - GB__BLIP_TAPS / 2;
+			const double sinc = x == 0.0 ? 1.0 : sin(pi * cutoff * x) / (pi * cutoff * x);
+			// Blackman window over [-TAPS / 2 - 1, TAPS / 2]
+			const double t = (x + GB__BLIP_TAPS / 2 + 1) / (GB__BLIP_TAPS + 1);
+			const double window = 0.42 - 0.5 * cos(2.0 * pi * t) + 0.08 * cos(4.0 * pi * t);
+			impulse[i] = sinc * window;
+			sum += impulse[i];
+		}
+
+		// Each impulse has to sum up to exactly 1, otherwise the steps would
+		// accumulate errors. The rounding error goes to the largest tap.
+		int32_t int_sum = 0;
+		int largest = 0;
+		for (int i = 0; i < GB__BLIP_TAPS; ++i)
+		{
+			gb__blip_tables.kernels[phase][i] = (int32_t)lround(impulse[i] / sum * (1 << GB__BLIP_FRAC_BITS));
+			int_sum += gb__blip_tables.kernels[phase][i];
+			if (impulse[i] > impulse[largest])
+			{
+				largest = i;
+			}
+		}
+		gb__blip_tables.kernels[phase][largest] += (1 << GB__BLIP_FRAC_BITS) - int_sum;
+	}
+}
+
+// The LFSR and band-limited synthesis tables are the same for all GameBoys.
+// They are built exactly once, by whichever thread loads a ROM first, the
+// others wait until they are complete.
+enum
+{
+	GB__TABLES_UNINITIALIZED,
+	GB__TABLES_INITIALIZING,
+	GB__TABLES_INITIALIZED,
+};
+
+#if defined(_MSC_VER) && !defined(__clang__)
+// The interlocked intrinsics are full barriers.
+static volatile long gb__tables_state;
+#define GB__TABLES_STATE_LOAD() _InterlockedOr(&gb__tables_state, 0)
+#define GB__TABLES_STATE_CLAIM() \
+	(_InterlockedCompareExchange(&gb__tables_state, GB__TABLES_INITIALIZING, GB__TABLES_UNINITIALIZED) == \
+			GB__TABLES_UNINITIALIZED)
+#define GB__TABLES_STATE_PUBLISH() _InterlockedExchange(&gb__tables_state, GB__TABLES_INITIALIZED)
+#else
+static atomic_int gb__tables_state;
+#define GB__TABLES_STATE_LOAD() atomic_load_explicit(&gb__tables_state, memory_order_acquire)
+#define GB__TABLES_STATE_CLAIM() \
+	atomic_compare_exchange_strong_explicit(&gb__tables_state, &(int){ GB__TABLES_UNINITIALIZED }, \
+			GB__TABLES_INITIALIZING, memory_order_acquire, memory_order_acquire)
+#define GB__TABLES_STATE_PUBLISH() \
+	atomic_store_explicit(&gb__tables_state, GB__TABLES_INITIALIZED, memory_order_release)
+#endif
+
+static void
+gb__InitTables(void)
+{
+	if (GB__TABLES_STATE_LOAD() == GB__TABLES_INITIALIZED)
+	{
+		return;
+	}
+
+	if (GB__TABLES_STATE_CLAIM())
+	{
+		gb__InitLfsrTables();
+		gb__InitBlipKernels();
+		GB__TABLES_STATE_PUBLISH();
+		return;
+	}
+
+	// Another thread is building them, that only takes a fraction of a millisecond.
+	while (GB__TABLES_STATE_LOAD() != GB__TABLES_INITIALIZED)
+	{
+	}
+}
+
+// Adds the steps from the last mixer output to 'mix' at the current time.
+static void
+gb__AddBlipSteps(gb_GameBoy *gb, const int mix[2], uint64_t sampling_period)
+{
+	struct gb_Apu *apu = &gb->apu;
+	const uint64_t pos = apu->clock_acc / sampling_period;
+	const uint64_t phase = (apu->clock_acc % sampling_period) * GB__BLIP_PHASES / sampling_period;
+	assert(pos + GB__BLIP_TAPS <= sizeof(apu->blip_deltas) / sizeof(apu->blip_deltas[0]));
+
+	for (int side = 0; side < 2; ++side)
+	{
+		const int32_t delta = mix[side] - apu->blip_amplitudes[side];
+		if (delta != 0)
+		{
+			apu->blip_amplitudes[side] = mix[side];
+			for (int i = 0; i < GB__BLIP_TAPS; ++i)
+			{
+				apu->blip_deltas[pos + i][side] += delta * gb__blip_tables.kernels[phase][i];
+			}
+		}
+	}
+}
+
+// Reads out all samples that no future step can affect anymore.
+static void
+gb__ReadBlipSamples(gb_GameBoy *gb, uint64_t sampling_period)
+{
+	struct gb_Apu *apu = &gb->apu;
+	const uint64_t num_samples = apu->clock_acc / sampling_period;
+	if (num_samples == 0)
+	{
+		return;
+	}
+
+	for (uint64_t i = 0; i < num_samples; ++i)
+	{
+		int mix[2];
+		for (int side = 0; side < 2; ++side)
+		{
+			apu->blip_sums[side] += apu->blip_deltas[i][side];
+			// Rounded, the overshoot at the steps can slightly exceed the range of the mixer.
+			const int32_t sample = (apu->blip_sums[side] + (1 << (GB__BLIP_FRAC_BITS - 1))) >> GB__BLIP_FRAC_BITS;
+			mix[side] = CLAMP(sample, -480, 480);
+		}
+		gb__BufferAudioSample(gb, mix, apu->clock_acc - i * sampling_period);
+	}
+
+	// Only the impulses of the last steps reach beyond the samples read.
+	memmove(apu->blip_deltas, &apu->blip_deltas[num_samples], GB__BLIP_TAPS * sizeof(apu->blip_deltas[0]));
+	memset(&apu->blip_deltas[GB__BLIP_TAPS], 0, num_samples * sizeof(apu->blip_deltas[0]));
+	apu->clock_acc -= num_samples * sampling_period;
+}
+
+// Reads out the samples of the frame that just ended in one go. Called by the
+// PPU right before the frame count is incremented.
+static void
+gb__EndAudioFrame(gb_GameBoy *gb)
+{
+	struct gb_Apu *apu = &gb->apu;
+	if (!apu->callback || apu->synthesis != GB_AUDIO_SYNTHESIS_BAND_LIMITED)
+	{
+		return;
+	}
+
+	gb__SyncApu(gb);
+	if (apu->chunk_size == GB_AUDIO_CHUNK_PER_FRAME)
+	{
+		gb__DeliverAudio(gb);
+		apu->chunk_frame_count = gb->display.frame_count + 1;
+	}
+}
+
+static void
+gb__AdvanceApu(gb_GameBoy *gb, uint16_t elapsed_m_cycles)
+{
+	// Advance timers, triggering, and sweeps.
+	//
+	// NOTE: Everything is advanced as long as audio is not off. Even if the
+	// channels or their DACs are off, the timers still advance.
+	if (gb->apu.audio_enable)
+	{
+		{  // Channel 1
+			struct gb_PulseA *ch1 = &gb->apu.ch1;
+
+			// TODO(steaflie): Trigger could also directly go into memory write
+			// procedure. Consider it.
+			if (ch1->trigger == 1 && ch1->dac_enable)
+			{
+				ch1->trigger = 0;
+				ch1->channel_enable = true;
+
+				// Length counter only resets to max if it was on 0.
+				// See: https://gbdev.gg8.se/wiki/articles/Gameboy_sound_hardware#Length_Counter
+				if (ch1->timeout.length_counter == 0)
+				{
+					ch1->timeout.length_counter = 64;
+				}
+
+				ch1->volume_sweep.current_volume = ch1->nr12.volume;
+				ch1->volume_sweep.current_sweep_pace = ch1->nr12.volume_sweep_pace;
+				ch1->volume_sweep.current_envelope_dir = ch1->nr12.envelope_dir;
+				ch1->volume_sweep.sweep_pace_counter = ch1->volume_sweep.current_sweep_pace;
+
+				ch1->freq_sweep_enable = ch1->nr10.freq_sweep_pace != 0 || ch1->nr10.freq_sweep_step != 0;
+				ch1->freq_sweep_pace_counter = ch1->nr10.freq_sweep_pace;
+				if (ch1->freq_sweep_pace_counter == 0)
+				{
+					ch1->freq_sweep_pace_counter = 8;
+				}
+				ch1->freq_shadow_period = ch1->period;
+			}
+
+			gb__SoundSampleAdvance(&ch1->wave_timer, elapsed_m_cycles, ch1->period, false);
+
+			if (gb__SoundTimeoutAdvance(&ch1->timeout, elapsed_m_cycles, ch1->length_enable))
+			{
+				ch1->channel_enable = false;
+			}
+
+			gb__VolumeSweepAdvance(&ch1->volume_sweep, elapsed_m_cycles);
+
+			// Frequency sweep
+			ch1->freq_timer += elapsed_m_cycles;
+			if (ch1->freq_timer >= SOUND_FREQ_SWEEP_PERIOD)
+			{
+				ch1->freq_timer -= SOUND_FREQ_SWEEP_PERIOD;
+
+				if (ch1->freq_sweep_pace_counter > 0)
+				{
+					--ch1->freq_sweep_pace_counter;
+				}
+				if (ch1->freq_sweep_pace_counter == 0)
+				{
+					ch1->freq_sweep_pace_counter = ch1->nr10.freq_sweep_pace;
+					if (ch1->freq_sweep_pace_counter == 0)
+					{
+						ch1->freq_sweep_pace_counter = 8;
+					}
+
+					if (ch1->freq_sweep_enable && ch1->nr10.freq_sweep_pace > 0)
+					{
+						// NOTE: This is so weird, but see:
+						// - https://nightshade256.github.io/2021/03/27/gb-sound-emulation.html
+						// - https://gbdev.gg8.se/wiki/articles/Gameboy_sound_hardware#Frequency_Sweep
+						uint16_t new_period = gb__CalculateSweepFrequency(ch1);
+
+						if (new_period < 2048 && ch1->nr10.freq_sweep_step > 0)
+						{
+							ch1->freq_shadow_period = new_period;
+							// Write period back to registers.
+							ch1->period = new_period;
+
+							// Run overflow check again.
+							gb__CalculateSweepFrequency(ch1);
+						}
+					}
+				}
+			}
+		}
+
+		{  // Channel 2
+			struct gb_PulseB *ch2 = &gb->apu.ch2;
+
+			if (ch2->trigger == 1 && ch2->dac_enable)
+			{
+				ch2->trigger = 0;
+				ch2->channel_enable = true;
+
+				if (ch2->timeout.length_counter == 0)
+				{
+					ch2->timeout.length_counter = 64;
+				}
+
+				ch2->volume_sweep.current_volume = ch2->nr22.volume;
+				ch2->volume_sweep.current_sweep_pace = ch2->nr22.volume_sweep_pace;
+				ch2->volume_sweep.current_envelope_dir = ch2->nr22.envelope_dir;
+				ch2->volume_sweep.sweep_pace_counter = ch2->volume_sweep.current_sweep_pace;
+			}
+
+			gb__SoundSampleAdvance(&ch2->wave_timer, elapsed_m_cycles, ch2->period, false);
+
+			if (gb__SoundTimeoutAdvance(&ch2->timeout, elapsed_m_cycles, ch2->length_enable))
+			{
 				ch2->channel_enable = false;
 			}
 
@@ -4147,273 +5638,2050 @@ gb__AdvanceApu(gb_GameBoy *gb, uint16_t elapsed_m_cycles)
 				ch4->volume_sweep.sweep_pace_counter = ch4->volume_sweep.current_sweep_pace;
 			}
 
-			uint16_t period = 1u << ch4->nr43.clock_shift;
-			period *= 4;  // Because LFSR is ticket at 256 MHz, not 1 GHz.
-			if (ch4->nr43.clock_div == 0)
+			const uint32_t period = gb__NoisePeriod(ch4);
+			if (period > 0)
 			{
-				period >>= 1;
+				ch4->lfsr_timer += elapsed_m_cycles;
+				if (ch4->lfsr_timer >= period)
+				{
+					const uint32_t num_steps = ch4->lfsr_timer / period;
+					ch4->lfsr_timer -= num_steps * period;
+					ch4->lfsr_state = gb__LfsrAdvance(ch4->lfsr_state, ch4->nr43.lfsr_width == 1, num_steps);
+				}
 			}
-			else
+
+			if (gb__SoundTimeoutAdvance(&ch4->timeout, elapsed_m_cycles, ch4->nr44.length_enable))
 			{
-				period *= ch4->nr43.clock_div;
+				ch4->channel_enable = false;
 			}
 
-			ch4->lfsr_timer += elapsed_m_cycles;
-			while (ch4->lfsr_timer >= period)
-			{
-				ch4->lfsr_timer -= period;
+			gb__VolumeSweepAdvance(&ch4->volume_sweep, elapsed_m_cycles);
+		}
+	}
+
+	// Create a 48 kHz sample if it's time.
+	gb->apu.clock_acc += elapsed_m_cycles * 375;
+	const uint64_t sampling_period = gb__SamplingPeriod(gb);
+	if (!gb->apu.callback)
+	{
+		// Only keep the phase.
+		gb->apu.clock_acc %= sampling_period;
+	}
+	else if (gb->apu.synthesis == GB_AUDIO_SYNTHESIS_BAND_LIMITED)
+	{
+		// NOTE: gb__SyncApu splits the elapsed cycles at each step of the
+		// channel outputs, i.e., any change happened right now.
+		int mix[2];
+		gb__MixChannels(gb, mix);
+		gb__AddBlipSteps(gb, mix, sampling_period);
+		gb__ReadBlipSamples(gb, sampling_period);
+	}
+	else
+	{
+		// NOTE: This should only do more than 1 iteration when switching from a higher
+		// speed to a lower one.
+		while (gb->apu.clock_acc >= sampling_period)
+		{
+			gb->apu.clock_acc -= sampling_period;
 
-				// NOTE: The following two sources implement the LFSR differently (but the
-				// effect should be the same). I follow gbdev.io.
-				// - https://gbdev.io/pandocs/Audio_details.html#noise-channel-ch4
-				// - https://gbdev.gg8.se/wiki/articles/Gameboy_sound_hardware#Noise_Channel
-				assert((ch4->lfsr_state & 0x8000) == 0);
-				uint16_t xor_bit = ((ch4->lfsr_state >> 1u) & 0x0001) ^ (ch4->lfsr_state & 0x0001);
-				uint16_t eq_bit = (~xor_bit) & 0x0001;
+			int mix[2];
+			gb__MixChannels(gb, mix);
+			gb__BufferAudioSample(gb, mix, gb->apu.clock_acc);
+		}
+	}
+}
 
-				ch4->lfsr_state |= eq_bit << 15u;
+// Upper bound for how far in the future a deadline can be. This keeps the
+// number of cycles that the gb__Advance* functions have to catch up with small.
+#define SCHEDULER_MAX_DISTANCE 4096
 
-				// For 7-bit mode, copy bit :
-				if (ch4->nr43.lfsr_width == 1)
-				{
-					ch4->lfsr_state = (ch4->lfsr_state & 0xFF7F) | (eq_bit << 7u);
-				}
+// NOTE: The gb__Advance* functions handle at most one mode change, frame
+// sequencer step, etc. per call. This is fine as long as they are synced at
+// the latest at the end of the instruction during which the deadline passed
+// (the APU is an exception, see gb__SyncApu).
+// Syncing them earlier (e.g., before register writes) doesn't change anything
+// as all their counters are simply accumulated.
 
-				ch4->lfsr_state >>= 1u;
-			}
+static void
+gb__SyncPpu(gb_GameBoy *gb)
+{
+	struct gb_Scheduler *sched = &gb->scheduler;
+	const uint64_t elapsed_m_cycles = sched->now - sched->ppu_last_sync;
+	sched->ppu_last_sync = sched->now;
 
-			if (gb__SoundTimeoutAdvance(&ch4->timeout, elapsed_m_cycles, ch4->nr44.length_enable))
+	// Cycles can be dropped while the LCD is off, the PPU doesn't advance anyway.
+	if (elapsed_m_cycles > 0 && gb->ppu.lcdc.lcd_enable)
+	{
+		assert(elapsed_m_cycles <= 0xFFFF);
+		gb__AdvancePpu(gb, (uint16_t)elapsed_m_cycles);
+	}
+}
+
+static void
+gb__SchedulePpu(gb_GameBoy *gb)
+{
+	const struct gb_Ppu *ppu = &gb->ppu;
+
+	uint64_t deadline = SCHEDULER_NEVER;
+	if (ppu->lcdc.lcd_enable)
+	{
+		uint16_t mode_length = 0;
+		switch (ppu->stat.mode)
+		{
+		case GB_PPU_MODE_HBLANK:
+			mode_length = MODE_HBLANK_LENGTH;
+			break;
+		case GB_PPU_MODE_VBLANK:
+			// The LY update of line 153 comes early, see gb__AdvancePpu.
+			mode_length = ppu->ly == 153 ? 56 : MODE_VBLANK_LINE_LENGTH;
+			break;
+		case GB_PPU_MODE_OAM_SCAN:
+			mode_length = MODE_OAM_SCAN_LENGTH;
+			break;
+		case GB_PPU_MODE_VRAM_SCAN:
+			mode_length = MODE_VRAM_SCAN_LENGTH;
+			break;
+		}
+		assert(ppu->mode_clock < mode_length);
+
+		// 'mode_clock' is in dots, 4 per m-cycle.
+		deadline = gb->scheduler.ppu_last_sync + (mode_length - ppu->mode_clock + 3u) / 4u;
+	}
+	gb__SetDeadline(gb, &gb->scheduler.ppu_deadline, deadline);
+}
+
+static void
+gb__SyncTimer(gb_GameBoy *gb)
+{
+	struct gb_Scheduler *sched = &gb->scheduler;
+	const uint64_t elapsed_m_cycles = sched->now - sched->timer_last_sync;
+	sched->timer_last_sync = sched->now;
+
+	if (elapsed_m_cycles > 0)
+	{
+		gb__UpdateClockAndTimer(gb, elapsed_m_cycles);
+	}
+}
+
+static void
+gb__ScheduleTimer(gb_GameBoy *gb)
+{
+	const struct gb_Timer *timer = &gb->timer;
+
+	// Nothing ever happens if the CPU is stopped.
+	uint64_t num_m_cycles = gb->cpu.stop ? SCHEDULER_NEVER : SCHEDULER_MAX_DISTANCE;
+	if (!gb->cpu.stop)
+	{
+		// DIV and TIMA increments are not events, they are computed on the fly
+		// when read. Only the TIMA overflow (interrupt) is.
+		if (timer->tac.enable)
+		{
+			if (timer->reset)
 			{
-				ch4->channel_enable = false;
+				// Must happen at the end of the current instruction.
+				num_m_cycles = 0;
+			}
+			else
+			{
+				const uint32_t overflow = (256u - timer->tima) * gb__TimerPeriod(gb);
+				const uint32_t until_overflow =
+						overflow > timer->remaining_m_cycles ? overflow - timer->remaining_m_cycles : 0;
+				num_m_cycles = MIN(num_m_cycles, until_overflow);
 			}
+		}
 
-			gb__VolumeSweepAdvance(&ch4->volume_sweep, elapsed_m_cycles);
+		if (gb->serial.interrupt_timer > 0)
+		{
+			num_m_cycles = MIN(num_m_cycles, (uint64_t)gb->serial.interrupt_timer);
+		}
+	}
+
+	const uint64_t deadline =
+			num_m_cycles == SCHEDULER_NEVER ? SCHEDULER_NEVER : gb->scheduler.timer_last_sync + num_m_cycles;
+	gb__SetDeadline(gb, &gb->scheduler.timer_deadline, deadline);
+}
+
+static inline uint16_t
+gb__CyclesUntil(uint16_t timer, uint16_t period)
+{
+	assert(timer < period);
+	return period - timer;
+}
+
+// Returns the number of m-cycles until the next length, volume sweep, or
+// frequency sweep step of any channel.
+static uint16_t
+gb__CyclesUntilApuStep(const struct gb_Apu *apu)
+{
+	if (!apu->audio_enable)
+	{
+		return 0xFFFF;  // Nothing advances.
+	}
+
+	uint16_t num_m_cycles = gb__CyclesUntil(apu->ch1.freq_timer, SOUND_FREQ_SWEEP_PERIOD);
+	num_m_cycles = MIN(num_m_cycles, gb__CyclesUntil(apu->ch1.timeout.length_timer, SOUND_LENGTH_PERIOD));
+	num_m_cycles = MIN(num_m_cycles, gb__CyclesUntil(apu->ch2.timeout.length_timer, SOUND_LENGTH_PERIOD));
+	num_m_cycles = MIN(num_m_cycles, gb__CyclesUntil(apu->ch3.timeout.length_timer, SOUND_LENGTH_PERIOD));
+	num_m_cycles = MIN(num_m_cycles, gb__CyclesUntil(apu->ch4.timeout.length_timer, SOUND_LENGTH_PERIOD));
+	num_m_cycles = MIN(num_m_cycles, gb__CyclesUntil(apu->ch1.volume_sweep.volume_timer, SOUND_VOLUME_SWEEP_PERIOD));
+	num_m_cycles = MIN(num_m_cycles, gb__CyclesUntil(apu->ch2.volume_sweep.volume_timer, SOUND_VOLUME_SWEEP_PERIOD));
+	num_m_cycles = MIN(num_m_cycles, gb__CyclesUntil(apu->ch4.volume_sweep.volume_timer, SOUND_VOLUME_SWEEP_PERIOD));
+	return num_m_cycles;
+}
+
+// 'num_steps' is the number of wave position steps until the output changes.
+static inline uint32_t
+gb__CyclesUntilWavePosStep(const gb_SoundSampleTimer *sample, uint16_t freq, uint8_t num_steps, bool is_channel_3)
+{
+	// See gb__SoundSampleAdvance.
+	const uint32_t period = 2048 - freq;
+	if (sample->wave_pos_timer >= period)
+	{
+		return 1;  // The period has been shortened by a register write.
+	}
+	const uint32_t remaining = (num_steps - 1u) * period + period - sample->wave_pos_timer;
+	return is_channel_3 ? (remaining + 1u) / 2u : remaining;
+}
+
+static inline uint8_t
+gb__NumStepsUntilPwmChange(uint8_t duty_cycle, uint8_t wave_pos)
+{
+	const uint8_t *wave_form = gb__PwmWaveForms[duty_cycle];
+	uint8_t num_steps = 1;
+	while (num_steps < 8 && wave_form[(wave_pos + num_steps) & 7u] == wave_form[wave_pos])
+	{
+		++num_steps;
+	}
+	return num_steps;
+}
+
+// Returns the number of m-cycles until the output of any channel might change
+// for the band-limited synthesis. It's capped such that the steps in between
+// two read outs fit into 'blip_deltas'.
+static uint16_t
+gb__CyclesUntilOutputStep(const gb_GameBoy *gb)
+{
+	const struct gb_Apu *apu = &gb->apu;
+	uint64_t num_m_cycles = MIN(0xFFFF, GB_AUDIO_MAX_CHUNK_SIZE * gb__SamplingPeriod(gb) / 375);
+	if (!apu->audio_enable)
+	{
+		return (uint16_t)num_m_cycles;
+	}
+
+	// Silent channels can be skipped, their volume only changes with a volume
+	// sweep step (see gb__CyclesUntilApuStep) or a register write.
+	const uint8_t panning = apu->nr51.reg | (apu->nr51.reg >> 4u);
+	const struct gb_PulseA *ch1 = &apu->ch1;
+	if (ch1->channel_enable && ch1->volume_sweep.current_volume > 0 && (panning & 0x01))
+	{
+		const uint8_t num_steps = gb__NumStepsUntilPwmChange(ch1->nr11.duty_cycle, ch1->wave_timer.wave_pos);
+		num_m_cycles = MIN(num_m_cycles, gb__CyclesUntilWavePosStep(&ch1->wave_timer, ch1->period, num_steps, false));
+	}
+	const struct gb_PulseB *ch2 = &apu->ch2;
+	if (ch2->channel_enable && ch2->volume_sweep.current_volume > 0 && (panning & 0x02))
+	{
+		const uint8_t num_steps = gb__NumStepsUntilPwmChange(ch2->nr21.duty_cycle, ch2->wave_timer.wave_pos);
+		num_m_cycles = MIN(num_m_cycles, gb__CyclesUntilWavePosStep(&ch2->wave_timer, ch2->period, num_steps, false));
+	}
+	const struct gb_Wave *ch3 = &apu->ch3;
+	if (ch3->channel_enable && ch3->nr32.output_level > 0 && (panning & 0x04))
+	{
+		num_m_cycles = MIN(num_m_cycles, gb__CyclesUntilWavePosStep(&ch3->wave_timer, ch3->period, 1, true));
+	}
+	const uint32_t noise_period = gb__NoisePeriod(&apu->ch4);
+	if (apu->ch4.channel_enable && apu->ch4.volume_sweep.current_volume > 0 && (panning & 0x08) && noise_period > 0)
+	{
+		const uint32_t until_lfsr_step = apu->ch4.lfsr_timer < noise_period ? noise_period - apu->ch4.lfsr_timer : 1;
+		num_m_cycles = MIN(num_m_cycles, until_lfsr_step);
+	}
+	return (uint16_t)num_m_cycles;
+}
+
+// The APU is only synced when a sample is due, when a channel might get
+// disabled (which is visible in NR52), and before register accesses (see
+// gb__ScheduleApu). In between it can be far behind, it's caught up in steps
+// that each contain at most one frame sequencer step (as gb__AdvanceApu
+// requires). For the band-limited synthesis, the steps also end at each
+// change of the channel outputs.
+static void
+gb__SyncApu(gb_GameBoy *gb)
+{
+	struct gb_Scheduler *sched = &gb->scheduler;
+	const bool band_limited = gb->apu.callback && gb->apu.synthesis == GB_AUDIO_SYNTHESIS_BAND_LIMITED;
+	if (band_limited && sched->apu_last_sync < sched->now)
+	{
+		// Register writes since the last sync (e.g., triggers) change the
+		// output right away.
+		gb__AdvanceApu(gb, 0);
+	}
+	while (sched->apu_last_sync < sched->now)
+	{
+		uint16_t elapsed_m_cycles =
+				(uint16_t)MIN(sched->now - sched->apu_last_sync, gb__CyclesUntilApuStep(&gb->apu));
+		if (band_limited)
+		{
+			elapsed_m_cycles = MIN(elapsed_m_cycles, gb__CyclesUntilOutputStep(gb));
+		}
+		sched->apu_last_sync += elapsed_m_cycles;
+		gb__AdvanceApu(gb, elapsed_m_cycles);
+	}
+}
+
+static void
+gb__ScheduleApu(gb_GameBoy *gb)
+{
+	const struct gb_Apu *apu = &gb->apu;
+	uint64_t num_m_cycles = SCHEDULER_NEVER;
+
+	// Next 48 kHz sample. Without callback, no samples are synthesized at all.
+	if (apu->callback)
+	{
+		uint64_t num_samples = 1;
+		if (apu->synthesis == GB_AUDIO_SYNTHESIS_BAND_LIMITED)
+		{
+			// Samples are only needed once the chunk is full (or at the end of the
+			// frame, see gb__EndAudioFrame).
+			const uint16_t chunk_size =
+					apu->chunk_size == GB_AUDIO_CHUNK_PER_FRAME ? GB_AUDIO_MAX_CHUNK_SIZE : apu->chunk_size;
+			num_samples = chunk_size - apu->num_buffered_samples;
+		}
+		const uint64_t until_samples = num_samples * gb__SamplingPeriod(gb);
+		num_m_cycles = apu->clock_acc < until_samples ? (until_samples - apu->clock_acc + 374) / 375 : 0;
+	}
+
+	// Events that are visible in NR52: channels that get disabled because
+	// their length runs out or because of a frequency sweep overflow.
+	// Everything else (e.g., volume sweeps) only matters for the samples.
+	if (apu->audio_enable)
+	{
+		const gb_SoundTimeout *timeouts[4] = { &apu->ch1.timeout, &apu->ch2.timeout, &apu->ch3.timeout,
+			&apu->ch4.timeout };
+		const bool length_enables[4] = { apu->ch1.length_enable, apu->ch2.length_enable, apu->ch3.length_enable,
+			apu->ch4.nr44.length_enable };
+		const bool channel_enables[4] = { apu->ch1.channel_enable, apu->ch2.channel_enable,
+			apu->ch3.channel_enable, apu->ch4.channel_enable };
+		for (int i = 0; i < 4; ++i)
+		{
+			if (channel_enables[i] && length_enables[i] && timeouts[i]->length_counter > 0)
+			{
+				const uint64_t until_expiry = gb__CyclesUntil(timeouts[i]->length_timer, SOUND_LENGTH_PERIOD) +
+						(timeouts[i]->length_counter - 1u) * (uint64_t)SOUND_LENGTH_PERIOD;
+				num_m_cycles = MIN(num_m_cycles, until_expiry);
+			}
+		}
+
+		if (apu->ch1.channel_enable && apu->ch1.freq_sweep_enable)
+		{
+			num_m_cycles = MIN(num_m_cycles, gb__CyclesUntil(apu->ch1.freq_timer, SOUND_FREQ_SWEEP_PERIOD));
+		}
+	}
+
+	const uint64_t deadline =
+			num_m_cycles == SCHEDULER_NEVER ? SCHEDULER_NEVER : gb->scheduler.apu_last_sync + num_m_cycles;
+	gb__SetDeadline(gb, &gb->scheduler.apu_deadline, deadline);
+}
+
+// Catches up with all subsystems whose deadline has passed and schedules
+// their next events.
+static void
+gb__ProcessEvents(gb_GameBoy *gb)
+{
+	struct gb_Scheduler *sched = &gb->scheduler;
+	sched->next_event = SCHEDULER_NEVER;
+
+	if (sched->now >= sched->ppu_deadline)
+	{
+		gb__SyncPpu(gb);
+		gb__SchedulePpu(gb);
+	}
+	sched->next_event = MIN(sched->next_event, sched->ppu_deadline);
+
+	if (sched->now >= sched->timer_deadline)
+	{
+		gb__SyncTimer(gb);
+		gb__ScheduleTimer(gb);
+	}
+	sched->next_event = MIN(sched->next_event, sched->timer_deadline);
+
+	if (sched->now >= sched->apu_deadline)
+	{
+		gb__SyncApu(gb);
+		gb__ScheduleApu(gb);
+	}
+	sched->next_event = MIN(sched->next_event, sched->apu_deadline);
+}
+
+static inline void
+gb__ElapseCycles(gb_GameBoy *gb, uint16_t elapsed_m_cycles)
+{
+	gb->scheduler.now += elapsed_m_cycles;
+	if (gb->scheduler.now >= gb->scheduler.next_event)
+	{
+		gb__ProcessEvents(gb);
+	}
+}
+
+// Lets time pass while the CPU is halted. Only the PPU and the timer (incl.
+// the serial port) can raise the interrupt that ends the halt (joypad input
+// only ever changes between calls to gb_RunCycles), so we can jump straight to
+// the next of their deadlines instead of stepping 1 m-cycle at a time.
+// Returns the number of m-cycles skipped, at most 'max_m_cycles'.
+static uint16_t
+gb__SkipHalted(gb_GameBoy *gb, size_t max_m_cycles)
+{
+	assert(max_m_cycles > 0);
+	struct gb_Scheduler *sched = &gb->scheduler;
+	const uint64_t start = sched->now;
+
+	uint64_t target = MIN(sched->ppu_deadline, sched->timer_deadline);
+	target = MIN(target, start + MIN(max_m_cycles, SCHEDULER_MAX_DISTANCE));
+	target = MAX(target, start + 1);
+
+	// The APU still needs to be caught up with at each one of its events on the
+	// way. The events are processed at the exact same times as they would be if
+	// we took 1 m-cycle steps.
+	while (sched->now < target)
+	{
+		sched->now = MAX(sched->now + 1, MIN(target, sched->next_event));
+		if (sched->now >= sched->next_event)
+		{
+			gb__ProcessEvents(gb);
+		}
+	}
+
+	return (uint16_t)(sched->now - start);
+}
+
+// Brings all subsystems up to date so that their state can be inspected from
+// the outside. Deadlines stay valid.
+static void
+gb__SyncAll(gb_GameBoy *gb)
+{
+	gb__MaterializeFlags(gb);
+	gb__SyncPpu(gb);
+	gb__SyncTimer(gb);
+	gb__SyncApu(gb);
+}
+
+// Everything that happens after an instruction has been executed (or not, if
+// 'num_cycles' is 0 because the CPU is halted).
+static inline uint16_t
+gb__FinishStep(gb_GameBoy *gb, uint16_t num_cycles, size_t max_halt_m_cycles)
+{
+	if (num_cycles > 0)
+	{
+		// NOTE: Unclear if the updates should be done before or after the execution
+		// of the instruction. (Before has the problem that you don't know how many
+		// cycles it took in the case of a conditional jump.) That is the curse of
+		// instruction-stepping and of always rendering full scan lines at once.
+		// The PPU, timer, and APU only see the elapsed cycles once the instruction
+		// is done.
+		gb__ElapseCycles(gb, num_cycles);
+
+#if BLARGG_TEST_ENABLE
+		if (gb->serial.sc == 0x81)
+		{
+			char c = gb->serial.sb;
+			printf("%c", c);
+			gb->serial.sc = 0;
+		}
+#endif
+	}
+
+	const uint16_t num_interrupt_cycles = gb__HandleInterrupts(gb);
+	if (num_interrupt_cycles > 0)
+	{
+		gb__ElapseCycles(gb, num_interrupt_cycles);
+		num_cycles += num_interrupt_cycles;
+	}
+
+	if (gb->cpu.interrupt.ime_after_next_inst)
+	{
+		gb->cpu.interrupt.ime = true;
+		gb->cpu.interrupt.ime_after_next_inst = false;
+	}
+
+	if (num_cycles == 0)
+	{
+		// When the CPU is halted, we still need to let cycles "elapse" so that the
+		// timer progresses. Nothing else happens until the next interrupt though.
+		assert(gb->cpu.halt);
+		num_cycles = gb__SkipHalted(gb, max_halt_m_cycles);
+	}
+
+	if (gb->serial.enable_interrupt_timer)
+	{
+		// This will trigger an interrupt 8 bit clocks (8192 Hz) later on.
+		// See page 31 of the GameBoy CPU manual.
+		// GB_MACHINE_M_FREQ / 8192 == 128 m cyles
+		gb__SyncTimer(gb);
+		gb->serial.interrupt_timer = 128 * 8;
+		gb__ScheduleTimer(gb);
+
+		gb->serial.enable_interrupt_timer = false;
+	}
+
+	assert(num_cycles > 0);
+	return num_cycles;
+}
+
+// The body of gb_ExecuteNextInstruction, split off so that it can be inlined
+// into the run loop of gb_RunCycles. 'max_halt_m_cycles' limits how far
+// a halted CPU is allowed to skip ahead.
+static inline uint16_t
+gb__Step(gb_GameBoy *gb, size_t max_halt_m_cycles)
+{
+	assert(gb->rom.data);
+	assert(gb->rom.num_bytes);
+
+	if (gb->cpu.pc == 0x0100)
+	{
+		// The BIOS gets automatically unmapped by writing to 0xFF50, and the
+		// BIOS itself does that.
+		assert(!gb->memory.bios_mapped);
+
+		// See Sec. 5.1 of The Cycle-Accurate Game Boy Docs
+		// The timer will be bogus will running the BIOS.
+		gb__SyncTimer(gb);
+		gb->timer.t_clock = 0xABCC;
+	}
+
+	uint16_t num_cycles = 0;
+	if (!gb->cpu.halt)
+	{
+#if GB_DISPATCH_TABLE
+		num_cycles = gb__basic_handlers[gb_MemoryReadByte(gb, gb->cpu.pc)](gb);
+#else
+		const gb_Instruction inst = gb__FetchInstructionCached(gb, gb->cpu.pc);
+		gb->cpu.pc += gb_InstructionSize(inst);
+
+		num_cycles =
+				inst.is_extended ? gb__ExecuteExtendedInstruction(gb, inst) : gb__ExecuteBasicInstruction(gb, inst);
+#endif
+	}
+
+	return gb__FinishStep(gb, num_cycles, max_halt_m_cycles);
+}
+
+size_t
+gb_ExecuteNextInstruction(gb_GameBoy *gb)
+{
+	const size_t num_cycles = gb__Step(gb, SCHEDULER_MAX_DISTANCE);
+	gb__SyncAll(gb);
+	return num_cycles;
+}
+
+gb_RunResult
+gb_RunCycles(gb_GameBoy *gb, size_t m_cycle_budget, const gb_StopConditions *stop_conditions)
+{
+	gb_RunResult result = { 0, GB_STOP_REASON_BUDGET };
+
+	const gb_StopConditions no_stop_conditions = { 0 };
+	const gb_StopConditions *stop = stop_conditions ? stop_conditions : &no_stop_conditions;
+	const uint32_t frame_count = gb->display.frame_count;
+
+	while (result.m_cycles < m_cycle_budget)
+	{
+		result.m_cycles += gb__Step(gb, m_cycle_budget - result.m_cycles);
+
+		for (size_t i = 0; i < stop->num_breakpoints; ++i)
+		{
+			if (gb->cpu.pc == stop->breakpoints[i])
+			{
+				result.stop_reason = GB_STOP_REASON_BREAKPOINT;
+				break;
+			}
+		}
+		if (result.stop_reason != GB_STOP_REASON_BUDGET)
+		{
+			break;
+		}
+
+		if (stop->stop_at_vblank && gb->display.frame_count != frame_count)
+		{
+			result.stop_reason = GB_STOP_REASON_VBLANK;
+			break;
+		}
+	}
+
+	gb__SyncAll(gb);
+	return result;
+}
+
+gb_RunResult
+gb_RunFrame(gb_GameBoy *gb, const gb_StopConditions *stop_conditions)
+{
+	gb_StopConditions stop = { 0 };
+	if (stop_conditions)
+	{
+		stop = *stop_conditions;
+	}
+	stop.stop_at_vblank = true;
+
+	return gb_RunCycles(gb, GB_MACHINE_CYCLES_PER_FRAME, &stop);
+}
+
+// JIT
+//
+// Translates basic blocks of ROM code into x86-64 code. Loads and stores,
+// the 8-bit ALU operations without carry, INC/DEC, RLCA/RRCA, PUSH/POP, and
+// all jumps, calls, and returns are executed inline: they operate directly on
+// the registers in gb_GameBoy, record the flags in 'struct gb_LazyFlags'
+// exactly like the interpreter, and add their cycles to the scheduler's 'now'.
+// All other instructions are executed by calling their opcode handler (see
+// GB_DISPATCH_TABLE).
+//
+// Within a block, 'now' lives in r15 and is compared against 'limit' in r14,
+// the earlier of the next scheduler event and the end of the cycle budget. As
+// long as 'now' stays below the limit, gb__FinishStep would do nothing but
+// advance time after an inline instruction (see gb__JitCanEnterBlock for why
+// there can't be any interrupts to handle), so the block just keeps going. An
+// instruction that reaches the limit leaves the block through gb__JitLeave,
+// which catches up on everything the interpreter would have done after it.
+//
+// Memory accesses go through the page tables (see gb__UpdateMemoryMap) and
+// the zero page RAM inline. Writes anywhere else and instructions that touch
+// the interrupt state can have all sorts of side effects (bank switches, new
+// deadlines, pending interrupts, etc.), those are executed by the handler
+// followed by gb__JitFinishInstruction which does exactly what the interpreter
+// does and tells the block whether it can go on.
+//
+// A block that ends with a jump to a known address in the same ROM bank is
+// chained to the block at that address the first time it is taken, so that
+// tight loops don't go through gb_RunCyclesJit on every iteration.
+//
+// Only code from the ROM is compiled. It never changes, so blocks are keyed by
+// their offset into the ROM. Code in RAM (possibly self-modifying) is always
+// interpreted. The code buffer is never writable and executable at the same
+// time: it's only made writable while a block is being emitted or chained.
+
+#if GB_JIT
+
+#define JIT_MAX_BLOCK_LENGTH 64  // In instructions
+#define JIT_MAX_INSTRUCTION_SIZE 512  // In bytes of native code, incl. its exits and slow path
+#define JIT_NUM_BLOCKS 16384  // Power of two
+#define JIT_CODE_SIZE (16 * 1024 * 1024)
+
+typedef struct gb__JitContext
+{
+	uint64_t limit;  // MIN(scheduler.next_event, end)
+	uint64_t end;  // Value of scheduler.now at which the budget is used up
+	uint32_t frame_count;
+	bool stop_at_vblank;
+	uint32_t link;  // Offset of the jump at the end of the block to chain, or 0
+
+	// The block is only valid as long as the ROM banks don't change.
+	const uint8_t *rom_bank0;
+	const uint8_t *rom_bankx;
+} gb__JitContext;
+
+typedef void gb__JitBlock(gb_GameBoy *gb, gb__JitContext *ctx);
+
+struct gb_Jit
+{
+	// The ROM that the compiled code belongs to.
+	const uint8_t *rom_data;
+	uint32_t rom_num_bytes;
+
+	struct
+	{
+		uint32_t tag;  // ROM offset + 1, 0 for empty entries.
+		uint32_t code_offset;
+	} blocks[JIT_NUM_BLOCKS];
+
+	size_t code_size;
+	uint8_t *code;  // JIT_CODE_SIZE bytes, each page either read/write or read/execute
+	size_t page_size;
+	size_t prologue_size;  // Where chained blocks are entered
+	uint32_t generation;  // Incremented by every flush
+};
+
+gb_Jit *
+gb_CreateJit(void)
+{
+	// One mapping for the bookkeeping and one for the code.
+	gb_Jit *jit = mmap(NULL, sizeof(gb_Jit), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (jit == MAP_FAILED)
+	{
+		return NULL;
+	}
+	jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (jit->code == MAP_FAILED)
+	{
+		munmap(jit, sizeof(gb_Jit));
+		return NULL;
+	}
+	jit->page_size = (size_t)sysconf(_SC_PAGESIZE);
+	return jit;
+}
+
+void
+gb_DestroyJit(gb_Jit *jit)
+{
+	if (jit)
+	{
+		munmap(jit->code, JIT_CODE_SIZE);
+		munmap(jit, sizeof(gb_Jit));
+	}
+}
+
+static void
+gb__JitFlush(gb_Jit *jit, const gb_GameBoy *gb)
+{
+	jit->rom_data = gb->rom.data;
+	jit->rom_num_bytes = gb->rom.num_bytes;
+	memset(jit->blocks, 0, sizeof(jit->blocks));
+	jit->code_size = 0;
+	++jit->generation;
+}
+
+// Called by the compiled code when an instruction that was executed inline
+// (or by a handler without side effects) reaches ctx->limit. PC is already
+// up to date, the block is left afterwards.
+static void
+gb__JitLeave(gb_GameBoy *gb, gb__JitContext *ctx, uint16_t num_cycles)
+{
+	gb__FinishStep(gb, num_cycles, ctx->end - gb->scheduler.now);
+}
+
+// Called by the compiled code after an instruction with side effects. Returns
+// false if the block has to be left.
+static bool
+gb__JitFinishInstruction(gb_GameBoy *gb, gb__JitContext *ctx, uint16_t num_cycles)
+{
+	const uint16_t expected_pc = gb->cpu.pc;
+	gb__FinishStep(gb, num_cycles, ctx->end - gb->scheduler.now);
+	ctx->limit = MIN(gb->scheduler.next_event, ctx->end);
+
+	return gb->cpu.pc == expected_pc && !gb->cpu.halt && gb->scheduler.now < ctx->end &&
+			!(ctx->stop_at_vblank && gb->display.frame_count != ctx->frame_count) &&
+			gb->memory.rom_bank0 == ctx->rom_bank0 && gb->memory.rom_bankx == ctx->rom_bankx;
+}
+
+// Called by the compiled code for conditional jumps if it doesn't know which
+// instruction set the flags, and for PUSH AF.
+static uint8_t
+gb__JitFlags(gb_GameBoy *gb)
+{
+	gb__Flags(gb);
+	return gb->cpu.f;
+}
+
+static bool
+gb__JitEndsBlock(gb_Instruction inst)
+{
+	if (inst.is_extended)
+	{
+		return false;
+	}
+
+	switch (inst.opcode)
+	{
+	case 0x10:  // STOP
+	case 0x18:  // JR i8
+	case 0x20:  // JR NZ, i8
+	case 0x28:  // JR Z, i8
+	case 0x30:  // JR NC, i8
+	case 0x38:  // JR C, i8
+	case 0x76:  // HALT
+	case 0xC0:  // RET NZ
+	case 0xC2:  // JP NZ, u16
+	case 0xC3:  // JP u16
+	case 0xC4:  // CALL NZ, u16
+	case 0xC7:  // RST 00h
+	case 0xC8:  // RET Z
+	case 0xC9:  // RET
+	case 0xCA:  // JP Z, u16
+	case 0xCC:  // CALL Z, u16
+	case 0xCD:  // CALL u16
+	case 0xCF:  // RST 08h
+	case 0xD0:  // RET NC
+	case 0xD2:  // JP NC, u16
+	case 0xD4:  // CALL NC, u16
+	case 0xD7:  // RST 10h
+	case 0xD8:  // RET C
+	case 0xD9:  // RETI
+	case 0xDA:  // JP C, u16
+	case 0xDC:  // CALL C, u16
+	case 0xDF:  // RST 18h
+	case 0xE7:  // RST 20h
+	case 0xE9:  // JP HL
+	case 0xEF:  // RST 28h
+	case 0xF7:  // RST 30h
+	case 0xFB:  // EI
+	case 0xFF:  // RST 38h
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool
+gb__JitIsUndefined(gb_Instruction inst)
+{
+	return !inst.is_extended && !gb__basic_instruction_infos[inst.opcode].name;
+}
+
+// Instructions that neither write memory, nor touch the interrupt/halt state,
+// nor jump. Their handlers can be called without gb__JitFinishInstruction.
+static bool
+gb__JitIsPure(gb_Instruction inst)
+{
+	const uint8_t op = inst.opcode;
+	if (inst.is_extended)
+	{
+		// Everything but the read-modify-write ones on (HL).
+		return (op & 0x07) != 0x06 || (op >= 0x40 && op < 0x80);
+	}
+
+	if (op < 0x40)
+	{
+		switch (op)
+		{
+		case 0x02:  // LD (BC), A
+		case 0x08:  // LD (u16), SP
+		case 0x10:  // STOP
+		case 0x12:  // LD (DE), A
+		case 0x18:  // JR i8
+		case 0x20:  // JR NZ, i8
+		case 0x22:  // LD (HL+), A
+		case 0x28:  // JR Z, i8
+		case 0x30:  // JR NC, i8
+		case 0x32:  // LD (HL-), A
+		case 0x34:  // INC (HL)
+		case 0x35:  // DEC (HL)
+		case 0x36:  // LD (HL), u8
+		case 0x38:  // JR C, i8
+			return false;
+		default:
+			return true;
+		}
+	}
+	else if (op < 0xC0)
+	{
+		// LD (HL), r and HALT
+		return op < 0x70 || op > 0x77;
+	}
+
+	switch (op)
+	{
+	case 0xC1:  // POP BC
+	case 0xC6:  // ADD A, u8
+	case 0xCE:  // ADC A, u8
+	case 0xD1:  // POP DE
+	case 0xD6:  // SUB A, u8
+	case 0xDE:  // SBC A, u8
+	case 0xE1:  // POP HL
+	case 0xE6:  // AND A, u8
+	case 0xE8:  // ADD SP, i8
+	case 0xEE:  // XOR A, u8
+	case 0xF0:  // LD A, (FF00 + u8)
+	case 0xF1:  // POP AF
+	case 0xF2:  // LD A, (FF00 + C)
+	case 0xF6:  // OR A, u8
+	case 0xF8:  // LD HL, SP + i8
+	case 0xF9:  // LD SP, HL
+	case 0xFA:  // LD A, (u16)
+	case 0xFE:  // CP A, u8
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Emitting x86-64 code
+//
+// Register usage within a block:
+// rbx: gb
+// r12: ctx
+// r14: ctx->limit
+// r15: gb->scheduler.now
+// rax, rcx, rdx, rsi, rdi: scratch
+
+static inline void
+gb__JitEmit(gb_Jit *jit, const uint8_t *bytes, size_t num_bytes)
+{
+	memcpy(jit->code + jit->code_size, bytes, num_bytes);
+	jit->code_size += num_bytes;
+}
+
+#define GB__JIT_EMIT(jit, ...) \
+	do \
+	{ \
+		const uint8_t jit_bytes_[] = { __VA_ARGS__ }; \
+		gb__JitEmit(jit, jit_bytes_, sizeof(jit_bytes_)); \
+	} while (0)
+
+static inline void
+gb__JitEmitU16(gb_Jit *jit, uint16_t value)
+{
+	gb__JitEmit(jit, (const uint8_t *)&value, sizeof(value));
+}
+
+static inline void
+gb__JitEmitU32(gb_Jit *jit, uint32_t value)
+{
+	gb__JitEmit(jit, (const uint8_t *)&value, sizeof(value));
+}
+
+#define GB__JIT_OFFSET(member) offsetof(gb_GameBoy, member)
+
+enum
+{
+	GB__JIT_EAX = 0,
+	GB__JIT_ECX = 1,
+	GB__JIT_R15 = 7,  // With REX.R
+};
+
+// Emits the ModRM byte and the displacement for the memory operand
+// [rbx + offset], i.e., a member of gb_GameBoy. 'reg' is either a register
+// or an opcode extension.
+static void
+gb__JitEmitGbOperand(gb_Jit *jit, uint8_t reg, size_t offset)
+{
+	if (offset < 0x80)
+	{
+		GB__JIT_EMIT(jit, (uint8_t)(0x43 | reg << 3u), (uint8_t)offset);
+	}
+	else
+	{
+		GB__JIT_EMIT(jit, (uint8_t)(0x83 | reg << 3u));
+		gb__JitEmitU32(jit, (uint32_t)offset);
+	}
+}
+
+// movzx reg, byte [gb + offset]
+static void
+gb__JitEmitLoadByte(gb_Jit *jit, uint8_t reg, size_t offset)
+{
+	GB__JIT_EMIT(jit, 0x0F, 0xB6);
+	gb__JitEmitGbOperand(jit, reg, offset);
+}
+
+// movzx eax, word [gb + offset]
+static void
+gb__JitEmitLoadWord(gb_Jit *jit, size_t offset)
+{
+	GB__JIT_EMIT(jit, 0x0F, 0xB7);
+	gb__JitEmitGbOperand(jit, GB__JIT_EAX, offset);
+}
+
+// mov byte [gb + offset], al
+static void
+gb__JitEmitStoreAl(gb_Jit *jit, size_t offset)
+{
+	GB__JIT_EMIT(jit, 0x88);
+	gb__JitEmitGbOperand(jit, GB__JIT_EAX, offset);
+}
+
+// mov byte [gb + offset], value
+static void
+gb__JitEmitStoreByteImm(gb_Jit *jit, size_t offset, uint8_t value)
+{
+	GB__JIT_EMIT(jit, 0xC6);
+	gb__JitEmitGbOperand(jit, 0, offset);
+	GB__JIT_EMIT(jit, value);
+}
+
+// mov word [gb + offset], value
+static void
+gb__JitEmitStoreWordImm(gb_Jit *jit, size_t offset, uint16_t value)
+{
+	GB__JIT_EMIT(jit, 0x66, 0xC7);
+	gb__JitEmitGbOperand(jit, 0, offset);
+	gb__JitEmitU16(jit, value);
+}
+
+// add/sub word [gb + offset], value
+static void
+gb__JitEmitAddWordImm(gb_Jit *jit, size_t offset, int8_t value)
+{
+	GB__JIT_EMIT(jit, 0x66, 0x83);
+	gb__JitEmitGbOperand(jit, value < 0 ? 5 : 0, offset);
+	GB__JIT_EMIT(jit, (uint8_t)(value < 0 ? -value : value));
+}
+
+// mov [gb + now], r15
+static void
+gb__JitEmitStoreNow(gb_Jit *jit)
+{
+	GB__JIT_EMIT(jit, 0x4C, 0x89);
+	gb__JitEmitGbOperand(jit, GB__JIT_R15, GB__JIT_OFFSET(scheduler.now));
+}
+
+// mov r15, [gb + now]
+// mov r14, [ctx + limit]
+static void
+gb__JitEmitLoadNowAndLimit(gb_Jit *jit)
+{
+	GB__JIT_EMIT(jit, 0x4C, 0x8B);
+	gb__JitEmitGbOperand(jit, GB__JIT_R15, GB__JIT_OFFSET(scheduler.now));
+	GB__JIT_EMIT(jit, 0x4D, 0x8B, 0x74, 0x24, (uint8_t)offsetof(gb__JitContext, limit));
+}
+
+static void
+gb__JitEmitCall(gb_Jit *jit, const void *func)
+{
+	GB__JIT_EMIT(jit, 0x48, 0xB8);  // mov rax, func
+	const uint64_t imm = (uint64_t)(uintptr_t)func;
+	gb__JitEmit(jit, (const uint8_t *)&imm, sizeof(imm));
+	GB__JIT_EMIT(jit, 0xFF, 0xD0);  // call rax
+}
+
+// Emits a jmp (0xE9) or a jcc (0x80 to 0x8F) with a 32-bit displacement that
+// still has to be patched. Returns the offset right after the instruction
+// which is what the displacement is relative to.
+static size_t
+gb__JitEmitJump(gb_Jit *jit, uint8_t opcode)
+{
+	if (opcode == 0xE9)
+	{
+		GB__JIT_EMIT(jit, 0xE9);
+	}
+	else
+	{
+		GB__JIT_EMIT(jit, 0x0F, opcode);
+	}
+	gb__JitEmitU32(jit, 0);
+	return jit->code_size;
+}
+
+static void
+gb__JitPatchJump(gb_Jit *jit, size_t jump, size_t target)
+{
+	const int32_t rel = (int32_t)(target - jump);
+	memcpy(jit->code + jump - sizeof(rel), &rel, sizeof(rel));
+}
+
+// What the compiled code knows about the last instruction that set the flags.
+typedef enum gb__JitFlagsSource
+{
+	GB__JIT_FLAGS_UNKNOWN,
+	GB__JIT_FLAGS_MATERIALIZED,  // No lazy flags pending
+	GB__JIT_FLAGS_ADD,  // ADD without carry in 'struct gb_LazyFlags'
+	GB__JIT_FLAGS_SUB,  // SUB or CP without carry in 'struct gb_LazyFlags'
+	GB__JIT_FLAGS_LOGIC,  // AND, OR, or XOR in 'struct gb_LazyFlags'
+	GB__JIT_FLAGS_INC_DEC,  // INC or DEC in 'struct gb_LazyFlags'
+} gb__JitFlagsSource;
+
+// Where an instruction goes if it reaches ctx->limit.
+typedef struct gb__JitExit
+{
+	size_t jump;
+	uint16_t pc;
+	bool set_pc;
+	uint8_t num_cycles;  // 0 if edx holds the cycles
+} gb__JitExit;
+
+// Where an inline instruction goes if it accesses memory that isn't plain
+// RAM. It executes the instruction with its handler instead.
+typedef struct gb__JitSlowPath
+{
+	size_t jumps[4];
+	size_t num_jumps;
+	gb_Instruction inst;
+	uint16_t pc;
+	size_t resume;  // 0 to leave the block afterwards
+} gb__JitSlowPath;
+
+typedef struct gb__JitEmitter
+{
+	gb_Jit *jit;
+	uint16_t start_pc;
+
+	gb__JitFlagsSource zero;
+	gb__JitFlagsSource carry;
+
+	gb__JitExit exits[2 * JIT_MAX_BLOCK_LENGTH];
+	size_t num_exits;
+	gb__JitSlowPath slow_paths[JIT_MAX_BLOCK_LENGTH];
+	size_t num_slow_paths;
+	size_t epilogue_jumps[2 * JIT_MAX_BLOCK_LENGTH];  // Jumps to the epilogue that stores 'now'
+	size_t num_epilogue_jumps;
+	size_t leave_jumps[2 * JIT_MAX_BLOCK_LENGTH];  // Jumps to the one that doesn't
+	size_t num_leave_jumps;
+} gb__JitEmitter;
+
+// Lets the instruction's cycles elapse, or leaves the block if that reaches
+// ctx->limit. The cycles come from edx if 'num_cycles' is 0.
+static void
+gb__JitEmitElapse(gb__JitEmitter *e, uint16_t pc, bool set_pc, uint8_t num_cycles)
+{
+	gb_Jit *jit = e->jit;
+	if (num_cycles > 0)
+	{
+		GB__JIT_EMIT(jit, 0x49, 0x8D, 0x47, num_cycles);  // lea rax, [r15 + num_cycles]
+	}
+	else
+	{
+		GB__JIT_EMIT(jit, 0x49, 0x8D, 0x04, 0x17);  // lea rax, [r15 + rdx]
+	}
+	GB__JIT_EMIT(jit, 0x4C, 0x39, 0xF0);  // cmp rax, r14
+	gb__JitExit *exit = &e->exits[e->num_exits++];
+	exit->jump = gb__JitEmitJump(jit, 0x83);  // jae
+	exit->pc = pc;
+	exit->set_pc = set_pc;
+	exit->num_cycles = num_cycles;
+	GB__JIT_EMIT(jit, 0x49, 0x89, 0xC7);  // mov r15, rax
+}
+
+// Ends the block with a jump to 'pc'. The dispatcher can chain the block to
+// the one at 'pc' if that is in the same 16 KiB ROM bank (see gb__JitLink).
+static void
+gb__JitEmitGoto(gb__JitEmitter *e, uint16_t pc)
+{
+	gb_Jit *jit = e->jit;
+	gb__JitEmitStoreWordImm(jit, GB__JIT_OFFSET(cpu.pc), pc);
+	if (pc < 0x8000 && (pc & 0xC000) == (e->start_pc & 0xC000))
+	{
+		// mov dword [ctx + link], <offset of the jmp's end>
+		GB__JIT_EMIT(jit, 0x41, 0xC7, 0x44, 0x24, (uint8_t)offsetof(gb__JitContext, link));
+		gb__JitEmitU32(jit, (uint32_t)(jit->code_size + 4 + 5));
+	}
+	e->epilogue_jumps[e->num_epilogue_jumps++] = gb__JitEmitJump(jit, 0xE9);
+}
+
+// Reads the byte at the address in eax into eax. Plain ROM/RAM accesses go
+// through the page table directly, the rest through gb_MemoryReadByte.
+static void
+gb__JitEmitRead(gb__JitEmitter *e)
+{
+	gb_Jit *jit = e->jit;
+	GB__JIT_EMIT(jit,
+			0x89, 0xC1,  // mov ecx, eax
+			0xC1, 0xE9, 0x0C,  // shr ecx, 12
+			0x48, 0x8B, 0x8C, 0xCB);  // mov rcx, [rbx + rcx * 8 + read_pages]
+	gb__JitEmitU32(jit, (uint32_t)GB__JIT_OFFSET(memory.read_pages));
+	GB__JIT_EMIT(jit, 0x48, 0x85, 0xC9);  // test rcx, rcx
+	const size_t jz_not_paged = gb__JitEmitJump(jit, 0x84);
+	GB__JIT_EMIT(jit,
+			0x25, 0xFF, 0x0F, 0x00, 0x00,  // and eax, 0x0FFF
+			0x0F, 0xB6, 0x04, 0x01);  // movzx eax, byte [rcx + rax]
+	const size_t jmp_done_paged = gb__JitEmitJump(jit, 0xE9);
+
+	// Zero page RAM
+	gb__JitPatchJump(jit, jz_not_paged, jit->code_size);
+	GB__JIT_EMIT(jit, 0x3D, 0x80, 0xFF, 0x00, 0x00);  // cmp eax, 0xFF80
+	const size_t jb_call = gb__JitEmitJump(jit, 0x82);
+	GB__JIT_EMIT(jit, 0x3D, 0xFF, 0xFF, 0x00, 0x00);  // cmp eax, 0xFFFF
+	const size_t je_call = gb__JitEmitJump(jit, 0x84);
+	GB__JIT_EMIT(jit, 0x0F, 0xB6, 0x84, 0x03);  // movzx eax, byte [rbx + rax + zero_page_ram - 0xFF80]
+	gb__JitEmitU32(jit, (uint32_t)(GB__JIT_OFFSET(memory.zero_page_ram) - 0xFF80));
+	const size_t jmp_done_zero_page = gb__JitEmitJump(jit, 0xE9);
+
+	gb__JitPatchJump(jit, jb_call, jit->code_size);
+	gb__JitPatchJump(jit, je_call, jit->code_size);
+	gb__JitEmitStoreNow(jit);  // Some registers depend on the current time.
+	GB__JIT_EMIT(jit,
+			0x48, 0x89, 0xDF,  // mov rdi, rbx
+			0x89, 0xC6);  // mov esi, eax
+	gb__JitEmitCall(jit, (const void *)&gb_MemoryReadByte);
+	GB__JIT_EMIT(jit, 0x0F, 0xB6, 0xC0);  // movzx eax, al
+
+	gb__JitPatchJump(jit, jmp_done_paged, jit->code_size);
+	gb__JitPatchJump(jit, jmp_done_zero_page, jit->code_size);
+}
+
+static gb__JitSlowPath *
+gb__JitBeginSlowPath(gb__JitEmitter *e, gb_Instruction inst, uint16_t pc)
+{
+	gb__JitSlowPath *slow = &e->slow_paths[e->num_slow_paths++];
+	*slow = (gb__JitSlowPath){ .inst = inst, .pc = pc };
+	return slow;
+}
+
+// Turns the address in eax into a pointer to plain RAM in rcx (clobbers eax)
+// or takes the slow path if writing to it can have side effects. This has to
+// happen before the instruction changes anything.
+static void
+gb__JitEmitWritePointer(gb__JitEmitter *e, gb__JitSlowPath *slow)
+{
+	gb_Jit *jit = e->jit;
+	GB__JIT_EMIT(jit,
+			0x89, 0xC1,  // mov ecx, eax
+			0xC1, 0xE9, 0x0C,  // shr ecx, 12
+			0x48, 0x8B, 0x8C, 0xCB);  // mov rcx, [rbx + rcx * 8 + write_pages]
+	gb__JitEmitU32(jit, (uint32_t)GB__JIT_OFFSET(memory.write_pages));
+	GB__JIT_EMIT(jit, 0x48, 0x85, 0xC9);  // test rcx, rcx
+	const size_t jz_not_paged = gb__JitEmitJump(jit, 0x84);
+	GB__JIT_EMIT(jit,
+			0x25, 0xFF, 0x0F, 0x00, 0x00,  // and eax, 0x0FFF
+			0x48, 0x01, 0xC1);  // add rcx, rax
+	const size_t jmp_done = gb__JitEmitJump(jit, 0xE9);
+
+	// Zero page RAM
+	gb__JitPatchJump(jit, jz_not_paged, jit->code_size);
+	GB__JIT_EMIT(jit, 0x3D, 0x80, 0xFF, 0x00, 0x00);  // cmp eax, 0xFF80
+	slow->jumps[slow->num_jumps++] = gb__JitEmitJump(jit, 0x82);  // jb
+	GB__JIT_EMIT(jit, 0x3D, 0xFF, 0xFF, 0x00, 0x00);  // cmp eax, 0xFFFF
+	slow->jumps[slow->num_jumps++] = gb__JitEmitJump(jit, 0x84);  // je
+	GB__JIT_EMIT(jit, 0x48, 0x8D, 0x8C, 0x03);  // lea rcx, [rbx + rax + zero_page_ram - 0xFF80]
+	gb__JitEmitU32(jit, (uint32_t)(GB__JIT_OFFSET(memory.zero_page_ram) - 0xFF80));
+
+	gb__JitPatchJump(jit, jmp_done, jit->code_size);
+}
+
+// Same as gb__JitEmitWritePointer for the two bytes below SP, the pointer
+// to SP - 1 ends up in rsi and the one to SP - 2 in rcx. Only the writes
+// themselves and the update of SP are left for the caller.
+static void
+gb__JitEmitPushPointers(gb__JitEmitter *e, gb__JitSlowPath *slow)
+{
+	gb_Jit *jit = e->jit;
+	for (uint8_t i = 1; i <= 2; ++i)
+	{
+		gb__JitEmitLoadWord(jit, GB__JIT_OFFSET(cpu.sp));
+		GB__JIT_EMIT(jit,
+				0x83, 0xE8, i,  // sub eax, i
+				0x25, 0xFF, 0xFF, 0x00, 0x00);  // and eax, 0xFFFF
+		gb__JitEmitWritePointer(e, slow);
+		if (i == 1)
+		{
+			GB__JIT_EMIT(jit, 0x48, 0x89, 0xCE);  // mov rsi, rcx
+		}
+	}
+}
+
+// Pops a word from the stack into the bytes at 'lo' and 'hi' (offsets into
+// gb_GameBoy).
+static void
+gb__JitEmitPop(gb__JitEmitter *e, size_t lo, size_t hi, bool is_af)
+{
+	gb_Jit *jit = e->jit;
+	gb__JitEmitLoadWord(jit, GB__JIT_OFFSET(cpu.sp));
+	gb__JitEmitRead(e);
+	if (is_af)
+	{
+		GB__JIT_EMIT(jit, 0x24, 0xF0);  // and al, 0xF0
+	}
+	gb__JitEmitStoreAl(jit, lo);
+	gb__JitEmitLoadWord(jit, GB__JIT_OFFSET(cpu.sp));
+	GB__JIT_EMIT(jit,
+			0xFF, 0xC0,  // inc eax
+			0x25, 0xFF, 0xFF, 0x00, 0x00);  // and eax, 0xFFFF
+	gb__JitEmitRead(e);
+	gb__JitEmitStoreAl(jit, hi);
+	gb__JitEmitAddWordImm(jit, GB__JIT_OFFSET(cpu.sp), 2);
+}
+
+// Materializes pending lazy flags (if there are any) and loads F into al.
+static void
+gb__JitEmitLoadFlags(gb__JitEmitter *e)
+{
+	gb_Jit *jit = e->jit;
+	gb__JitEmitLoadByte(jit, GB__JIT_EAX, GB__JIT_OFFSET(cpu.lazy_flags.op));
+	GB__JIT_EMIT(jit, 0x0A);  // or al, byte [gb + inc_dec_op]
+	gb__JitEmitGbOperand(jit, GB__JIT_EAX, GB__JIT_OFFSET(cpu.lazy_flags.inc_dec_op));
+	const size_t jnz_materialize = gb__JitEmitJump(jit, 0x85);
+	gb__JitEmitLoadByte(jit, GB__JIT_EAX, GB__JIT_OFFSET(cpu.f));
+	const size_t jmp_done = gb__JitEmitJump(jit, 0xE9);
+
+	gb__JitPatchJump(jit, jnz_materialize, jit->code_size);
+	GB__JIT_EMIT(jit, 0x48, 0x89, 0xDF);  // mov rdi, rbx
+	gb__JitEmitCall(jit, (const void *)&gb__JitFlags);
+
+	gb__JitPatchJump(jit, jmp_done, jit->code_size);
+}
+
+static const size_t gb__jit_register_offsets[8] = {
+	GB__JIT_OFFSET(cpu.b),
+	GB__JIT_OFFSET(cpu.c),
+	GB__JIT_OFFSET(cpu.d),
+	GB__JIT_OFFSET(cpu.e),
+	GB__JIT_OFFSET(cpu.h),
+	GB__JIT_OFFSET(cpu.l),
+	0,  // (HL)
+	GB__JIT_OFFSET(cpu.a),
+};
+
+static const size_t gb__jit_register_pair_offsets[4] = {
+	GB__JIT_OFFSET(cpu.bc),
+	GB__JIT_OFFSET(cpu.de),
+	GB__JIT_OFFSET(cpu.hl),
+	GB__JIT_OFFSET(cpu.sp),
+};
+
+// Loads the 8-bit operand 'index' (B, C, D, E, H, L, (HL), A) into eax.
+static void
+gb__JitEmitLoadOperand(gb__JitEmitter *e, uint8_t index)
+{
+	if (index == 6)
+	{
+		gb__JitEmitLoadWord(e->jit, GB__JIT_OFFSET(cpu.hl));
+		gb__JitEmitRead(e);
+	}
+	else
+	{
+		gb__JitEmitLoadByte(e->jit, GB__JIT_EAX, gb__jit_register_offsets[index]);
+	}
+}
+
+// ADD, SUB, AND, XOR, OR, and CP (the ALU operations without carry) with
+// the operand in ecx. See gb__Add, gb__Sub, etc.
+static void
+gb__JitEmitAlu(gb__JitEmitter *e, uint8_t alu_op)
+{
+	gb_Jit *jit = e->jit;
+	const size_t a = GB__JIT_OFFSET(cpu.a);
+	const size_t lhs = GB__JIT_OFFSET(cpu.lazy_flags.lhs);
+
+	gb__JitEmitLoadByte(jit, GB__JIT_EAX, a);
+	uint8_t lazy_op = GB__LAZY_FLAGS_OP_NONE;
+	switch (alu_op)
+	{
+	case 0:  // ADD
+		gb__JitEmitStoreAl(jit, lhs);
+		GB__JIT_EMIT(jit, 0x00, 0xC8);  // add al, cl
+		lazy_op = GB__LAZY_FLAGS_OP_ADD;
+		e->zero = e->carry = GB__JIT_FLAGS_ADD;
+		break;
+	case 2:  // SUB
+		gb__JitEmitStoreAl(jit, lhs);
+		GB__JIT_EMIT(jit, 0x28, 0xC8);  // sub al, cl
+		lazy_op = GB__LAZY_FLAGS_OP_SUB;
+		e->zero = e->carry = GB__JIT_FLAGS_SUB;
+		break;
+	case 4:  // AND
+		GB__JIT_EMIT(jit, 0x20, 0xC8);  // and al, cl
+		lazy_op = GB__LAZY_FLAGS_OP_AND;
+		e->zero = e->carry = GB__JIT_FLAGS_LOGIC;
+		break;
+	case 5:  // XOR
+		GB__JIT_EMIT(jit, 0x30, 0xC8);  // xor al, cl
+		lazy_op = GB__LAZY_FLAGS_OP_OR_XOR;
+		e->zero = e->carry = GB__JIT_FLAGS_LOGIC;
+		break;
+	case 6:  // OR
+		GB__JIT_EMIT(jit, 0x08, 0xC8);  // or al, cl
+		lazy_op = GB__LAZY_FLAGS_OP_OR_XOR;
+		e->zero = e->carry = GB__JIT_FLAGS_LOGIC;
+		break;
+	case 7:  // CP
+		gb__JitEmitStoreAl(jit, lhs);
+		lazy_op = GB__LAZY_FLAGS_OP_SUB;
+		e->zero = e->carry = GB__JIT_FLAGS_SUB;
+		break;
+	default:
+		assert(false);
+		break;
+	}
+
+	if (alu_op != 7)
+	{
+		gb__JitEmitStoreAl(jit, a);
+	}
+
+	// 'lhs' is the result for AND, OR, and XOR (see gb__SetFlagsLazy).
+	if (lazy_op == GB__LAZY_FLAGS_OP_AND || lazy_op == GB__LAZY_FLAGS_OP_OR_XOR)
+	{
+		gb__JitEmitStoreAl(jit, lhs);
+		gb__JitEmitStoreByteImm(jit, GB__JIT_OFFSET(cpu.lazy_flags.rhs), 0);
+	}
+	else
+	{
+		GB__JIT_EMIT(jit, 0x88);  // mov byte [gb + rhs], cl
+		gb__JitEmitGbOperand(jit, GB__JIT_ECX, GB__JIT_OFFSET(cpu.lazy_flags.rhs));
+	}
+	gb__JitEmitStoreByteImm(jit, GB__JIT_OFFSET(cpu.lazy_flags.carry_in), 0);
+	gb__JitEmitStoreByteImm(jit, GB__JIT_OFFSET(cpu.lazy_flags.op), lazy_op);
+	gb__JitEmitStoreByteImm(jit, GB__JIT_OFFSET(cpu.lazy_flags.inc_dec_op), GB__LAZY_FLAGS_OP_NONE);
+}
+
+// INC or DEC of the byte that rcx points to (if 'reg_offset' is 0) or of a
+// register. See gb__Inc and gb__Dec.
+static void
+gb__JitEmitIncDec(gb__JitEmitter *e, size_t reg_offset, bool dec)
+{
+	gb_Jit *jit = e->jit;
+	if (reg_offset)
+	{
+		gb__JitEmitLoadByte(jit, GB__JIT_EAX, reg_offset);
+	}
+	else
+	{
+		GB__JIT_EMIT(jit, 0x0F, 0xB6, 0x01);  // movzx eax, byte [rcx]
+	}
+	GB__JIT_EMIT(jit, 0xFE, dec ? 0xC8 : 0xC0);  // dec/inc al
+	if (reg_offset)
+	{
+		gb__JitEmitStoreAl(jit, reg_offset);
+	}
+	else
+	{
+		GB__JIT_EMIT(jit, 0x88, 0x01);  // mov byte [rcx], al
+	}
+	gb__JitEmitStoreAl(jit, GB__JIT_OFFSET(cpu.lazy_flags.inc_dec_result));
+	gb__JitEmitStoreByteImm(
+			jit, GB__JIT_OFFSET(cpu.lazy_flags.inc_dec_op), dec ? GB__LAZY_FLAGS_OP_DEC : GB__LAZY_FLAGS_OP_INC);
+	e->zero = GB__JIT_FLAGS_INC_DEC;
+}
+
+// Emits the test for the condition of a conditional jump, call, or return
+// ('cond' is 0 to 3 for NZ, Z, NC, C) and returns the opcode of the jcc that
+// jumps if it's true.
+static uint8_t
+gb__JitEmitCondition(gb__JitEmitter *e, uint8_t cond)
+{
+	gb_Jit *jit = e->jit;
+	const bool test_zero = cond < 2;
+	const bool flag_set = cond & 1;
+	const uint8_t mask = test_zero ? 0x80 : 0x10;
+	const gb__JitFlagsSource source = test_zero ? e->zero : e->carry;
+
+	// Each case sets the host's ZF or CF to the flag (or to its inverse).
+	switch (source)
+	{
+	case GB__JIT_FLAGS_ADD:
+	case GB__JIT_FLAGS_SUB:
+		gb__JitEmitLoadByte(jit, GB__JIT_EAX, GB__JIT_OFFSET(cpu.lazy_flags.lhs));
+		// add/cmp al, byte [gb + rhs]
+		GB__JIT_EMIT(jit, source == GB__JIT_FLAGS_ADD ? 0x02 : 0x3A);
+		gb__JitEmitGbOperand(jit, GB__JIT_EAX, GB__JIT_OFFSET(cpu.lazy_flags.rhs));
+		if (test_zero)
+		{
+			return flag_set ? 0x84 : 0x85;  // je/jne
+		}
+		return flag_set ? 0x82 : 0x83;  // jb/jae
+	case GB__JIT_FLAGS_LOGIC:
+		if (!test_zero)
+		{
+			// The carry is always clear, the jump is either never or always taken.
+			GB__JIT_EMIT(jit, 0x39, 0xC0);  // cmp eax, eax
+			return flag_set ? 0x85 : 0x84;  // jne/je
+		}
+		GB__JIT_EMIT(jit, 0x80);  // cmp byte [gb + lhs], 0
+		gb__JitEmitGbOperand(jit, 7, GB__JIT_OFFSET(cpu.lazy_flags.lhs));
+		GB__JIT_EMIT(jit, 0x00);
+		return flag_set ? 0x84 : 0x85;  // je/jne
+	case GB__JIT_FLAGS_INC_DEC:
+		assert(test_zero);
+		GB__JIT_EMIT(jit, 0x80);  // cmp byte [gb + inc_dec_result], 0
+		gb__JitEmitGbOperand(jit, 7, GB__JIT_OFFSET(cpu.lazy_flags.inc_dec_result));
+		GB__JIT_EMIT(jit, 0x00);
+		return flag_set ? 0x84 : 0x85;  // je/jne
+	case GB__JIT_FLAGS_MATERIALIZED:
+		GB__JIT_EMIT(jit, 0xF6);  // test byte [gb + f], mask
+		gb__JitEmitGbOperand(jit, 0, GB__JIT_OFFSET(cpu.f));
+		GB__JIT_EMIT(jit, mask);
+		return flag_set ? 0x85 : 0x84;  // jne/je
+	case GB__JIT_FLAGS_UNKNOWN:
+	default:
+		gb__JitEmitLoadFlags(e);
+		GB__JIT_EMIT(jit, 0xA8, mask);  // test al, mask
+		return flag_set ? 0x85 : 0x84;  // jne/je
+	}
+}
+
+// Emits the instruction at 'pc' inline if possible, see the list at the top.
+// Must not emit anything if it returns false.
+static bool
+gb__JitEmitInline(gb__JitEmitter *e, gb_Instruction inst, uint16_t pc, bool is_last)
+{
+	gb_Jit *jit = e->jit;
+	const uint8_t op = inst.opcode;
+	if (inst.is_extended)
+	{
+		return false;
+	}
+
+	const uint16_t next_pc = (uint16_t)(pc + gb_InstructionSize(inst));
+	const gb__InstructionInfo info = gb__basic_instruction_infos[op];
+	const uint8_t dst = (op >> 3u) & 0x07;
+	const uint8_t src = op & 0x07;
+	const size_t a = GB__JIT_OFFSET(cpu.a);
+	const size_t hl = GB__JIT_OFFSET(cpu.hl);
+	const size_t sp = GB__JIT_OFFSET(cpu.sp);
+
+	if (op == 0x00)  // NOP
+	{
+	}
+	else if ((op & 0xCF) == 0x01)  // LD rr, u16
+	{
+		gb__JitEmitStoreWordImm(jit, gb__jit_register_pair_offsets[op >> 4u], inst.operand_word);
+	}
+	else if ((op & 0xC7) == 0x03)  // INC/DEC rr
+	{
+		gb__JitEmitAddWordImm(jit, gb__jit_register_pair_offsets[op >> 4u], (op & 0x08) ? -1 : 1);
+	}
+	else if (GB_LAZY_FLAGS && op < 0x40 && (op & 0x06) == 0x04)  // INC/DEC r, INC/DEC (HL)
+	{
+		if (dst == 6)
+		{
+			gb__JitSlowPath *slow = gb__JitBeginSlowPath(e, inst, pc);
+			gb__JitEmitLoadWord(jit, hl);
+			gb__JitEmitWritePointer(e, slow);
+			gb__JitEmitIncDec(e, 0, op & 0x01);
+		}
+		else
+		{
+			gb__JitEmitIncDec(e, gb__jit_register_offsets[dst], op & 0x01);
+		}
+	}
+	else if (op < 0x40 && (op & 0x07) == 0x06)  // LD r, u8, LD (HL), u8
+	{
+		if (dst == 6)
+		{
+			gb__JitSlowPath *slow = gb__JitBeginSlowPath(e, inst, pc);
+			gb__JitEmitLoadWord(jit, hl);
+			gb__JitEmitWritePointer(e, slow);
+			GB__JIT_EMIT(jit, 0xC6, 0x01, inst.operand_byte);  // mov byte [rcx], u8
+		}
+		else
+		{
+			gb__JitEmitStoreByteImm(jit, gb__jit_register_offsets[dst], inst.operand_byte);
+		}
+	}
+	else if (op == 0x07 || op == 0x0F)  // RLCA, RRCA
+	{
+		gb__JitEmitLoadByte(jit, GB__JIT_EAX, a);
+		GB__JIT_EMIT(jit, 0xD0, op == 0x07 ? 0xC0 : 0xC8);  // rol/ror al, 1
+		gb__JitEmitStoreAl(jit, a);
+		GB__JIT_EMIT(jit,
+				0x0F, 0x92, 0xC0,  // setc al
+				0xC0, 0xE0, 0x04);  // shl al, 4
+		gb__JitEmitStoreAl(jit, GB__JIT_OFFSET(cpu.f));
+		gb__JitEmitStoreByteImm(jit, GB__JIT_OFFSET(cpu.lazy_flags.op), GB__LAZY_FLAGS_OP_NONE);
+		gb__JitEmitStoreByteImm(jit, GB__JIT_OFFSET(cpu.lazy_flags.inc_dec_op), GB__LAZY_FLAGS_OP_NONE);
+		e->zero = e->carry = GB__JIT_FLAGS_MATERIALIZED;
+	}
+	else if ((op & 0xCF) == 0x02)  // LD (BC), A, LD (DE), A, LD (HL+), A, LD (HL-), A
+	{
+		gb__JitSlowPath *slow = gb__JitBeginSlowPath(e, inst, pc);
+		gb__JitEmitLoadWord(jit, gb__jit_register_pair_offsets[MIN(op >> 4u, 2)]);
+		gb__JitEmitWritePointer(e, slow);
+		gb__JitEmitLoadByte(jit, GB__JIT_EAX, a);
+		GB__JIT_EMIT(jit, 0x88, 0x01);  // mov byte [rcx], al
+		if (op >= 0x22)
+		{
+			gb__JitEmitAddWordImm(jit, hl, op == 0x32 ? -1 : 1);
+		}
+	}
+	else if ((op & 0xCF) == 0x0A)  // LD A, (BC), LD A, (DE), LD A, (HL+), LD A, (HL-)
+	{
+		gb__JitEmitLoadWord(jit, gb__jit_register_pair_offsets[MIN(op >> 4u, 2)]);
+		gb__JitEmitRead(e);
+		gb__JitEmitStoreAl(jit, a);
+		if (op >= 0x2A)
+		{
+			gb__JitEmitAddWordImm(jit, hl, op == 0x3A ? -1 : 1);
+		}
+	}
+	else if (op >= 0x40 && op < 0x80 && op != 0x76)  // LD r, r, LD r, (HL), LD (HL), r
+	{
+		if (dst == 6)
+		{
+			gb__JitSlowPath *slow = gb__JitBeginSlowPath(e, inst, pc);
+			gb__JitEmitLoadWord(jit, hl);
+			gb__JitEmitWritePointer(e, slow);
+			gb__JitEmitLoadByte(jit, GB__JIT_EAX, gb__jit_register_offsets[src]);
+			GB__JIT_EMIT(jit, 0x88, 0x01);  // mov byte [rcx], al
+		}
+		else
+		{
+			gb__JitEmitLoadOperand(e, src);
+			gb__JitEmitStoreAl(jit, gb__jit_register_offsets[dst]);
+		}
+	}
+	else if (GB_LAZY_FLAGS && op >= 0x80 && op < 0xC0 && dst != 1 && dst != 3)  // ALU A, r
+	{
+		gb__JitEmitLoadOperand(e, src);
+		GB__JIT_EMIT(jit, 0x89, 0xC1);  // mov ecx, eax
+		gb__JitEmitAlu(e, dst);
+	}
+	else if (GB_LAZY_FLAGS && op >= 0xC0 && (op & 0x07) == 0x06 && dst != 1 && dst != 3)  // ALU A, u8
+	{
+		GB__JIT_EMIT(jit, 0xB9);  // mov ecx, u8
+		gb__JitEmitU32(jit, inst.operand_byte);
+		gb__JitEmitAlu(e, dst);
+	}
+	else if (op == 0xF0 || op == 0xFA)  // LD A, (FF00 + u8), LD A, (u16)
+	{
+		GB__JIT_EMIT(jit, 0xB8);  // mov eax, address
+		gb__JitEmitU32(jit, op == 0xF0 ? 0xFF00u + inst.operand_byte : inst.operand_word);
+		gb__JitEmitRead(e);
+		gb__JitEmitStoreAl(jit, a);
+	}
+	else if (op == 0xE0 || op == 0xEA)  // LD (FF00 + u8), A, LD (u16), A
+	{
+		const uint16_t addr = op == 0xE0 ? 0xFF00u + inst.operand_byte : inst.operand_word;
+		if (addr >= 0xFF80 && addr < 0xFFFF)
+		{
+			gb__JitEmitLoadByte(jit, GB__JIT_EAX, a);
+			gb__JitEmitStoreAl(jit, GB__JIT_OFFSET(memory.zero_page_ram) + (addr & 0x7F));
+		}
+		else if (addr >= 0xFF00)
+		{
+			return false;  // I/O registers, always need the handler.
+		}
+		else
+		{
+			gb__JitSlowPath *slow = gb__JitBeginSlowPath(e, inst, pc);
+			GB__JIT_EMIT(jit, 0xB8);  // mov eax, address
+			gb__JitEmitU32(jit, addr);
+			gb__JitEmitWritePointer(e, slow);
+			gb__JitEmitLoadByte(jit, GB__JIT_EAX, a);
+			GB__JIT_EMIT(jit, 0x88, 0x01);  // mov byte [rcx], al
+		}
+	}
+	else if ((op & 0xCF) == 0xC5)  // PUSH rr
+	{
+		size_t lo = gb__jit_register_pair_offsets[(op >> 4u) & 0x03];
+		if (op == 0xF5)
+		{
+			gb__JitEmitLoadFlags(e);
+			lo = GB__JIT_OFFSET(cpu.af);
+			e->zero = e->carry = GB__JIT_FLAGS_MATERIALIZED;
+		}
+		gb__JitSlowPath *slow = gb__JitBeginSlowPath(e, inst, pc);
+		gb__JitEmitPushPointers(e, slow);
+		gb__JitEmitLoadByte(jit, GB__JIT_EAX, lo);
+		GB__JIT_EMIT(jit, 0x88, 0x01);  // mov byte [rcx], al
+		gb__JitEmitLoadByte(jit, GB__JIT_EAX, lo + 1);
+		GB__JIT_EMIT(jit, 0x88, 0x06);  // mov byte [rsi], al
+		gb__JitEmitAddWordImm(jit, sp, -2);
+	}
+	else if ((op & 0xCF) == 0xC1)  // POP rr
+	{
+		if (op == 0xF1)
+		{
+			gb__JitEmitPop(e, GB__JIT_OFFSET(cpu.f), a, true);
+			gb__JitEmitStoreByteImm(jit, GB__JIT_OFFSET(cpu.lazy_flags.op), GB__LAZY_FLAGS_OP_NONE);
+			gb__JitEmitStoreByteImm(jit, GB__JIT_OFFSET(cpu.lazy_flags.inc_dec_op), GB__LAZY_FLAGS_OP_NONE);
+			e->zero = e->carry = GB__JIT_FLAGS_MATERIALIZED;
+		}
+		else
+		{
+			const size_t rr = gb__jit_register_pair_offsets[(op >> 4u) & 0x03];
+			gb__JitEmitPop(e, rr, rr + 1, false);
+		}
+	}
+	else if (op == 0xF9)  // LD SP, HL
+	{
+		gb__JitEmitLoadWord(jit, hl);
+		GB__JIT_EMIT(jit, 0x66, 0x89);  // mov word [gb + sp], ax
+		gb__JitEmitGbOperand(jit, GB__JIT_EAX, sp);
+	}
+	else if (op == 0x18 || op == 0xC3 || (op & 0xE7) == 0x20 || (op & 0xE7) == 0xC2)  // JR, JP
+	{
+		const uint16_t target = (op & 0x40) ? inst.operand_word : (uint16_t)(next_pc + (int8_t)inst.operand_byte);
+		if (op == 0x18 || op == 0xC3)
+		{
+			gb__JitEmitElapse(e, target, true, info.num_machine_cycles_wo_branch);
+			gb__JitEmitGoto(e, target);
+			return true;
+		}
+
+		const size_t jcc_taken = gb__JitEmitJump(jit, gb__JitEmitCondition(e, dst & 0x03));
+		gb__JitEmitElapse(e, next_pc, true, info.num_machine_cycles_wo_branch);
+		gb__JitEmitGoto(e, next_pc);
+
+		gb__JitPatchJump(jit, jcc_taken, jit->code_size);
+		gb__JitEmitElapse(e, target, true, info.num_machine_cycles_with_branch);
+		gb__JitEmitGoto(e, target);
+		return true;
+	}
+	else if (op == 0xCD || (op & 0xE7) == 0xC4 || (op & 0xC7) == 0xC7)  // CALL, RST
+	{
+		const uint16_t target = (op & 0x07) == 0x07 ? op & 0x38 : inst.operand_word;
+		size_t jcc_not_taken = 0;
+		if ((op & 0xE7) == 0xC4)
+		{
+			jcc_not_taken = gb__JitEmitJump(jit, gb__JitEmitCondition(e, dst & 0x03) ^ 0x01);
+		}
+
+		gb__JitSlowPath *slow = gb__JitBeginSlowPath(e, inst, pc);
+		gb__JitEmitPushPointers(e, slow);
+		GB__JIT_EMIT(jit,
+				0xC6, 0x01, (uint8_t)next_pc,  // mov byte [rcx], lo(next_pc)
+				0xC6, 0x06, (uint8_t)(next_pc >> 8u));  // mov byte [rsi], hi(next_pc)
+		gb__JitEmitAddWordImm(jit, sp, -2);
+		gb__JitEmitElapse(e, target, true,
+				jcc_not_taken ? info.num_machine_cycles_with_branch : info.num_machine_cycles_wo_branch);
+		gb__JitEmitGoto(e, target);
+
+		if (jcc_not_taken)
+		{
+			gb__JitPatchJump(jit, jcc_not_taken, jit->code_size);
+			gb__JitEmitElapse(e, next_pc, true, info.num_machine_cycles_wo_branch);
+			gb__JitEmitGoto(e, next_pc);
+		}
+		return true;
+	}
+	else if (op == 0xC9 || (op & 0xE7) == 0xC0)  // RET
+	{
+		size_t jcc_not_taken = 0;
+		if (op != 0xC9)
+		{
+			jcc_not_taken = gb__JitEmitJump(jit, gb__JitEmitCondition(e, dst & 0x03) ^ 0x01);
+		}
+
+		const size_t pc_offset = GB__JIT_OFFSET(cpu.pc);
+		gb__JitEmitPop(e, pc_offset, pc_offset + 1, false);
+		gb__JitEmitElapse(e, 0, false,
+				jcc_not_taken ? info.num_machine_cycles_with_branch : info.num_machine_cycles_wo_branch);
+		e->epilogue_jumps[e->num_epilogue_jumps++] = gb__JitEmitJump(jit, 0xE9);
+
+		if (jcc_not_taken)
+		{
+			gb__JitPatchJump(jit, jcc_not_taken, jit->code_size);
+			gb__JitEmitElapse(e, next_pc, true, info.num_machine_cycles_wo_branch);
+			gb__JitEmitGoto(e, next_pc);
+		}
+		return true;
+	}
+	else if (op == 0xE9)  // JP HL
+	{
+		gb__JitEmitLoadWord(jit, hl);
+		GB__JIT_EMIT(jit, 0x66, 0x89);  // mov word [gb + pc], ax
+		gb__JitEmitGbOperand(jit, GB__JIT_EAX, GB__JIT_OFFSET(cpu.pc));
+		gb__JitEmitElapse(e, 0, false, info.num_machine_cycles_wo_branch);
+		e->epilogue_jumps[e->num_epilogue_jumps++] = gb__JitEmitJump(jit, 0xE9);
+		return true;
+	}
+	else
+	{
+		return false;
+	}
+
+	gb__JitEmitElapse(e, next_pc, true, info.num_machine_cycles_wo_branch);
+	if (is_last)
+	{
+		gb__JitEmitGoto(e, next_pc);
+	}
+	return true;
+}
+
+// Calls the instruction's handler. For instructions with side effects,
+// gb__JitFinishInstruction then decides whether the block can go on.
+static void
+gb__JitEmitHandlerCall(gb__JitEmitter *e, gb_Instruction inst, uint16_t pc, bool is_last)
+{
+	gb_Jit *jit = e->jit;
+	const uint16_t next_pc = (uint16_t)(pc + gb_InstructionSize(inst));
+	gb__OpcodeHandler *handler = inst.is_extended ? gb__extended_handlers[inst.opcode] : gb__basic_handlers[inst.opcode];
+
+	gb__JitEmitStoreWordImm(jit, GB__JIT_OFFSET(cpu.pc), pc);
+	gb__JitEmitStoreNow(jit);
+	GB__JIT_EMIT(jit, 0x48, 0x89, 0xDF);  // mov rdi, rbx
+	gb__JitEmitCall(jit, (const void *)handler);
+	GB__JIT_EMIT(jit, 0x0F, 0xB7, 0xD0);  // movzx edx, ax
+	e->zero = e->carry = GB__JIT_FLAGS_UNKNOWN;
+
+	if (gb__JitIsPure(inst))
+	{
+		gb__JitEmitElapse(e, next_pc, false, 0);
+		if (is_last)
+		{
+			gb__JitEmitGoto(e, next_pc);
 		}
 	}
+	else
+	{
+		GB__JIT_EMIT(jit,
+				0x48, 0x89, 0xDF,  // mov rdi, rbx
+				0x4C, 0x89, 0xE6);  // mov rsi, r12
+		gb__JitEmitCall(jit, (const void *)&gb__JitFinishInstruction);
+		gb__JitEmitLoadNowAndLimit(jit);
+		GB__JIT_EMIT(jit, 0x84, 0xC0);  // test al, al
+		e->leave_jumps[e->num_leave_jumps++] = gb__JitEmitJump(jit, is_last ? 0xE9 : 0x84);  // jmp/jz
+	}
+}
 
-	// Create a 48 kHz sample if it's time.
+// Instructions in the block can't leave the 16 KiB ROM bank that the block
+// starts in, and they can't reach address 0x0100 (see gb__Step).
+static bool
+gb__JitCanCompile(const gb_GameBoy *gb, uint16_t addr)
+{
+	return addr < 0x8000 && addr != 0x0100 && gb->memory.read_pages[addr >> 12u] && (addr & 0x3FFF) < 0x3FFE;
+}
 
-	// We should pump out a new sample every 1024 * 1024 / 48 kHz.
-	// This is not an integral number, therefore let's go via the LCM.
-	//
-	// LCM of 48k and 1 MHz is 375 * 1024 * 1024 == 8192 * 48000
-	gb->apu.clock_acc += elapsed_m_cycles * 375;
-	uint64_t sampling_period = 8192;
-	if (gb->apu.speed_multiplier_shift > 0)
+// Changes the protection of the pages that contain 'size' bytes at 'offset'.
+static bool
+gb__JitProtect(gb_Jit *jit, size_t offset, size_t size, bool writable)
+{
+	const size_t begin = offset & ~(jit->page_size - 1);
+	const size_t end = (offset + size + jit->page_size - 1) & ~(jit->page_size - 1);
+	return mprotect(jit->code + begin, end - begin, PROT_READ | (writable ? PROT_WRITE : PROT_EXEC)) == 0;
+}
+
+// Returns NULL if the code at PC can't be compiled.
+static gb__JitBlock *
+gb__JitGetBlock(gb_Jit *jit, gb_GameBoy *gb)
+{
+	const uint16_t start_pc = gb->cpu.pc;
+	if (!gb__JitCanCompile(gb, start_pc))
 	{
-		sampling_period <<= gb->apu.speed_multiplier_shift;
+		return NULL;
 	}
-	else if (gb->apu.speed_multiplier_shift < 0)
+
+	const uint8_t *page = gb->memory.read_pages[start_pc >> 12u];
+	const uint32_t rom_offset = (uint32_t)(page - gb->rom.data) + (start_pc & 0x0FFF);
+	const uint32_t index = (rom_offset ^ (rom_offset >> 14u)) & (JIT_NUM_BLOCKS - 1);
+	if (jit->blocks[index].tag == rom_offset + 1)
 	{
-		sampling_period >>= -gb->apu.speed_multiplier_shift;
+		return (gb__JitBlock *)(void *)(jit->code + jit->blocks[index].code_offset);
 	}
-	assert((sampling_period & (sampling_period - 1)) == 0);  // POT
 
-	// NOTE: This should only do more than 1 iteration when switching from a higher
-	// speed to a lower one.
-	while (gb->apu.clock_acc >= sampling_period)
+	// Decode the block first.
+	gb_Instruction insts[JIT_MAX_BLOCK_LENGTH];
+	size_t num_insts = 0;
+	uint16_t addr = start_pc;
+	while (num_insts < JIT_MAX_BLOCK_LENGTH && gb__JitCanCompile(gb, addr) && (addr & 0xC000) == (start_pc & 0xC000))
 	{
-		gb->apu.clock_acc -= sampling_period;
-
-		if (gb->apu.callback)
+		const gb_Instruction inst = gb_FetchInstruction(gb, addr);
+		if (gb__JitIsUndefined(inst))
 		{
-			float samples[2] = { 0 };
-			if (gb->apu.audio_enable)
-			{
-				struct gb_PulseA *ch1 = &gb->apu.ch1;
-				struct gb_PulseB *ch2 = &gb->apu.ch2;
-				struct gb_Wave *ch3 = &gb->apu.ch3;
-				struct gb_Noise *ch4 = &gb->apu.ch4;
-
-				// TODO(stefalie): Add a GUI/debugger option to selectively disable channels.
-
-				if (ch1->channel_enable)
-				{
-					assert(ch1->dac_enable);
-
-					uint8_t sample = ch1->volume_sweep.current_volume *
-							gb__PwmWaveForms[ch1->nr11.duty_cycle][ch1->wave_timer.wave_pos];
-					if (gb->apu.nr51.ch1_left == 1)
-					{
-						samples[0] += 1.0f - sample / 7.5f;
-					}
-					if (gb->apu.nr51.ch1_right == 1)
-					{
-						samples[1] += 1.0f - sample / 7.5f;
-					}
-				}
+			break;
+		}
+		insts[num_insts++] = inst;
+		addr += gb_InstructionSize(inst);
+		if (gb__JitEndsBlock(inst))
+		{
+			break;
+		}
+	}
+	if (num_insts == 0)
+	{
+		return NULL;
+	}
 
-				if (ch2->channel_enable)
-				{
-					assert(ch2->dac_enable);
+	const size_t max_block_size = 64 + num_insts * JIT_MAX_INSTRUCTION_SIZE;
+	if (jit->code_size + max_block_size > JIT_CODE_SIZE)
+	{
+		gb__JitFlush(jit, gb);
+	}
 
-					uint8_t sample = ch2->volume_sweep.current_volume *
-							gb__PwmWaveForms[ch2->nr21.duty_cycle][ch2->wave_timer.wave_pos];
-					if (gb->apu.nr51.ch2_left == 1)
-					{
-						samples[0] += 1.0f - sample / 7.5f;
-					}
-					if (gb->apu.nr51.ch2_right == 1)
-					{
-						samples[1] += 1.0f - sample / 7.5f;
-					}
-				}
+	// Only the pages that the block can end up in are made writable.
+	const size_t code_offset = jit->code_size;
+	if (!gb__JitProtect(jit, code_offset, max_block_size, true))
+	{
+		return NULL;
+	}
 
-				if (ch3->channel_enable)
-				{
-					assert(ch3->nr30.dac_enable);
-					uint8_t pos = ch3->wave_timer.wave_pos;
-					// NOTE: I think Argentum does the wrong thing here. Upper nibble comes first.
-					uint8_t sample = (gb->apu.wave_pattern[pos / 2] >> ((pos & 0x01) == 0 ? 4u : 0u)) & 0x0F;
+	// Prologue: keep 'gb', 'ctx', the limit, and the time in callee-saved
+	// registers, the 5th push aligns the stack to 16 bytes for the calls.
+	GB__JIT_EMIT(jit,
+			0x53,  // push rbx
+			0x41, 0x54,  // push r12
+			0x41, 0x56,  // push r14
+			0x41, 0x57,  // push r15
+			0x50,  // push rax
+			0x48, 0x89, 0xFB,  // mov rbx, rdi
+			0x49, 0x89, 0xF4);  // mov r12, rsi
+	gb__JitEmitLoadNowAndLimit(jit);
+
+	// Chained blocks are entered here (see gb__JitLink).
+	jit->prologue_size = jit->code_size - code_offset;
+	GB__JIT_EMIT(jit, 0x41, 0xC7, 0x44, 0x24, (uint8_t)offsetof(gb__JitContext, link));  // mov dword [ctx + link], 0
+	gb__JitEmitU32(jit, 0);
+
+	gb__JitEmitter e = {
+		.jit = jit,
+		.start_pc = start_pc,
+	};
 
-					uint8_t volume_shift = 0xFF;
-					if (ch3->nr32.output_level == 1)
-					{
-						volume_shift = 0;
-					}
-					else if (ch3->nr32.output_level == 2)
-					{
-						volume_shift = 1;
-					}
-					else if (ch3->nr32.output_level == 3)
-					{
-						volume_shift = 2;
-					}
-					else if (ch3->nr32.output_level == 0)
-					{
-						volume_shift = 4;
-					}
-					assert(volume_shift != 0xFF);
+	uint16_t pc = start_pc;
+	for (size_t i = 0; i < num_insts; ++i)
+	{
+		const gb_Instruction inst = insts[i];
+		const bool is_last = i + 1 == num_insts;
+		const size_t num_slow_paths = e.num_slow_paths;
+		if (!gb__JitEmitInline(&e, inst, pc, is_last))
+		{
+			gb__JitEmitHandlerCall(&e, inst, pc, is_last);
+		}
 
-					sample >>= volume_shift;
+		if (e.num_slow_paths > num_slow_paths)
+		{
+			e.slow_paths[num_slow_paths].resume = is_last ? 0 : jit->code_size;
+		}
+		pc = (uint16_t)(pc + gb_InstructionSize(inst));
+	}
 
-					if (gb->apu.nr51.ch3_left == 1)
-					{
-						samples[0] += 1.0f - sample / 7.5f;
-					}
-					if (gb->apu.nr51.ch3_right == 1)
-					{
-						samples[1] += 1.0f - sample / 7.5f;
-					}
-				}
+	// Epilogue
+	const size_t epilogue_offset = jit->code_size;
+	gb__JitEmitStoreNow(jit);
+	const size_t leave_offset = jit->code_size;
+	GB__JIT_EMIT(jit,
+			0x58,  // pop rax
+			0x41, 0x5F,  // pop r15
+			0x41, 0x5E,  // pop r14
+			0x41, 0x5C,  // pop r12
+			0x5B,  // pop rbx
+			0xC3);  // ret
+
+	// Exits for instructions that reach ctx->limit
+	for (size_t i = 0; i < e.num_exits; ++i)
+	{
+		const gb__JitExit *exit = &e.exits[i];
+		gb__JitPatchJump(jit, exit->jump, jit->code_size);
+		if (exit->set_pc)
+		{
+			gb__JitEmitStoreWordImm(jit, GB__JIT_OFFSET(cpu.pc), exit->pc);
+		}
+		if (exit->num_cycles > 0)
+		{
+			GB__JIT_EMIT(jit, 0xBA);  // mov edx, num_cycles
+			gb__JitEmitU32(jit, exit->num_cycles);
+		}
+		gb__JitEmitStoreNow(jit);
+		GB__JIT_EMIT(jit,
+				0x48, 0x89, 0xDF,  // mov rdi, rbx
+				0x4C, 0x89, 0xE6);  // mov rsi, r12
+		gb__JitEmitCall(jit, (const void *)&gb__JitLeave);
+		gb__JitPatchJump(jit, gb__JitEmitJump(jit, 0xE9), leave_offset);
+	}
 
-				if (ch4->channel_enable)
-				{
-					assert(ch4->dac_enable);
+	// Slow paths for inline instructions that access memory with side effects
+	for (size_t i = 0; i < e.num_slow_paths; ++i)
+	{
+		const gb__JitSlowPath *slow = &e.slow_paths[i];
+		for (size_t j = 0; j < slow->num_jumps; ++j)
+		{
+			gb__JitPatchJump(jit, slow->jumps[j], jit->code_size);
+		}
+		gb__JitEmitHandlerCall(&e, slow->inst, slow->pc, !slow->resume);
+		if (slow->resume)
+		{
+			gb__JitPatchJump(jit, gb__JitEmitJump(jit, 0xE9), slow->resume);
+		}
+	}
+	assert(jit->code_size - code_offset <= max_block_size);
 
-					uint8_t sample = ch4->volume_sweep.current_volume * (ch4->lfsr_state & 0x0001);
+	for (size_t i = 0; i < e.num_epilogue_jumps; ++i)
+	{
+		gb__JitPatchJump(jit, e.epilogue_jumps[i], epilogue_offset);
+	}
+	for (size_t i = 0; i < e.num_leave_jumps; ++i)
+	{
+		gb__JitPatchJump(jit, e.leave_jumps[i], leave_offset);
+	}
 
-					if (gb->apu.nr51.ch4_left == 1)
-					{
-						samples[0] += 1.0f - sample / 7.5f;
-					}
-					if (gb->apu.nr51.ch4_right == 1)
-					{
-						samples[1] += 1.0f - sample / 7.5f;
-					}
-				}
-			}
+	if (!gb__JitProtect(jit, code_offset, max_block_size, false))
+	{
+		gb__JitFlush(jit, gb);
+		return NULL;
+	}
 
-			// TODO(stefalie): Remove this debug sine wave once it's not used anymore.
-			// static int t;
-			// samples[0] = sinf((2.0f * 3.14159265358f) * 240 /* Hz */ * t++ * 1.0f / GB_AUDIO_SAMPLING_RATE);
-			// samples[1] = samples[0];
+	jit->blocks[index].tag = rom_offset + 1;
+	jit->blocks[index].code_offset = (uint32_t)code_offset;
+	return (gb__JitBlock *)(void *)(jit->code + code_offset);
+}
 
-			// TODO(stefalie): should these be rounded instead of truncated?
-			const float volume_multiplier = 1.0f;
-			int8_t int_samples[] = {
-				(int8_t)(samples[0] * (gb->apu.nr50.left_volume + 1) * volume_multiplier),
-				(int8_t)(samples[1] * (gb->apu.nr50.right_volume + 1) * volume_multiplier),
-			};
-			gb->apu.callback(gb->apu.callback_user_data, int_samples, 2);
-		}
+// Patches the jump at the end of the block that was left last to go straight
+// to 'block' next time.
+static void
+gb__JitLink(gb_Jit *jit, const gb_GameBoy *gb, uint32_t link, gb__JitBlock *block)
+{
+	// The rel32 can straddle two pages.
+	if (!gb__JitProtect(jit, link - sizeof(int32_t), sizeof(int32_t), true))
+	{
+		return;
+	}
+	gb__JitPatchJump(jit, link, (size_t)((uint8_t *)(void *)block - jit->code) + jit->prologue_size);
+	if (!gb__JitProtect(jit, link - sizeof(int32_t), sizeof(int32_t), false))
+	{
+		gb__JitFlush(jit, gb);
 	}
 }
 
-size_t
-gb_ExecuteNextInstruction(gb_GameBoy *gb)
+// The compiled code can only execute instructions inline if there's nothing
+// for gb__FinishStep to do but to let time pass. Nothing that the inline
+// instructions do can change that, it's only ever the case after EI and
+// after the interpreter handled an instruction.
+static bool
+gb__JitCanEnterBlock(const gb_GameBoy *gb)
 {
-	assert(gb->rom.data);
-	assert(gb->rom.num_bytes);
+	const struct gb_Interrupt *intr = &gb->cpu.interrupt;
+	return !gb->cpu.halt && !intr->ime_after_next_inst && !(intr->ime && (intr->ie_flags.reg & intr->if_flags.reg)) &&
+			!gb->serial.enable_interrupt_timer;
+}
 
-	if (gb->cpu.pc == 0x0100)
+gb_RunResult
+gb_RunCyclesJit(gb_GameBoy *gb, gb_Jit *jit, size_t m_cycle_budget, const gb_StopConditions *stop_conditions)
+{
+	if (!jit || (stop_conditions && stop_conditions->num_breakpoints > 0))
 	{
-		// The BIOS gets automatically unmapped by writing to 0xFF50, and the
-		// BIOS itself does that.
-		assert(!gb->memory.bios_mapped);
+		return gb_RunCycles(gb, m_cycle_budget, stop_conditions);
+	}
 
-		// See Sec. 5.1 of The Cycle-Accurate Game Boy Docs
-		// The timer will be bogus will running the BIOS.
-		gb->timer.t_clock = 0xABCC;
+	if (jit->rom_data != gb->rom.data || jit->rom_num_bytes != gb->rom.num_bytes)
+	{
+		gb__JitFlush(jit, gb);
 	}
 
-	uint16_t num_cycles = 0;
-	if (!gb->cpu.halt)
+	// The cycles that the interpreter counts are exactly the ones that elapse.
+	const uint64_t start = gb->scheduler.now;
+	gb__JitContext ctx = {
+		.end = start + MIN(m_cycle_budget, UINT64_MAX - start),
+		.frame_count = gb->display.frame_count,
+		.stop_at_vblank = stop_conditions && stop_conditions->stop_at_vblank,
+	};
+
+	while (gb->scheduler.now < ctx.end)
 	{
-		const gb_Instruction inst = gb_FetchInstruction(gb, gb->cpu.pc);
-		gb->cpu.pc += gb_InstructionSize(inst);
+		// The jump at the end of the last block that can be chained to the next.
+		const uint32_t link = ctx.link;
+		const uint32_t generation = jit->generation;
+		ctx.link = 0;
 
-		num_cycles =
-				inst.is_extended ? gb__ExecuteExtendedInstruction(gb, inst) : gb__ExecuteBasicInstruction(gb, inst);
+		gb__JitBlock *block = gb__JitCanEnterBlock(gb) ? gb__JitGetBlock(jit, gb) : NULL;
+		if (block)
+		{
+			if (link && jit->generation == generation)
+			{
+				gb__JitLink(jit, gb, link, block);
+			}
 
-		// NOTE: Unclear if the updates should be done before or after the execution
-		// of the instruction. (Before has the problem that you don't know how many
-		// cycles it took in the case of a conditional jump.) That is the curse of
-		// instruction-stepping and of always rendering full scan lines at once.
-		gb__AdvancePpu(gb, num_cycles);
-		gb__UpdateClockAndTimer(gb, num_cycles);
-		gb__AdvanceApu(gb, num_cycles);
+			ctx.limit = MIN(gb->scheduler.next_event, ctx.end);
+			ctx.rom_bank0 = gb->memory.rom_bank0;
+			ctx.rom_bankx = gb->memory.rom_bankx;
+			block(gb, &ctx);
+		}
+		else
+		{
+			gb__Step(gb, ctx.end - gb->scheduler.now);
+		}
 
-#if BLARGG_TEST_ENABLE
-		if (gb->serial.sc == 0x81)
+		if (ctx.stop_at_vblank && gb->display.frame_count != ctx.frame_count)
 		{
-			char c = gb->serial.sb;
-			printf("%c", c);
-			gb->serial.sc = 0;
+			break;
 		}
-#endif
 	}
 
-	const uint16_t num_interrupt_cycles = gb__HandleInterrupts(gb);
-	if (num_interrupt_cycles > 0)
-	{
-		gb__AdvancePpu(gb, num_interrupt_cycles);
-		gb__UpdateClockAndTimer(gb, num_interrupt_cycles);
-		gb__AdvanceApu(gb, num_interrupt_cycles);
-		num_cycles += num_interrupt_cycles;
-	}
+	gb__SyncAll(gb);
 
-	if (gb->cpu.interrupt.ime_after_next_inst)
+	gb_RunResult result = { gb->scheduler.now - start, GB_STOP_REASON_BUDGET };
+	if (ctx.stop_at_vblank && gb->display.frame_count != ctx.frame_count)
 	{
-		gb->cpu.interrupt.ime = true;
-		gb->cpu.interrupt.ime_after_next_inst = false;
+		result.stop_reason = GB_STOP_REASON_VBLANK;
 	}
+	return result;
+}
 
-	if (num_cycles == 0)
-	{
-		// When the CPU is halted, we still need to let cycles "elapse" so that the
-		// timer progresses.
-		// TODO(stefalie): Take bigger steps when just advancing the timer? 4 m cycles instead?
-		num_cycles = 1;
-		gb__UpdateClockAndTimer(gb, num_cycles);
-		gb__AdvancePpu(gb, num_cycles);
-		gb__AdvanceApu(gb, num_cycles);
-	}
+#else
 
-	if (gb->serial.enable_interrupt_timer)
-	{
-		// This will trigger an interrupt 8 bit clocks (8192 Hz) later on.
-		// See page 31 of the GameBoy CPU manual.
-		// GB_MACHINE_M_FREQ / 8192 == 128 m cyles
-		gb->serial.interrupt_timer = 128 * 8;
+gb_Jit *
+gb_CreateJit(void)
+{
+	return NULL;
+}
 
-		gb->serial.enable_interrupt_timer = false;
-	}
+void
+gb_DestroyJit(gb_Jit *jit)
+{
+	(void)jit;
+}
 
-	assert(num_cycles > 0);
-	return num_cycles;
+gb_RunResult
+gb_RunCyclesJit(gb_GameBoy *gb, gb_Jit *jit, size_t m_cycle_budget, const gb_StopConditions *stop_conditions)
+{
+	(void)jit;
+	return gb_RunCycles(gb, m_cycle_budget, stop_conditions);
 }
 
+#endif
+
 void
 gb_SetInput(gb_GameBoy *gb, gb_Input input, bool down)
 {
@@ -4484,9 +7752,51 @@ gb_SetInput(gb_GameBoy *gb, gb_Input input, bool down)
 void
 gb_SetAudioCallback(gb_GameBoy *gb, gb_AudioCallback *callback, void *user_data, int speed_multiplier_shift)
 {
+	// The buffered samples still go to the previous callback.
+	gb__SyncApu(gb);
+	gb__DeliverAudio(gb);
 	gb->apu.callback = callback;
 	gb->apu.callback_user_data = user_data;
 	gb->apu.speed_multiplier_shift = speed_multiplier_shift;
+	gb__ScheduleApu(gb);
+}
+
+void
+gb_SetAudioChunkSize(gb_GameBoy *gb, uint16_t num_samples)
+{
+	assert(num_samples <= GB_AUDIO_MAX_CHUNK_SIZE);
+	gb_FlushAudio(gb);
+	gb->apu.chunk_size = MIN(num_samples, GB_AUDIO_MAX_CHUNK_SIZE);
+}
+
+void
+gb_SetAudioFormat(gb_GameBoy *gb, gb_AudioFormat format)
+{
+	gb_FlushAudio(gb);
+	gb->apu.format = format;
+}
+
+void
+gb_SetAudioSynthesis(gb_GameBoy *gb, gb_AudioSynthesis synthesis)
+{
+	gb_FlushAudio(gb);
+	struct gb_Apu *apu = &gb->apu;
+	apu->synthesis = synthesis;
+
+	// Start at the current output, there is no step.
+	gb__MixChannels(gb, apu->blip_amplitudes);
+	apu->blip_sums[0] = apu->blip_amplitudes[0] * (1 << GB__BLIP_FRAC_BITS);
+	apu->blip_sums[1] = apu->blip_amplitudes[1] * (1 << GB__BLIP_FRAC_BITS);
+	memset(apu->blip_deltas, 0, sizeof(apu->blip_deltas));
+	apu->clock_acc %= gb__SamplingPeriod(gb);
+	gb__ScheduleApu(gb);
+}
+
+void
+gb_FlushAudio(gb_GameBoy *gb)
+{
+	gb__SyncApu(gb);
+	gb__DeliverAudio(gb);
 }
 
 gb_Tile
@@ -4524,32 +7834,160 @@ gb_GetMapTile(gb_GameBoy *gb, uint8_t map_index, uint8_t address_mode, size_t ti
 	return result;
 }
 
+void
+gb_SetLayers(gb_GameBoy *gb, gb_Layers *layers)
+{
+	struct gb_LayerCache *cache = &gb->memory.layer_cache;
+	*cache = (struct gb_LayerCache){ 0 };
+	cache->layers = layers;
+	cache->dirty = layers != NULL;
+	cache->all_dirty = layers != NULL;
+}
+
+const uint8_t *
+gb_GetLayer(gb_GameBoy *gb, uint8_t map_index, uint8_t address_mode)
+{
+	assert(map_index < 2 && address_mode < 2);
+	if (!gb->memory.layer_cache.layers)
+	{
+		return NULL;
+	}
+
+	gb__UpdateLayers(gb);
+	return &gb->memory.layer_cache.layers->pixels[map_index][address_mode][0][0];
+}
+
+void
+gb_SetFrameSkip(gb_GameBoy *gb, uint8_t num_skipped_frames)
+{
+	gb->display.frame_skip = num_skipped_frames;
+}
+
+void
+gb_SetDeferredRendering(gb_GameBoy *gb, bool enable)
+{
+	struct gb_Display *display = &gb->display;
+	gb__ComposeLoggedLines(gb);
+	display->deferred = enable;
+
+	// The lines before LY have been rendered already.
+	const uint8_t first_line = enable ? MIN(gb->ppu.ly, GB_FRAMEBUFFER_HEIGHT) : 0;
+	display->log_begin = first_line;
+	display->log_end = first_line;
+}
+
+bool
+gb_TakeDeferredFrame(gb_GameBoy *gb, gb_GameBoy *target)
+{
+	assert(gb != target);
+	struct gb_Display *display = &gb->display;
+	if (!display->deferred || display->log_end != GB_FRAMEBUFFER_HEIGHT)
+	{
+		return false;
+	}
+
+	gb_SetFramebufferFormat(target, display->format);
+
+	// The lines that had to be composed because of VRAM/OAM writes.
+	for (uint8_t ly = 0; ly < display->log_begin; ++ly)
+	{
+		gb__StoreScanLineShades(target, ly, &display->shades[GB_FRAMEBUFFER_WIDTH * ly]);
+	}
+
+	// Everything else that the renderer reads.
+	memcpy(target->memory.vram, gb->memory.vram, sizeof(gb->memory.vram));
+	memcpy(target->memory.decoded_tiles, gb->memory.decoded_tiles, sizeof(gb->memory.decoded_tiles));
+	target->memory.oam = gb->memory.oam;
+	target->memory.sprite_buckets.valid = false;
+	gb_SetLayers(target, target->memory.layer_cache.layers);  // Marks everything dirty
+
+	const size_t num_logged_lines = display->log_end - display->log_begin;
+	memcpy(&target->display.line_log[display->log_begin], &display->line_log[display->log_begin],
+			num_logged_lines * sizeof(gb_LineRegisters));
+	target->display.log_begin = display->log_begin;
+	target->display.log_end = display->log_end;
+	display->log_begin = 0;
+	display->log_end = 0;
+
+	target->display.updated = true;
+	display->updated = false;
+	return true;
+}
+
+void
+gb_ComposeDeferredFrame(gb_GameBoy *target)
+{
+	gb__ComposeLoggedLines(target);
+}
+
 bool
 gb_FramebufferUpdated(gb_GameBoy *gb)
 {
 	bool result = gb->display.updated;
 	gb->display.updated = false;
+	if (result)
+	{
+		gb__ComposeLoggedLines(gb);
+	}
+	return result;
+}
+
+void
+gb_SetFramebufferFormat(gb_GameBoy *gb, gb_FramebufferFormat format)
+{
+	if (gb->display.format == GB_FRAMEBUFFER_FORMAT_INDEXED && format == GB_FRAMEBUFFER_FORMAT_RGB)
+	{
+		// The colors are stale, the following scan lines would only partially
+		// update them.
+		gb_ExpandIndexedFramebuffer(gb_GetIndexedFramebuffer(gb), gb->display.pixels);
+	}
+	gb->display.format = format;
+}
+
+gb_RowRange
+gb_FramebufferDirtyRows(gb_GameBoy *gb)
+{
+	const gb_RowRange result = gb->display.dirty_rows;
+	gb->display.dirty_rows = (gb_RowRange){ 0 };
 	return result;
 }
 
+gb_IndexedFramebuffer
+gb_GetIndexedFramebuffer(const gb_GameBoy *gb)
+{
+	return (gb_IndexedFramebuffer){
+		.width = GB_FRAMEBUFFER_WIDTH,
+		.height = GB_FRAMEBUFFER_HEIGHT,
+		.shades = gb->display.shades,
+	};
+}
+
+void
+gb_ExpandIndexedFramebuffer(gb_IndexedFramebuffer fb, gb_Color *pixels)
+{
+	gb__ExpandShades(fb.shades, pixels, (size_t)fb.width * fb.height);
+}
+
 uint32_t
 gb_MagFramebufferSizeInBytes(gb_MagFilter mag_filter)
 {
 	const uint32_t num_bytes = GB_FRAMEBUFFER_WIDTH * GB_FRAMEBUFFER_HEIGHT * sizeof(gb_Color);
 
+	// The filters need room for the colors of an indexed framebuffer at the end
+	// (see gb_MagFramebuffer).
 	switch (mag_filter)
 	{
 	case GB_MAG_FILTER_NONE:
 		return num_bytes;
 	case GB_MAG_FILTER_EPX_SCALE2X_ADVMAME2X:
 	case GB_MAG_FILTER_XBR2:
-		return num_bytes * (2 * 2);
+		return num_bytes * (2 * 2) + num_bytes;
 	case GB_MAG_FILTER_SCALE3X_ADVMAME3X_SCALEF:
-		return num_bytes * (3 * 3);
+		return num_bytes * (3 * 3) + num_bytes;
 	case GB_MAG_FILTER_SCALE4X_ADVMAME4X:
 		// Needs storage for the temporary intermediate buffer. Smarter people might
 		// be able to do it in place.
-		return gb_MagFramebufferSizeInBytes(GB_MAG_FILTER_EPX_SCALE2X_ADVMAME2X) + num_bytes * (4 * 4);
+		return num_bytes * (2 * 2) + num_bytes * (4 * 4) + num_bytes;
 	default:
 		assert(false);
 		return 0;
@@ -4951,16 +8389,26 @@ gb__MagFramebufferXbr2(const gb_Framebuffer input, gb_Color *pixels)
 gb_Framebuffer
 gb_MagFramebuffer(const gb_GameBoy *gb, gb_MagFilter mag_filter, gb_Color *pixels)
 {
-	const gb_Framebuffer input = {
+	gb_Framebuffer input = {
 		.width = GB_FRAMEBUFFER_WIDTH,
 		.height = GB_FRAMEBUFFER_HEIGHT,
 		.pixels = gb->display.pixels,
 	};
+	if (gb->display.format == GB_FRAMEBUFFER_FORMAT_INDEXED)
+	{
+		// The filters don't write the last GB_FRAMEBUFFER_WIDTH *
+		// GB_FRAMEBUFFER_HEIGHT pixels of 'pixels' (see
+		// gb_MagFramebufferSizeInBytes). Without a filter, that's all of them.
+		const size_t num_pixels = GB_FRAMEBUFFER_WIDTH * GB_FRAMEBUFFER_HEIGHT;
+		gb_Color *colors = pixels + gb_MagFramebufferSizeInBytes(mag_filter) / sizeof(gb_Color) - num_pixels;
+		gb_ExpandIndexedFramebuffer(gb_GetIndexedFramebuffer(gb), colors);
+		input.pixels = colors;
+	}
 
 	switch (mag_filter)
 	{
 	case GB_MAG_FILTER_NONE:
-		// Returns the internal pixel buffer.
+		// Returns the internal pixel buffer (or the expanded colors).
 		return input;
 	case GB_MAG_FILTER_EPX_SCALE2X_ADVMAME2X:
 		return gb__MagFramebufferEpxScale2xAdvMame2x(input, pixels);
@@ -6,6 +6,7 @@
 // clang -std=c11 -c gb.c
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define GB_FRAMEBUFFER_WIDTH 160
@@ -36,6 +37,12 @@ gb_MemoryReadWord(const gb_GameBoy *gb, uint16_t addr);
 void
 gb_Reset(gb_GameBoy *gb, bool skip_bios);
 
+// Points the GameBoy to another copy of the same ROM that it was loaded with,
+// e.g., after restoring a save state. Also required after a gb_GameBoy has been
+// copied or moved to a different address.
+void
+gb_RelocateRom(gb_GameBoy *gb, const uint8_t *rom);
+
 // A GameBoy assembly instruction.
 typedef struct gb_Instruction
 {
@@ -58,6 +65,30 @@ gb_FetchInstruction(const gb_GameBoy *gb, uint16_t addr);
 uint16_t
 gb_InstructionSize(gb_Instruction inst);
 
+// Number of entries in the decoded instruction cache (power of two).
+#define GB_DECODE_CACHE_SIZE 8192
+
+// Decoded instructions from the ROM, keyed by ROM offset (i.e., by bank and
+// address), so bank switches don't invalidate anything. The ROM never
+// changes, code in RAM is always decoded from scratch.
+typedef struct gb_DecodeCache
+{
+	struct
+	{
+		uint32_t tag;  // ROM offset + 1, 0 for empty entries.
+		gb_Instruction inst;
+	} entries[GB_DECODE_CACHE_SIZE];
+} gb_DecodeCache;
+
+// Optional, lets the CPU fetch instructions from ROM through 'cache' instead
+// of decoding them every time they are executed. Pass NULL to disable.
+// 'cache' is owned by the caller (it's derived data and not part of the
+// emulator's state). It's cleared when set and on reset. Like the audio
+// callback, it's kept across resets but has to be set again after restoring
+// a gb_GameBoy from a copy (e.g., a save state).
+void
+gb_SetDecodeCache(gb_GameBoy *gb, gb_DecodeCache *cache);
+
 // Disassembles 'inst' into 'str_buf'. Appends a NUL suffix.
 // A 32 byte buffer is sufficient for any instruction.
 // Returns the string length of the written disassembly (not counting the NUL suffix).
@@ -69,6 +100,64 @@ gb_DisassembleInstruction(gb_Instruction inst, char str_buf[], size_t str_buf_le
 size_t
 gb_ExecuteNextInstruction(gb_GameBoy *gb);
 
+// Optional conditions that make gb_RunCycles/gb_RunFrame return before the
+// cycle budget is used up. All conditions are checked after each instruction.
+typedef struct gb_StopConditions
+{
+	// Stop when the PC reaches any of these addresses (the instruction at the
+	// breakpoint has not been executed yet).
+	const uint16_t *breakpoints;
+	size_t num_breakpoints;
+	// Stop right after the PPU entered V-Blank, i.e., when a new frame is ready.
+	bool stop_at_vblank;
+} gb_StopConditions;
+
+typedef enum gb_StopReason
+{
+	GB_STOP_REASON_BUDGET,  // The cycle budget has been used up.
+	GB_STOP_REASON_BREAKPOINT,
+	GB_STOP_REASON_VBLANK,
+} gb_StopReason;
+
+typedef struct gb_RunResult
+{
+	size_t m_cycles;  // Number of machine cycles that have been emulated.
+	gb_StopReason stop_reason;
+} gb_RunResult;
+
+// Executes instructions until at least 'm_cycle_budget' machine cycles have
+// elapsed (the last instruction can overshoot the budget) or until one of the
+// 'stop_conditions' is met. 'stop_conditions' can be NULL.
+// Prefer this over calling gb_ExecuteNextInstruction in a loop, it keeps the
+// hot loop inside the emulator.
+gb_RunResult
+gb_RunCycles(gb_GameBoy *gb, size_t m_cycle_budget, const gb_StopConditions *stop_conditions);
+
+// Runs until the next frame has been completed (the PPU enters V-Blank) or one
+// frame worth of machine cycles has elapsed (the LCD might be off), whichever
+// comes first. 'stop_conditions' can be NULL.
+gb_RunResult
+gb_RunFrame(gb_GameBoy *gb, const gb_StopConditions *stop_conditions);
+
+// Optional just-in-time compiler that compiles blocks of ROM code to x86-64
+// code. The most common instructions are emitted inline, the others call the
+// interpreter's opcode handlers. Only available on x86-64 Linux if gb.c is built with GB_JIT=1,
+// gb_CreateJit returns NULL otherwise. A gb_Jit can be used with different
+// GameBoys and ROMs, but not by several threads at the same time.
+typedef struct gb_Jit gb_Jit;
+
+gb_Jit *
+gb_CreateJit(void);
+
+void
+gb_DestroyJit(gb_Jit *jit);
+
+// Same as gb_RunCycles (and with identical results) but runs ROM code through
+// the JIT. Falls back to gb_RunCycles if 'jit' is NULL or if there are
+// breakpoints.
+gb_RunResult
+gb_RunCyclesJit(gb_GameBoy *gb, gb_Jit *jit, size_t m_cycle_budget, const gb_StopConditions *stop_conditions);
+
 typedef enum gb_Input
 {
 	GB_INPUT_BUTTON_A,
@@ -84,30 +173,69 @@ typedef enum gb_Input
 void
 gb_SetInput(gb_GameBoy *gb, gb_Input input, bool down);
 
-// TODO(stefalie): To me it's still unclear what the best way is to do sound.
-// With SDL, we can either push or pull. Push seems simpler and that's what I did.
-// With pull end up storing sound clock states as floats (which is an ugly mess)
-// unless we rerecord audio samples during emulation and keep them in a buffer
-// until we can rerecord.
-// Push on the other hand just has to make sure that the audio queue is always
-// fed well enough. Just adding a small delay (few ms) in the beginning of the
-// audio buffer should guarantee that there won't be a buffer underrun.
-// Argentum and VBA too (I think ) use an approach where the sound controls the
-// blocking/waiting of the main loop. I'm not convinced that's the best solution.
-// A problem of the current implementation is that it sometimes becomes out of 
-// sync/delayed (not exactly sure why). If that happens one can save and reload
-// the game state to reset the audio queue.
+// The emulators calls the callback and provides interleaved stereo integer audio
+// samples at 48 kHz (see gb_SetAudioFormat).
+// The samples are delivered in chunks (see gb_SetAudioChunkSize), 'm_cycle' is
+// the emulated time of the first sample in m-cycles since the last reset.
 //
-// The emulators calls the callback and provides stereo 8-bit integer audio samples at 48 kHz.
+// NOTE: The emulation and the audio device never run at exactly the same rate.
+// If the samples are simply queued, the audio slowly drifts out of sync. The
+// SDL frontend passes them through a ring buffer that the audio device pulls
+// from and slightly resamples them depending on how full the ring is (see
+// PlayAudio in main.cpp).
 typedef void
-gb_AudioCallback(void *user_data, const int8_t *data, size_t len_in_bytes);
+gb_AudioCallback(void *user_data, const void *data, size_t len_in_bytes, uint64_t m_cycle);
 
 // Set the audio callback. With the speed multiplier shift you tell the APU that the
 // emulator is running faster/slower than in reality. For example -1 for half the speed,
 // 2 for 4 times the normal speed, 0 for normal speed.
+// Without a callback (NULL) no samples are synthesized at all, only the state
+// visible through the registers (e.g., the channel status in NR52) is kept up to date.
 void
 gb_SetAudioCallback(gb_GameBoy *gb, gb_AudioCallback *callback, void *user_data, int speed_multiplier_shift);
 
+// Sets how many stereo samples are buffered before the audio callback is called,
+// at most GB_AUDIO_MAX_CHUNK_SIZE. With GB_AUDIO_CHUNK_PER_FRAME (the default),
+// a chunk ends at each V-Blank (or when the buffer is full, e.g., while the LCD
+// is off). The setting is kept across resets.
+void
+gb_SetAudioChunkSize(gb_GameBoy *gb, uint16_t num_samples);
+
+#define GB_AUDIO_CHUNK_PER_FRAME 0
+#define GB_AUDIO_MAX_CHUNK_SIZE 2048
+
+typedef enum gb_AudioFormat
+{
+	GB_AUDIO_FORMAT_S8,  // int8_t, only uses [-32, 32]
+	GB_AUDIO_FORMAT_S16,  // int16_t in native byte order
+} gb_AudioFormat;
+
+// Selects the sample type passed to the audio callback. Default is
+// GB_AUDIO_FORMAT_S8, the format is kept across resets.
+void
+gb_SetAudioFormat(gb_GameBoy *gb, gb_AudioFormat format);
+
+typedef enum gb_AudioSynthesis
+{
+	GB_AUDIO_SYNTHESIS_POINT_SAMPLED,  // Samples the channels at 48 kHz, aliases
+	GB_AUDIO_SYNTHESIS_BAND_LIMITED,  // Band-limited steps, see below
+} gb_AudioSynthesis;
+
+// Selects how the channel outputs are turned into samples. Default is
+// GB_AUDIO_SYNTHESIS_POINT_SAMPLED, the setting is kept across resets.
+// In band-limited mode, each change of the mixer output is added as a
+// band-limited step at its exact m-cycle, and the samples are read out in bulk
+// at the end of each frame (or chunk, see gb_SetAudioChunkSize). This doesn't
+// alias, and the cost depends on how often the channel outputs change rather
+// than on the sampling rate. The output is delayed by 8 samples.
+void
+gb_SetAudioSynthesis(gb_GameBoy *gb, gb_AudioSynthesis synthesis);
+
+// Passes all buffered samples to the audio callback right away, e.g., before
+// stopping the emulation.
+void
+gb_FlushAudio(gb_GameBoy *gb);
+
 // Note that this is currently rather wasteful as we only support the monochrome
 // DMG. If we however decide to go for Color GameBoy support, this will make it
 // easy. It also allows to map the monochrome values to whatever RGB values we
@@ -135,9 +263,86 @@ gb_GetTile(gb_GameBoy *gb, uint8_t address_mode, uint8_t tile_index);
 gb_Tile
 gb_GetMapTile(gb_GameBoy *gb, uint8_t map_index, uint8_t address_mode, size_t tile_x, size_t tile_y);
 
+// Both tile maps decoded for both address modes, i.e., the full 256x256 pixel
+// background/window layers as color indices in [0, 3] (before applying BGP).
+typedef struct gb_Layers
+{
+	uint8_t pixels[2][2][256][256];  // [map_index][address_mode][y][x]
+} gb_Layers;
+
+// Optional, lets the PPU keep 'layers' up to date on VRAM writes and copy the
+// background and window of a scan line directly out of them instead of
+// fetching tile by tile. Pass NULL to disable.
+// 'layers' is owned by the caller (it's large and not part of the emulator's
+// state). Like the audio callback, it's kept across resets but has to be set
+// again after restoring a gb_GameBoy from a copy (e.g., a save state).
+void
+gb_SetLayers(gb_GameBoy *gb, gb_Layers *layers);
+
+// Returns the 256x256 color indices of a tile map (see gb_Layers) or NULL if
+// no layers are set.
+const uint8_t *
+gb_GetLayer(gb_GameBoy *gb, uint8_t map_index, uint8_t address_mode);
+
+// Only renders every ('num_skipped_frames' + 1)th frame, or none at all with
+// GB_FRAME_SKIP_ALL. For fast-forwarding and batch runs where most frames are
+// never looked at. The PPU timing (modes, LY/LYC, STAT and V-Blank interrupts,
+// the window line counter) is unaffected, only the pixels are not computed.
+// The framebuffer keeps the last rendered frame. Default is 0, the setting is
+// kept across resets.
+void
+gb_SetFrameSkip(gb_GameBoy *gb, uint8_t num_skipped_frames);
+
+#define GB_FRAME_SKIP_ALL 0xFF
+
+// The PPU registers that a scan line depends on, see gb_SetDeferredRendering.
+typedef struct gb_LineRegisters
+{
+	uint8_t lcdc;
+	uint8_t scx;
+	uint8_t scy;
+	uint8_t wx;
+	uint8_t wy;
+	uint8_t bgp;
+	uint8_t obp0;
+	uint8_t obp1;
+	uint8_t ly_win_internal;
+} gb_LineRegisters;
+
+// Optional, lets the PPU only log the registers of each scan line instead of
+// rendering it so that the frame can be composed later, e.g., on a worker
+// thread while the emulation continues (see gb_TakeDeferredFrame).
+// VRAM and OAM aren't logged. If they are written while there are logged lines,
+// these lines are composed right away (before the write), which makes the result
+// identical to rendering every line immediately.
+// Frames that aren't taken are composed when the next frame starts or by
+// gb_FramebufferUpdated, whichever comes first. The setting is kept across
+// resets.
+void
+gb_SetDeferredRendering(gb_GameBoy *gb, bool enable);
+
+// Hands the frame that has just been completed over to 'target', a second
+// gb_GameBoy that only serves as render target and holds the frame afterwards
+// (use gb_FramebufferUpdated, gb_MagFramebuffer, etc. on it). Copies the line
+// log, VRAM, OAM, and the lines that had to be composed already. Call it when
+// gb_RunCycles stops at V-Blank, before VRAM/OAM get modified for the next
+// frame. Use the same (initially zeroed) 'target' for all frames, the dirty rows
+// are tracked against its previous frame.
+// Returns false if there is no such frame (not in deferred mode, the frame was
+// skipped, or it has already been taken or composed).
+bool
+gb_TakeDeferredFrame(gb_GameBoy *gb, gb_GameBoy *target);
+
+// Composes the lines of a frame handed over with gb_TakeDeferredFrame.
+// Only accesses 'target', it can run on a different thread than the emulation.
+void
+gb_ComposeDeferredFrame(gb_GameBoy *target);
+
 // Returns true if a new frame has been fully rendered.
 // Use this to check if the emulator's texture should be updated.
 // Calling this will reset the emulator's internal "framebuffer updated" flag.
+// In deferred mode (see gb_SetDeferredRendering), the remaining lines of the
+// frame are composed first.
 bool
 gb_FramebufferUpdated(gb_GameBoy *gb);
 
@@ -148,6 +353,52 @@ typedef struct gb_Framebuffer
 	const gb_Color *pixels;
 } gb_Framebuffer;
 
+typedef enum gb_FramebufferFormat
+{
+	// The PPU writes the shades for every scan line and the colors for the
+	// ones whose shades changed (default).
+	GB_FRAMEBUFFER_FORMAT_RGB,
+	// The PPU only writes the shades, 1 byte instead of 4 per pixel. Colors are
+	// only computed when gb_MagFramebuffer is called.
+	GB_FRAMEBUFFER_FORMAT_INDEXED,
+} gb_FramebufferFormat;
+
+// Selects what the PPU writes per pixel. The format is kept across resets.
+void
+gb_SetFramebufferFormat(gb_GameBoy *gb, gb_FramebufferFormat format);
+
+// The framebuffer as shades (i.e., after applying BGP/OBP0/OBP1) in [0, 3],
+// 1 byte per pixel.
+typedef struct gb_IndexedFramebuffer
+{
+	uint16_t width;
+	uint16_t height;
+	const uint8_t *shades;
+} gb_IndexedFramebuffer;
+
+// A range of framebuffer rows [begin, end), empty if begin == end.
+typedef struct gb_RowRange
+{
+	uint8_t begin;
+	uint8_t end;
+} gb_RowRange;
+
+// Returns the rows of the framebuffer whose content changed since the last
+// call and resets the tracking. Use this to skip magnifying/uploading
+// identical frames and to only upload the rows that changed.
+// Everything is considered dirty after a reset.
+gb_RowRange
+gb_FramebufferDirtyRows(gb_GameBoy *gb);
+
+// Returns the internal shade buffer. Valid in all formats.
+gb_IndexedFramebuffer
+gb_GetIndexedFramebuffer(const gb_GameBoy *gb);
+
+// Converts shades to colors with the default palette. 'pixels' needs to hold
+// width * height colors.
+void
+gb_ExpandIndexedFramebuffer(gb_IndexedFramebuffer fb, gb_Color *pixels);
+
 // Magnification filters for the framebuffer
 // For general overview, see:
 // https://en.wikipedia.org/wiki/Pixel-art_scaling_algorithms
@@ -178,7 +429,8 @@ typedef enum gb_MagFilter
 	GB_MAG_FILTER_MAX_VALUE,
 } gb_MagFilter;
 
-// Returns the framebuffer size when using a specific magnification filter.
+// Returns the framebuffer size when using a specific magnification filter,
+// including the scratch space that gb_MagFramebuffer needs.
 uint32_t
 gb_MagFramebufferSizeInBytes(gb_MagFilter mag_filter);
 
@@ -189,6 +441,8 @@ gb_MaxMagFramebufferSizeInBytes(void);
 // TODO(stefalie): Magnification filters would be way faster in a shader.
 // Magnify 'gb's default framebuffer with a given filter and stores in user
 // provided buffer.
+// With GB_FRAMEBUFFER_FORMAT_INDEXED, the shades are first expanded to colors
+// in scratch space at the end of 'pixels'.
 gb_Framebuffer
 gb_MagFramebuffer(const gb_GameBoy *gb, gb_MagFilter mag_filter, gb_Color *pixels);
 
@@ -263,7 +517,7 @@ typedef struct gb_GameBoy
 			{
 				union
 				{
-					struct
+					struct gb_Flags
 					{
 						uint8_t _ : 4;
 						uint8_t carry : 1;
@@ -330,8 +584,42 @@ typedef struct gb_GameBoy
 		} interrupt;
 		bool stop;
 		bool halt;
+
+		// The flags in 'f' are not updated right away by the most common
+		// arithmetic instructions. Instead, the operation and its operands are
+		// recorded here and the flags are computed once they are read (branches,
+		// PUSH AF, DAA, etc.). 'f' is always up to date when the emulator
+		// returns from gb_ExecuteNextInstruction/gb_RunCycles.
+		struct gb_LazyFlags
+		{
+			uint8_t op;  // Last operation that sets all flags
+			uint8_t lhs;
+			uint8_t rhs;
+			uint8_t carry_in;
+			uint8_t inc_dec_op;  // INC/DEC after 'op', sets all flags but the carry
+			uint8_t inc_dec_result;
+		} lazy_flags;
 	} cpu;
 
+	// The PPU, the timer, and the APU are not advanced after every instruction.
+	// Each of them catches up with the CPU ('now') only once its next deadline
+	// has been reached or right before the CPU writes to one of its registers.
+	// All values are in machine cycles since the last reset.
+	struct gb_Scheduler
+	{
+		uint64_t now;
+		uint64_t next_event;  // Earliest of the deadlines below (can be too early, never too late).
+
+		uint64_t ppu_last_sync;
+		uint64_t ppu_deadline;
+		uint64_t timer_last_sync;
+		uint64_t timer_deadline;
+		uint64_t apu_last_sync;
+		uint64_t apu_deadline;
+	} scheduler;
+
+	gb_DecodeCache *decode_cache;  // See gb_SetDecodeCache
+
 	struct gb_Joypad
 	{
 		uint8_t buttons;
@@ -409,8 +697,21 @@ typedef struct gb_GameBoy
 	{
 		bool bios_mapped;
 		uint8_t wram[8192];  // 8 KiB
-		// TODO(stefalie): Consider caching the tiles for better performance.
 		uint8_t vram[8192];  // 8 KiB
+		// The 384 tiles in [0x8000, 0x9800) decoded to 1 byte per pixel (8 pixels
+		// per uint64_t line). Kept up to date by VRAM writes.
+		uint64_t decoded_tiles[384][8];
+
+		// See gb_SetLayers. The layers are brought up to date lazily, VRAM
+		// writes only mark the tiles and tile map entries they touch.
+		struct gb_LayerCache
+		{
+			gb_Layers *layers;
+			bool dirty;
+			bool all_dirty;
+			uint8_t dirty_tiles[384 / 8];  // Bit sets
+			uint8_t dirty_map_entries[2 * 1024 / 8];
+		} layer_cache;
 		uint8_t external_ram[8192 * 4];  // Up to 4 banks of 8 KiB each
 		uint8_t zero_page_ram[128];
 
@@ -420,6 +721,16 @@ typedef struct gb_GameBoy
 			uint8_t bytes[160];
 		} oam;  // Sprite attribute memory
 
+		// For each line, the indices of the (up to 10) sprites that are drawn on
+		// it, sorted by drawing priority (x position, then OAM index).
+		// Rebuilt lazily after OAM writes, DMA, or sprite size changes.
+		struct gb_SpriteBuckets
+		{
+			bool valid;
+			uint8_t num_sprites[GB_FRAMEBUFFER_HEIGHT];
+			uint8_t sprites[GB_FRAMEBUFFER_HEIGHT][10];
+		} sprite_buckets;
+
 		// Memory Bank Controller
 		gb_MbcType mbc_type;
 		bool mbc_external_ram_enable;
@@ -445,6 +756,19 @@ typedef struct gb_GameBoy
 				uint8_t rtc_regs[5];
 			} mbc3;
 		};
+		// ROM banks currently mapped to [0x0000, 0x4000) and [0x4000, 0x8000),
+		// resolved from the MBC registers above whenever they are written.
+		const uint8_t *rom_bank0;
+		const uint8_t *rom_bankx;
+
+		// Memory map with 4 KiB pages. Accesses to pages that are plain ROM/RAM
+		// go directly through these pointers. NULL means that the page needs
+		// special handling (BIOS, MBC registers, I/O, etc.).
+		// NOTE: Some pointers point into this struct. The map is rebuilt by
+		// gb_RelocateRom, so the only thing to remember after copying a
+		// gb_GameBoy around is to call that.
+		const uint8_t *read_pages[16];
+		uint8_t *write_pages[16];
 	} memory;
 
 	struct gb_Timer
@@ -471,11 +795,27 @@ typedef struct gb_GameBoy
 	struct gb_Display
 	{
 		bool updated;
+		uint32_t frame_count;  // Incremented whenever V-Blank is entered, wraps around.
+
+		gb_FramebufferFormat format;
+		uint8_t frame_skip;  // See gb_SetFrameSkip
 
 		// The original DMG only has 2 bits per pixel, but This makes it easy to
 		// map the framebuffer onto a texture (and there won't be anything to change
 		// if we ever support the Color GameBoy).
+		// Only up to date with GB_FRAMEBUFFER_FORMAT_RGB, see gb_MagFramebuffer.
 		gb_Color pixels[GB_FRAMEBUFFER_WIDTH * GB_FRAMEBUFFER_HEIGHT];
+		uint8_t shades[GB_FRAMEBUFFER_WIDTH * GB_FRAMEBUFFER_HEIGHT];  // In [0, 3]
+
+		// Rows whose shades changed since the last gb_FramebufferDirtyRows.
+		gb_RowRange dirty_rows;
+
+		// See gb_SetDeferredRendering. Lines [log_begin, log_end) of the current
+		// frame are logged but not composed yet, the ones before are composed.
+		bool deferred;
+		uint8_t log_begin;
+		uint8_t log_end;
+		gb_LineRegisters line_log[GB_FRAMEBUFFER_HEIGHT];
 	} display;
 
 	// TODO(stefalie): In retrospect, especially after having implemented the APU,
@@ -490,6 +830,23 @@ typedef struct gb_GameBoy
 		gb_AudioCallback *callback;
 		void *callback_user_data;
 
+		// Samples that haven't been passed to the callback yet, see
+		// gb_SetAudioChunkSize.
+		gb_AudioFormat format;
+		uint16_t chunk_size;
+		uint32_t chunk_frame_count;  // 'frame_count' of the display when the chunk was started
+		uint16_t num_buffered_samples;
+		uint64_t buffer_m_cycle;  // Of the first buffered sample
+		int16_t buffer[GB_AUDIO_MAX_CHUNK_SIZE * 2];  // Used as int8_t array with GB_AUDIO_FORMAT_S8
+
+		// Band-limited synthesis, see gb_SetAudioSynthesis. 'blip_deltas' holds the
+		// differences between consecutive samples, starting with the sample that
+		// is due when 'clock_acc' is 0.
+		gb_AudioSynthesis synthesis;
+		int blip_amplitudes[2];  // Mixer output at the last step
+		int32_t blip_sums[2];  // Output of the last sample read out, fixed point
+		int32_t blip_deltas[GB_AUDIO_MAX_CHUNK_SIZE + 32][2];
+
 		bool audio_enable;
 
 		union
@@ -672,7 +1029,7 @@ typedef struct gb_GameBoy
 			bool channel_enable;
 			gb_SoundTimeout timeout;
 			gb_SoundVolumeSweep volume_sweep;
-			uint16_t lfsr_timer;
+			uint32_t lfsr_timer;
 			uint16_t lfsr_state;
 
 			union
@@ -0,0 +1,345 @@
+// Copyright (C) 2022 Stefan Lienhard
+
+// Headless batch runner for the emulator core.
+//
+// Loads a ROM, runs it as fast as possible without any window, OpenGL, audio
+// device or GUI, and optionally dumps the last framebuffer and the produced
+// audio. Only depends on 'gb.c' and the C standard library so that it can be
+// built anywhere (see build_linux_x64.sh and build_win_x64.bat).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gb.h"
+
+static void
+PrintUsage(const char *exe_name)
+{
+	fprintf(stderr,
+			"Usage: %s <rom> [options]\n"
+			"Options:\n"
+			"  --frames <n>     Emulate n frames worth of m-cycles (default: 600).\n"
+			"  --cycles <n>     Emulate n m-cycles (overrides --frames).\n"
+			"  --skip-bios      Start directly at 0x0100 instead of running the BIOS.\n"
+			"  --fb <path>      Write the last completed frame as binary PPM (P6).\n"
+			"  --audio <path>   Write raw audio (stereo, signed 8-bit, %i Hz).\n"
+			"  --audio-s16      Write signed 16-bit audio instead.\n"
+			"  --band-limited   Use the band-limited audio synthesis.\n"
+			"  --frame-skip <n> Only render every (n + 1)th frame, 255 renders none.\n"
+			"  --layers         Render from incrementally updated tile map layers.\n"
+			"  --deferred       Compose frames from the per-line register log.\n"
+			"  --jit            Use the JIT (requires gb.c to be built with GB_JIT=1).\n"
+			"  --quiet          Don't print statistics.\n",
+			exe_name, GB_AUDIO_SAMPLING_RATE);
+}
+
+typedef struct AudioDump
+{
+	FILE *file;
+	uint64_t num_bytes;
+	uint64_t hash;
+} AudioDump;
+
+// 64-bit FNV-1a, used to quickly compare the output of different runs/builds.
+static const uint64_t fnv_offset_basis = 0xCBF29CE484222325ull;
+
+static uint64_t
+Fnv1a(uint64_t hash, const void *data, size_t num_bytes)
+{
+	const uint8_t *bytes = (const uint8_t *)data;
+	for (size_t i = 0; i < num_bytes; ++i)
+	{
+		hash ^= bytes[i];
+		hash *= 0x100000001B3ull;
+	}
+	return hash;
+}
+
+static void
+DumpAudio(void *user_data, const void *data, size_t len_in_bytes, uint64_t m_cycle)
+{
+	(void)m_cycle;
+	AudioDump *dump = (AudioDump *)user_data;
+	dump->num_bytes += len_in_bytes;
+	dump->hash = Fnv1a(dump->hash, data, len_in_bytes);
+	if (dump->file)
+	{
+		fwrite(data, 1, len_in_bytes, dump->file);
+	}
+}
+
+static bool
+WritePpm(const char *path, const gb_Color *pixels)
+{
+	FILE *file = fopen(path, "wb");
+	if (!file)
+	{
+		return true;
+	}
+
+	fprintf(file, "P6\n%i %i\n255\n", GB_FRAMEBUFFER_WIDTH, GB_FRAMEBUFFER_HEIGHT);
+	for (size_t i = 0; i < GB_FRAMEBUFFER_WIDTH * GB_FRAMEBUFFER_HEIGHT; ++i)
+	{
+		const uint8_t rgb[3] = { pixels[i].r, pixels[i].g, pixels[i].b };
+		fwrite(rgb, 1, sizeof(rgb), file);
+	}
+	fclose(file);
+	return false;
+}
+
+static double
+WallTimeInS(void)
+{
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int
+main(int argc, char *argv[])
+{
+	if (argc < 2)
+	{
+		PrintUsage(argv[0]);
+		return 1;
+	}
+
+	const char *rom_path = argv[1];
+	uint64_t num_frames = 600;
+	uint64_t num_m_cycles = 0;
+	bool skip_bios = false;
+	const char *fb_path = NULL;
+	const char *audio_path = NULL;
+	gb_AudioFormat audio_format = GB_AUDIO_FORMAT_S8;
+	gb_AudioSynthesis audio_synthesis = GB_AUDIO_SYNTHESIS_POINT_SAMPLED;
+	uint8_t frame_skip = 0;
+	bool use_layers = false;
+	bool deferred = false;
+	bool use_jit = false;
+	bool quiet = false;
+
+	for (int i = 2; i < argc; ++i)
+	{
+		const bool has_value = i + 1 < argc;
+		if (!strcmp(argv[i], "--frames") && has_value)
+		{
+			num_frames = strtoull(argv[++i], NULL, 10);
+		}
+		else if (!strcmp(argv[i], "--cycles") && has_value)
+		{
+			num_m_cycles = strtoull(argv[++i], NULL, 10);
+		}
+		else if (!strcmp(argv[i], "--skip-bios"))
+		{
+			skip_bios = true;
+		}
+		else if (!strcmp(argv[i], "--fb") && has_value)
+		{
+			fb_path = argv[++i];
+		}
+		else if (!strcmp(argv[i], "--audio") && has_value)
+		{
+			audio_path = argv[++i];
+		}
+		else if (!strcmp(argv[i], "--audio-s16"))
+		{
+			audio_format = GB_AUDIO_FORMAT_S16;
+		}
+		else if (!strcmp(argv[i], "--band-limited"))
+		{
+			audio_synthesis = GB_AUDIO_SYNTHESIS_BAND_LIMITED;
+		}
+		else if (!strcmp(argv[i], "--frame-skip") && has_value)
+		{
+			frame_skip = (uint8_t)strtoul(argv[++i], NULL, 10);
+		}
+		else if (!strcmp(argv[i], "--layers"))
+		{
+			use_layers = true;
+		}
+		else if (!strcmp(argv[i], "--deferred"))
+		{
+			deferred = true;
+		}
+		else if (!strcmp(argv[i], "--jit"))
+		{
+			use_jit = true;
+		}
+		else if (!strcmp(argv[i], "--quiet"))
+		{
+			quiet = true;
+		}
+		else
+		{
+			fprintf(stderr, "Error: unknown or incomplete option '%s'.\n", argv[i]);
+			PrintUsage(argv[0]);
+			return 1;
+		}
+	}
+	if (num_m_cycles == 0)
+	{
+		num_m_cycles = num_frames * GB_MACHINE_CYCLES_PER_FRAME;
+	}
+
+	// Load ROM
+	uint8_t *rom = NULL;
+	uint32_t rom_size = 0;
+	{
+		FILE *file = fopen(rom_path, "rb");
+		if (!file)
+		{
+			fprintf(stderr, "Error: can't open '%s'.\n", rom_path);
+			return 1;
+		}
+		fseek(file, 0, SEEK_END);
+		rom_size = (uint32_t)ftell(file);
+		fseek(file, 0, SEEK_SET);
+		rom = (uint8_t *)malloc(rom_size);
+		const size_t num_read = fread(rom, 1, rom_size, file);
+		fclose(file);
+		if (num_read != rom_size)
+		{
+			fprintf(stderr, "Error: can't read '%s'.\n", rom_path);
+			free(rom);
+			return 1;
+		}
+	}
+
+	// The GameBoy is too large to comfortably live on the stack.
+	gb_GameBoy *gb = (gb_GameBoy *)calloc(1, sizeof(gb_GameBoy));
+	if (gb_LoadRom(gb, rom, rom_size, skip_bios))
+	{
+		fprintf(stderr, "Error: '%s' is not a valid/supported GameBoy ROM.\n", rom_path);
+		free(gb);
+		free(rom);
+		return 1;
+	}
+
+	AudioDump audio = { .hash = fnv_offset_basis };
+	if (audio_path)
+	{
+		audio.file = fopen(audio_path, "wb");
+		if (!audio.file)
+		{
+			fprintf(stderr, "Error: can't open '%s'.\n", audio_path);
+			free(gb);
+			free(rom);
+			return 1;
+		}
+		gb_SetAudioCallback(gb, &DumpAudio, &audio, 0);
+		gb_SetAudioFormat(gb, audio_format);
+		gb_SetAudioSynthesis(gb, audio_synthesis);
+	}
+
+	// Keep a copy of the last completed frame. The internal framebuffer might
+	// be in the middle of being rendered when we stop.
+	// Only the shades are copied per frame, colors are computed once at the end.
+	gb_SetFramebufferFormat(gb, GB_FRAMEBUFFER_FORMAT_INDEXED);
+	gb_SetFrameSkip(gb, frame_skip);
+	gb_DecodeCache *decode_cache = (gb_DecodeCache *)malloc(sizeof(gb_DecodeCache));
+	gb_SetDecodeCache(gb, decode_cache);
+	gb_Layers *layers = NULL;
+	if (use_layers)
+	{
+		layers = (gb_Layers *)malloc(sizeof(gb_Layers));
+		gb_SetLayers(gb, layers);
+	}
+	// The frames are composed right away, but in the same way as a frontend
+	// would do it on a worker thread.
+	gb_GameBoy *render_target = NULL;
+	if (deferred)
+	{
+		gb_SetDeferredRendering(gb, true);
+		render_target = (gb_GameBoy *)calloc(1, sizeof(gb_GameBoy));
+	}
+	static uint8_t last_frame_shades[GB_FRAMEBUFFER_WIDTH * GB_FRAMEBUFFER_HEIGHT];
+	uint64_t num_completed_frames = 0;
+	uint64_t elapsed_m_cycles = 0;
+	const gb_StopConditions stop_conditions = { .stop_at_vblank = true };
+
+	gb_Jit *jit = NULL;
+	if (use_jit)
+	{
+		jit = gb_CreateJit();
+		if (!jit)
+		{
+			fprintf(stderr, "Warning: JIT not available, falling back to the interpreter.\n");
+		}
+	}
+
+	const double start_time = WallTimeInS();
+
+	while (elapsed_m_cycles < num_m_cycles)
+	{
+		const gb_RunResult result = gb_RunCyclesJit(gb, jit, num_m_cycles - elapsed_m_cycles, &stop_conditions);
+		elapsed_m_cycles += result.m_cycles;
+
+		if (result.stop_reason == GB_STOP_REASON_VBLANK)
+		{
+			// Skipped frames don't update the framebuffer.
+			if (render_target && gb_TakeDeferredFrame(gb, render_target))
+			{
+				gb_ComposeDeferredFrame(render_target);
+				const gb_IndexedFramebuffer fb = gb_GetIndexedFramebuffer(render_target);
+				memcpy(last_frame_shades, fb.shades, sizeof(last_frame_shades));
+			}
+			else if (gb_FramebufferUpdated(gb))
+			{
+				const gb_IndexedFramebuffer fb = gb_GetIndexedFramebuffer(gb);
+				memcpy(last_frame_shades, fb.shades, sizeof(last_frame_shades));
+			}
+			++num_completed_frames;
+		}
+	}
+
+	gb_FlushAudio(gb);
+	const double elapsed_s = WallTimeInS() - start_time;
+
+	static gb_Color last_frame[GB_FRAMEBUFFER_WIDTH * GB_FRAMEBUFFER_HEIGHT];
+	const gb_IndexedFramebuffer last_fb = {
+		.width = GB_FRAMEBUFFER_WIDTH,
+		.height = GB_FRAMEBUFFER_HEIGHT,
+		.shades = last_frame_shades,
+	};
+	gb_ExpandIndexedFramebuffer(last_fb, last_frame);
+
+	if (!quiet)
+	{
+		const double emulated_s = (double)elapsed_m_cycles / GB_MACHINE_M_FREQ;
+		printf("ROM:                '%s' (%s)\n", rom_path, gb->rom.name);
+		printf("Emulated m-cycles:  %llu (%.3f s)\n", (unsigned long long)elapsed_m_cycles, emulated_s);
+		printf("Completed frames:   %llu\n", (unsigned long long)num_completed_frames);
+		printf("Wall time:          %.3f s\n", elapsed_s);
+		printf("Speed:              %.2f MHz (%.1fx realtime)\n", elapsed_m_cycles / elapsed_s * 1e-6,
+				emulated_s / elapsed_s);
+		printf("Framebuffer hash:   %016llX\n",
+				(unsigned long long)Fnv1a(fnv_offset_basis, last_frame, sizeof(last_frame)));
+		if (audio_path)
+		{
+			printf("Audio bytes:        %llu\n", (unsigned long long)audio.num_bytes);
+			printf("Audio hash:         %016llX\n", (unsigned long long)audio.hash);
+		}
+	}
+
+	int result = 0;
+	if (fb_path && WritePpm(fb_path, last_frame))
+	{
+		fprintf(stderr, "Error: can't write '%s'.\n", fb_path);
+		result = 1;
+	}
+
+	if (audio.file)
+	{
+		fclose(audio.file);
+	}
+	gb_DestroyJit(jit);
+	free(layers);
+	free(decode_cache);
+	free(render_target);
+	free(gb);
+	free(rom);
+
+	return result;
+}
@@ -195,6 +195,52 @@ static const struct
 };
 static const size_t num_speed_options = sizeof(speed_options) / sizeof(speed_options[0]);
 
+// Decoded tile maps, shared by the renderer and the tilemap debug view.
+// Too large for the stack.
+static gb_Layers layers;
+
+// See gb_SetDecodeCache, too large for the stack as well.
+static gb_DecodeCache decode_cache;
+
+// Frames are composed on a worker thread while the emulation continues (see
+// gb_SetDeferredRendering).
+static struct
+{
+	gb_GameBoy target;  // Only used as render target, too large for the stack.
+	SDL_Thread *thread = NULL;
+	SDL_sem *start = NULL;
+	SDL_sem *done = NULL;
+	bool busy = false;  // Between handing a frame to the worker and waiting for it
+	bool quit = false;
+} composer;
+
+// Audio goes from the emulator (producer, see PlayAudio) to the SDL audio
+// thread (consumer, see PullAudio) through a lock-free single-producer
+// single-consumer ring of stereo frames. The positions only ever increase and
+// are wrapped when indexing, each one is only written by one side.
+//
+// The emulation and the audio device don't run at exactly the same rate. To
+// keep the latency constant, the producer resamples the audio by a fraction
+// of a percent depending on how full the ring is (dynamic rate control).
+// See: https://docs.libretro.com/development/cores/dynamic-rate-control/
+static const uint32_t audio_ring_size = 8192;  // Stereo frames, POT
+static const double audio_max_rate_delta = 0.005;
+static struct
+{
+	int16_t frames[audio_ring_size][2];
+	SDL_atomic_t write_pos;
+	SDL_atomic_t read_pos;
+	SDL_atomic_t flush;  // Set by the producer to drop all queued frames
+	uint32_t target_fill = 0;  // In frames, the latency aimed for
+
+	// Producer only
+	double resample_pos = 0.0;  // Of the next output frame, in input frames after 'prev_frame'
+	int16_t prev_frame[2] = {};
+
+	// Consumer only
+	bool buffering = true;  // Outputs silence until the ring is filled up to the target
+} audio_ring;
+
 static const size_t num_breakpoints = 4;
 static struct
 {
@@ -495,11 +541,11 @@ struct Emulator
 		bool fullscreen = false;
 
 		bool mag_filter_changed = true;
+		const gb_GameBoy *texture_source = NULL;
 		Speed speed_frame_multiplier = SPEED_DEFAULT;
 
 		bool exec_next_step = false;
 
-		gb_PpuMode prev_lcd_mode;
 		bool stop_at_vblank = false;
 
 		// TODO(stefalie): We might also want to store the previous state of pause
@@ -539,9 +585,119 @@ struct Emulator
 };
 
 static void
-PlayAudio(void *user_data, const int8_t *data, size_t len_in_bytes)
+PlayAudio(void *user_data, const void *data, size_t len_in_bytes, uint64_t m_cycle)
 {
-	SDL_QueueAudio(*(SDL_AudioDeviceID *)user_data, data, (uint32_t)len_in_bytes);
+	(void)user_data;
+	(void)m_cycle;
+	const int16_t(*input)[2] = (const int16_t(*)[2])data;
+	const size_t num_input_frames = len_in_bytes / sizeof(input[0]);
+
+	uint32_t write_pos = (uint32_t)SDL_AtomicGet(&audio_ring.write_pos);
+	const uint32_t read_pos = (uint32_t)SDL_AtomicGet(&audio_ring.read_pos);
+	const uint32_t fill = write_pos - read_pos;
+
+	// Input frames per output frame. Stretch the audio a little if the ring is
+	// less full than the target, compress it if it's fuller.
+	double fill_error = ((double)fill - audio_ring.target_fill) / audio_ring.target_fill;
+	fill_error = fill_error < -1.0 ? -1.0 : (fill_error > 1.0 ? 1.0 : fill_error);
+	const double step = 1.0 + audio_max_rate_delta * fill_error;
+
+	// Linear interpolation between consecutive input frames.
+	int16_t *prev_frame = audio_ring.prev_frame;
+	for (size_t i = 0; i < num_input_frames; ++i)
+	{
+		for (; audio_ring.resample_pos < 1.0; audio_ring.resample_pos += step)
+		{
+			// If the ring is full, the consumer is paused, drop the frame.
+			if (write_pos - read_pos < audio_ring_size)
+			{
+				const double t = audio_ring.resample_pos;
+				int16_t *output = audio_ring.frames[write_pos & (audio_ring_size - 1)];
+				output[0] = (int16_t)(prev_frame[0] + (input[i][0] - prev_frame[0]) * t);
+				output[1] = (int16_t)(prev_frame[1] + (input[i][1] - prev_frame[1]) * t);
+				++write_pos;
+			}
+		}
+		audio_ring.resample_pos -= 1.0;
+		prev_frame[0] = input[i][0];
+		prev_frame[1] = input[i][1];
+	}
+
+	SDL_AtomicSet(&audio_ring.write_pos, (int)write_pos);
+}
+
+// Called on the SDL audio thread.
+static void SDLCALL
+PullAudio(void *user_data, Uint8 *stream, int len)
+{
+	(void)user_data;
+	int16_t(*output)[2] = (int16_t(*)[2])stream;
+	const uint32_t num_output_frames = (uint32_t)len / sizeof(output[0]);
+
+	const uint32_t write_pos = (uint32_t)SDL_AtomicGet(&audio_ring.write_pos);
+	uint32_t read_pos = (uint32_t)SDL_AtomicGet(&audio_ring.read_pos);
+	if (SDL_AtomicCAS(&audio_ring.flush, 1, 0))
+	{
+		read_pos = write_pos;
+		audio_ring.buffering = true;
+	}
+
+	const uint32_t fill = write_pos - read_pos;
+	if (audio_ring.buffering && fill >= audio_ring.target_fill)
+	{
+		audio_ring.buffering = false;
+	}
+
+	uint32_t num_frames = 0;
+	if (!audio_ring.buffering)
+	{
+		num_frames = fill < num_output_frames ? fill : num_output_frames;
+		for (uint32_t i = 0; i < num_frames; ++i)
+		{
+			const int16_t *frame = audio_ring.frames[(read_pos + i) & (audio_ring_size - 1)];
+			output[i][0] = frame[0];
+			output[i][1] = frame[1];
+		}
+		read_pos += num_frames;
+
+		// Underrun, wait until the ring is filled up again.
+		if (num_frames < num_output_frames)
+		{
+			audio_ring.buffering = true;
+		}
+	}
+	memset(&output[num_frames], 0, (num_output_frames - num_frames) * sizeof(output[0]));
+
+	SDL_AtomicSet(&audio_ring.read_pos, (int)read_pos);
+}
+
+// Adapts audio and rendering to the current emulation speed.
+static void
+ApplySpeed(gb_GameBoy *gb, Emulator *emu)
+{
+	const Speed speed = emu->gui.speed_frame_multiplier;
+	gb_SetAudioCallback(gb, &PlayAudio, NULL, speed == SPEED_HALF ? -1 : speed);
+
+	// At turbo speeds, several GameBoy frames are run per SDL frame but only one
+	// of them is shown. Don't render the others.
+	gb_SetFrameSkip(gb, speed == SPEED_HALF ? 0 : (uint8_t)((1 << speed) - 1));
+}
+
+static int
+ComposeFrames(void *user_data)
+{
+	(void)user_data;
+	for (;;)
+	{
+		SDL_SemWait(composer.start);
+		if (composer.quit)
+		{
+			break;
+		}
+		gb_ComposeDeferredFrame(&composer.target);
+		SDL_SemPost(composer.done);
+	}
+	return 0;
 }
 
 static void
@@ -577,14 +733,19 @@ LoadGameState(gb_GameBoy *gb, Emulator *emu)
 		fread(gb, sizeof(gb_GameBoy), 1, file);
 		fclose(file);
 
-		// The ROM, audio callback and user data for it are the pointers.
-		// They need patching.
-		gb->rom.data = emu->rom.data;
-		gb_SetAudioCallback(gb, &PlayAudio, &emu->handles.audio_dev,
-				emu->gui.speed_frame_multiplier == 0xFF ? -1 : emu->gui.speed_frame_multiplier);
+		// The ROM, audio callback and user data for it, and the caches are
+		// pointers. They need patching.
+		gb_RelocateRom(gb, emu->rom.data);
+		ApplySpeed(gb, emu);
+		gb_SetLayers(gb, &layers);
+		gb_SetDecodeCache(gb, &decode_cache);
 
 		emu->gui.reset_delta_time = true;
 
+		// The dirty rows in the save state are unrelated to what's in the
+		// texture, force a full update.
+		emu->gui.mag_filter_changed = true;
+
 		// Disable all buttons (they might be considered pressed in saved state).
 		gb_SetInput(gb, GB_INPUT_BUTTON_A, false);
 		gb_SetInput(gb, GB_INPUT_BUTTON_B, false);
@@ -823,8 +984,7 @@ GuiDraw(Emulator *emu, gb_GameBoy *gb)
 									emu->gui.speed_frame_multiplier == speed_options[i].type))
 						{
 							emu->gui.speed_frame_multiplier = speed_options[i].type;
-							gb_SetAudioCallback(gb, &PlayAudio, &emu->handles.audio_dev,
-									emu->gui.speed_frame_multiplier == 0xFF ? -1 : emu->gui.speed_frame_multiplier);
+							ApplySpeed(gb, emu);
 						}
 					}
 					ImGui::EndMenu();
@@ -1198,17 +1358,31 @@ DebuggerDraw(Emulator *emu, gb_GameBoy *gb)
 			const int dim = dim_tiles * 8;
 			gb_Color img[dim][dim];
 
-			for (int ty = 0; ty < dim_tiles; ++ty)
+			// The renderer keeps the decoded tile map around anyway.
+			const uint8_t *layer =
+					gb_GetLayer(gb, (uint8_t)emu->debug.tilemap_index, (uint8_t)emu->debug.tilemap_addr_mode);
+			if (layer)
+			{
+				gb_IndexedFramebuffer layer_fb = {};
+				layer_fb.width = dim;
+				layer_fb.height = dim;
+				layer_fb.shades = layer;
+				gb_ExpandIndexedFramebuffer(layer_fb, &img[0][0]);
+			}
+			else
 			{
-				for (int tx = 0; tx < dim_tiles; ++tx)
+				for (int ty = 0; ty < dim_tiles; ++ty)
 				{
-					gb_Tile tile = gb_GetMapTile(
-							gb, (uint8_t)emu->debug.tilemap_index, (uint8_t)emu->debug.tilemap_addr_mode, tx, ty);
-
-					// For each line of current tile.
-					for (int y = 0; y < 8; ++y)
+					for (int tx = 0; tx < dim_tiles; ++tx)
 					{
-						memcpy(&img[ty * 8 + y][tx * 8], tile.pixels[y], sizeof(tile.pixels[y]));
+						gb_Tile tile = gb_GetMapTile(
+								gb, (uint8_t)emu->debug.tilemap_index, (uint8_t)emu->debug.tilemap_addr_mode, tx, ty);
+
+						// For each line of current tile.
+						for (int y = 0; y < 8; ++y)
+						{
+							memcpy(&img[ty * 8 + y][tx * 8], tile.pixels[y], sizeof(tile.pixels[y]));
+						}
 					}
 				}
 			}
@@ -1498,6 +1672,21 @@ static const char* fragment_shader_source =
 static void
 UpdateGameTexture(gb_GameBoy *gb, Emulator *cfg, GLuint texture, gb_Color *pixels)
 {
+	// The dirty rows are tracked per GameBoy. When switching between the
+	// emulator and the composer's render target, the whole texture is updated.
+	if (gb != cfg->gui.texture_source)
+	{
+		cfg->gui.texture_source = gb;
+		cfg->gui.mag_filter_changed = true;
+	}
+
+	// Nothing to do if the frame is identical to the one in the texture.
+	const gb_RowRange dirty_rows = gb_FramebufferDirtyRows(gb);
+	if (dirty_rows.begin == dirty_rows.end && !cfg->gui.mag_filter_changed)
+	{
+		return;
+	}
+
 	const gb_Framebuffer fb = gb_MagFramebuffer(gb, cfg->ini.mag_filter, pixels);
 	glBindTexture(GL_TEXTURE_2D, texture);
 	if (cfg->gui.mag_filter_changed)
@@ -1508,7 +1697,24 @@ UpdateGameTexture(gb_GameBoy *gb, Emulator *cfg, GLuint texture, gb_Color *pixel
 	}
 	else
 	{
-		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, fb.width, fb.height, GL_RGBA, GL_UNSIGNED_BYTE, fb.pixels);
+		// Only upload the rows that changed. The magnification filters look at
+		// neighboring pixels (up to 2 away for xBR), so the rows next to the
+		// dirty ones can change too.
+		const int margin = cfg->ini.mag_filter == GB_MAG_FILTER_NONE ? 0 : 2;
+		int begin = dirty_rows.begin - margin;
+		int end = dirty_rows.end + margin;
+		if (begin < 0)
+		{
+			begin = 0;
+		}
+		if (end > GB_FRAMEBUFFER_HEIGHT)
+		{
+			end = GB_FRAMEBUFFER_HEIGHT;
+		}
+
+		const int scale = fb.height / GB_FRAMEBUFFER_HEIGHT;
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, begin * scale, fb.width, (end - begin) * scale, GL_RGBA,
+				GL_UNSIGNED_BYTE, fb.pixels + begin * scale * fb.width);
 	}
 }
 
@@ -1545,10 +1751,10 @@ main(int argc, char *argv[])
 	// Sound
 	SDL_AudioSpec audio_req = {}, audio;
 	audio_req.freq = GB_AUDIO_SAMPLING_RATE;
-	audio_req.format = AUDIO_S8;
+	audio_req.format = AUDIO_S16SYS;
 	audio_req.channels = 2;
 	audio_req.samples = 1024;
-	audio_req.userdata = &gb;
+	audio_req.callback = &PullAudio;
 	emu.handles.audio_dev = SDL_OpenAudioDevice(NULL, 0, &audio_req, &audio, 0);
 	assert(audio.freq == GB_AUDIO_SAMPLING_RATE);
 	if (!emu.handles.audio_dev)
@@ -1556,12 +1762,21 @@ main(int argc, char *argv[])
 		SDL_CheckError();
 		exit(1);
 	}
-	gb_SetAudioCallback(&gb, &PlayAudio, &emu.handles.audio_dev,
-			emu.gui.speed_frame_multiplier == 0xFF ? -1 : emu.gui.speed_frame_multiplier);
-	SDL_ClearQueuedAudio(emu.handles.audio_dev);
-	// Add a tiny audio delay
-	int8_t silence[1024 * 2] = { 0 };
-	SDL_QueueAudio(emu.handles.audio_dev, silence, sizeof(silence));
+	// Enough to cover one callback of the device and some jitter of the main loop.
+	audio_ring.target_fill = 2u * audio.samples;
+	assert(audio_ring.target_fill < audio_ring_size);
+	ApplySpeed(&gb, &emu);
+	gb_SetAudioFormat(&gb, GB_AUDIO_FORMAT_S16);
+	gb_SetAudioSynthesis(&gb, GB_AUDIO_SYNTHESIS_BAND_LIMITED);
+	gb_SetLayers(&gb, &layers);
+	gb_SetDecodeCache(&gb, &decode_cache);
+	// Colors are only needed for the frames that end up in the texture, i.e., at
+	// most one per SDL frame (even fewer at turbo speeds).
+	gb_SetFramebufferFormat(&gb, GB_FRAMEBUFFER_FORMAT_INDEXED);
+	gb_SetDeferredRendering(&gb, true);
+	composer.start = SDL_CreateSemaphore(0);
+	composer.done = SDL_CreateSemaphore(0);
+	composer.thread = SDL_CreateThread(&ComposeFrames, "Compose Frames", NULL);
 
 	// Load ini
 	const char *ini_name = "config.ini";
@@ -1973,9 +2188,9 @@ main(int argc, char *argv[])
 		{
 			elapsed_m_cycles = 0;
 			emu.gui.reset_delta_time = false;
-			SDL_ClearQueuedAudio(emu.handles.audio_dev);
-			// Add a tiny audio delay
-			SDL_QueueAudio(emu.handles.audio_dev, silence, sizeof(silence));
+			// The queued audio belongs to the past, the consumer drops it and
+			// waits until the ring is filled up to the target again.
+			SDL_AtomicSet(&audio_ring.flush, 1);
 		}
 
 		emu.gui.show_gui_timeout_in_s -= (float)dt_in_s;
@@ -2028,57 +2243,88 @@ main(int argc, char *argv[])
 			// will be executed.
 			bool has_updated_fb = false;
 
+			// Breakpoints for debugging
+			//
+			// TODO(stefalie): If there is a breakpoint on 0x0100 and the BIOS
+			// is skipped, we unfortunately won't stop. But if the check happened
+			// before executing an instruction, we couldn't ever progress with 'space'.
+			uint16_t enabled_breakpoints[num_breakpoints];
+			gb_StopConditions stop_conditions = {};
+			stop_conditions.breakpoints = enabled_breakpoints;
+			if (emu.debug.show)
+			{
+				for (size_t i = 0; i < num_breakpoints; ++i)
+				{
+					if (breakpoints[i].enable)
+					{
+						enabled_breakpoints[stop_conditions.num_breakpoints++] = breakpoints[i].address;
+					}
+				}
+			}
+			// Always stop at V-Blank until the texture has been updated.
+			stop_conditions.stop_at_vblank = true;
+
 			while (m_cycle_acc > 0)
 			{
-				const size_t emulated_m_cycles = gb_ExecuteNextInstruction(&gb);
-				assert(emulated_m_cycles > 0);
-				m_cycle_acc -= emulated_m_cycles;
-				emu.debug.elapsed_m_cycles += emulated_m_cycles;
+				const gb_RunResult result = gb_RunCycles(&gb, (size_t)m_cycle_acc, &stop_conditions);
+				m_cycle_acc -= result.m_cycles;
+				emu.debug.elapsed_m_cycles += result.m_cycles;
 
-				if (gb_FramebufferUpdated(&gb) && !has_updated_fb)
+				if (result.stop_reason == GB_STOP_REASON_BREAKPOINT)
 				{
-					UpdateGameTexture(&gb, &emu, texture, pixels);
-					has_updated_fb = true;
+					emu.gui.pause = true;
+					break;
 				}
 
-				// TODO(stefalie): If there is a breakpoint on 0x0100 and the BIOS
-				// is skipped, we unfortunately won't stop. But if moved above,
-				// gb_ExecuteNextInstruction we can't ever progress with 'space'.
-				//
-				// Breakpoints for debugging
-				if (emu.debug.show)
+				if (result.stop_reason == GB_STOP_REASON_VBLANK)
 				{
-					for (size_t i = 0; i < num_breakpoints; ++i)
+					if (!has_updated_fb)
 					{
-						if (breakpoints[i].enable && gb.cpu.pc == breakpoints[i].address)
+						// The frame is composed while the remaining cycles of this SDL
+						// frame are emulated, the texture is updated further below.
+						assert(!composer.busy);
+						if (gb_TakeDeferredFrame(&gb, &composer.target))
+						{
+							SDL_SemPost(composer.start);
+							composer.busy = true;
+							has_updated_fb = true;
+						}
+						else if (gb_FramebufferUpdated(&gb))
 						{
-							emu.gui.pause = true;
-							goto exit;
+							UpdateGameTexture(&gb, &emu, texture, pixels);
+							has_updated_fb = true;
 						}
 					}
-				}
-
-				// TODO(stefalie): Retrospective NOTE to self for the case I'll
-				// ever implement another emulator: Make debugging/breaking an
-				// intergral part of the GameBoy/console library itself and don't
-				// only for the user/application side like here (it's too limiting).
 
-				// Break when new frame is shown.
-				const bool vlbank_rising_edge = emu.gui.prev_lcd_mode == GB_PPU_MODE_HBLANK &&
-						(gb_PpuMode)gb.ppu.stat.mode == GB_PPU_MODE_VBLANK;
-				emu.gui.prev_lcd_mode = (gb_PpuMode)gb.ppu.stat.mode;
+					// Break when new frame is shown.
+					if (emu.gui.stop_at_vblank)
+					{
+						emu.gui.pause = true;
+						emu.debug.show = true;
+						break;
+					}
 
-				if (emu.gui.stop_at_vblank && vlbank_rising_edge)
-				{
-					emu.gui.pause = true;
-					emu.debug.show = true;
-					goto exit;
+					// Skipped frames don't update the framebuffer, keep stopping
+					// until a rendered one has been taken.
+					if (has_updated_fb)
+					{
+						stop_conditions.stop_at_vblank = false;
+					}
 				}
 			}
-		exit:;
 		}
 		emu.gui.exec_next_step = false;
 
+		if (composer.busy)
+		{
+			SDL_SemWait(composer.done);
+			composer.busy = false;
+			if (gb_FramebufferUpdated(&composer.target))
+			{
+				UpdateGameTexture(&composer.target, &emu, texture, pixels);
+			}
+		}
+
 		// OpenGL drawing
 		int fb_width, fb_height;
 		SDL_GL_GetDrawableSize(emu.handles.window, &fb_width, &fb_height);
@@ -2189,6 +2435,12 @@ main(int argc, char *argv[])
 		}
 	}
 
+	composer.quit = true;
+	SDL_SemPost(composer.start);
+	SDL_WaitThread(composer.thread, NULL);
+	SDL_DestroySemaphore(composer.start);
+	SDL_DestroySemaphore(composer.done);
+
 	glDeleteTextures(1, &texture);
 
 	ImGui_ImplOpenGL2_Shutdown();